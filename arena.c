@@ -0,0 +1,167 @@
+/*****************************************************************************
+
+NAME
+   arena.c -- memory that lives exactly as long as one conversion.
+
+   Most of what the compiler allocates -- the data segments it collects,
+   the pixels among them, which image.c's buffers are made from -- is
+   needed until the file is done and not a moment longer.  Rather than
+   malloc and free each piece, and miss some, we carve them out of large
+   blocks with a bump pointer and give everything back at once with
+   arena_reset() when the file is done.
+
+   The blocks are kept for the next file.  A block is added, twice the
+   size of the last or as big as the request if that is bigger, when the
+   ones there are fill up; when more than one was needed, the reset
+   replaces them with a single block big enough for all that was used,
+   so a batch of similar files settles into one block and resetting is
+   a matter of rewinding a pointer.  A file that needed more than
+   ARENA_KEEP bytes doesn't get to keep them, so one huge image doesn't
+   pin its memory for the rest of a batch or the life of a server.
+
+   The most recent allocation can grow in place, which is how data
+   segments are collected; one that has a block to itself and outgrows
+   it takes the block along with realloc(), so a big image costs no more
+   than it did when it was collected with realloc() alone.  The arena
+   belongs to whichever thread is converting; nothing else may use it.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+#include "sng.h"
+
+#define ARENA_ALIGN	16		/* enough for anything malloc() gives */
+#define ARENA_MIN	(16 * 1024)	/* the first block */
+#define ARENA_KEEP	(16 * 1024 * 1024)	/* most kept between files */
+
+typedef struct arena_block
+{
+    struct arena_block	*next;
+    unsigned long	size;		/* bytes after the header */
+    unsigned long	used;
+}
+arena_block;
+
+/* the header is a multiple of the alignment, so the data after it is too */
+#define HEADER	((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define DATA(bp)	((char *)(bp) + HEADER)
+#define ROUND(n)	(((n) + ARENA_ALIGN - 1) & ~(unsigned long)(ARENA_ALIGN - 1))
+
+static arena_block *first, *current;	/* current is the one in use */
+static arena_block **link = &first;	/* what points at current */
+static void *last;			/* the most recent allocation */
+static unsigned long last_size;
+
+static arena_block *new_block(unsigned long size)
+{
+    arena_block *bp;
+    int was = mem_subsystem;
+
+    mem_subsystem = MEM_ARENA;
+    bp = xalloc(HEADER + size);
+    mem_subsystem = was;
+    bp->next = NULL;
+    bp->size = size;
+    bp->used = 0;
+    return(bp);
+}
+
+void *arena_alloc(unsigned long size)
+/* size bytes, aligned, that last until the next arena_reset() */
+{
+    arena_block *bp;
+    unsigned long need = ROUND(size ? size : 1);
+
+    if (need < size)
+	fatal("out of memory");
+    if (first == NULL)
+	first = current = new_block(need > ARENA_MIN ? need : ARENA_MIN);
+
+    /* blocks kept from the last file are used in turn */
+    while (current->size - current->used < need)
+    {
+	if (current->next == NULL || current->next->size < need)
+	{
+	    bp = new_block(need > 2 * current->size ? need : 2 * current->size);
+	    bp->next = current->next;
+	    current->next = bp;
+	}
+	link = &current->next;
+	current = current->next;
+    }
+    last = DATA(current) + current->used;
+    last_size = need;
+    current->used += need;
+    return(last);
+}
+
+void *arena_grow(void *p, unsigned long old, unsigned long size)
+/* p, of old bytes, made size bytes long, in place if it was the last */
+{
+    unsigned long need = ROUND(size);
+    arena_block *bp;
+    void *q;
+
+    if (p == NULL)
+	return(arena_alloc(size));
+    if (need < size)
+	fatal("out of memory");
+    if (p == last && (need <= last_size
+		      || need - last_size <= current->size - current->used))
+    {
+	current->used += need - last_size;
+	last_size = need;
+	return(p);
+    }
+    if (p == last && p == DATA(current) && need > last_size)
+    {
+	/* it has the block to itself, so the block can grow instead */
+	bp = mem_realloc(current, HEADER + need + need / 4);
+	if (bp == NULL)
+	    fatal("out of memory");
+	bp->size = need + need / 4;
+	bp->used = last_size = need;
+	*link = current = bp;
+	return(last = DATA(bp));
+    }
+    q = arena_alloc(size);
+    memcpy(q, p, old < size ? old : size);
+    return(q);
+}
+
+void arena_reset(void)
+/* give back everything allocated since the last reset */
+{
+    arena_block *bp, *next;
+    unsigned long total = 0;
+
+    if (first == NULL)
+	return;
+    if (current != first)
+    {
+	/* the blocks used last time become one, if they're worth keeping */
+	for (bp = first; bp; bp = next)
+	{
+	    next = bp->next;
+	    total += bp->used;
+	    xfree(bp);
+	}
+	first = current = NULL;
+	if (total <= ARENA_KEEP)
+	    first = current = new_block(total > ARENA_MIN ? total : ARENA_MIN);
+    }
+    else if (first->size > ARENA_KEEP)
+    {
+	xfree(first);
+	first = current = NULL;
+    }
+    else
+	first->used = 0;
+    link = &first;
+    last = NULL;
+    last_size = 0;
+}
+
+/* arena.c ends here */
@@ -0,0 +1,743 @@
+/*****************************************************************************
+
+NAME
+   batch.c -- overlap file I/O with conversion when given many files.
+
+   When sng is handed a list of files, a reader thread loads the next
+   few inputs into memory while the current one converts, and a writer
+   thread puts finished outputs on disk, so main() never waits on open,
+   read, write or close for the common case of many small files.  How
+   far ahead we go is the queue depth.  Where the kernel has io_uring,
+   each thread issues the opens, reads or writes and closes for a whole
+   queue's worth of files in one system call apiece; elsewhere they use
+   ordinary system calls.
+
+   Two things would make reading ahead give the wrong answer: an input
+   that an earlier conversion writes (`sng a.png a.sng'), and files a
+   bundle writes under names of its own.  The first kind of input is left
+   for main() to open after the writes are done; after a bundle, anything
+   already read is thrown away.  Inputs too large to be worth holding in
+   memory are also left to main(), which maps them, and so are pipes and
+   devices, which may come a piece at a time.
+
+*****************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "png.h"
+#include "sng.h"
+#include "config.h"
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#endif
+#endif
+
+#define MAX_PREFETCH	(16L * 1024 * 1024)	/* larger inputs are mapped */
+#define FIRST_READ	(64 * 1024)
+
+typedef struct
+{
+    char	*name;
+    int		direct;		/* main() opens it itself */
+    int		loaded;		/* has the reader been here? */
+    int		generation;	/* batch_invalidate() count when loaded */
+    int		error;		/* errno from loading, or 0 */
+    char	*data;
+    size_t	size;
+}
+input;
+
+typedef struct
+{
+    char	*name;
+    char	*data;
+    size_t	size;
+}
+output;
+
+/* members below `lock' are guarded by it */
+static struct {
+    input		*inputs;
+    int			ninputs;
+    int			depth;
+    input		**read_group;	/* the threads' working space */
+    output		*write_group;
+    pthread_t		reader, writer;
+    int			threads;	/* did they start? */
+
+    pthread_mutex_t	lock;
+    pthread_cond_t	changed;
+    int			next_load;	/* next input the reader takes */
+    int			consumed;	/* inputs main() has taken */
+    int			generation;
+    output		*outputs;	/* ring of depth queued outputs */
+    int			out_head, out_count, out_busy;
+    int			status;		/* worst write failure */
+    int			stopping;
+} batch;
+
+/*************************************************************************
+ *
+ * io_uring
+ *
+ * Just enough of it to run a batch of operations and wait for them all,
+ * without needing liburing.
+ *
+ ************************************************************************/
+
+#ifdef USE_IO_URING
+typedef struct
+{
+    int			fd;
+    unsigned		entries;
+    unsigned		*sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned		*cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe	*sqes;
+    struct io_uring_cqe	*cqes;
+    unsigned		pending;
+}
+ring;
+
+static int ring_init(ring *rp, unsigned entries)
+/* set up a ring; FALSE if the kernel won't give us one */
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+
+    memset(&p, '\0', sizeof(p));
+    if ((rp->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+	return(FALSE);
+    /* we need reads and writes at the file offset, which came with OPENAT */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))
+    {
+	close(rp->fd);
+	return(FALSE);
+    }
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      rp->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+	close(rp->fd);
+	return(FALSE);
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	cq = sq;
+    else if ((cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,
+			rp->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+	close(rp->fd);
+	return(FALSE);
+    }
+    rp->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    rp->fd, IORING_OFF_SQES);
+    if (rp->sqes == MAP_FAILED)
+    {
+	close(rp->fd);
+	return(FALSE);
+    }
+    rp->entries = p.sq_entries;
+    rp->sq_head = (unsigned *)(sq + p.sq_off.head);
+    rp->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    rp->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    rp->sq_array = (unsigned *)(sq + p.sq_off.array);
+    rp->cq_head = (unsigned *)(cq + p.cq_off.head);
+    rp->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    rp->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    rp->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    rp->pending = 0;
+    return(TRUE);
+}
+
+static struct io_uring_sqe *ring_sqe(ring *rp, int op, int fd,
+				     unsigned long long data)
+/* the next free submission entry, cleared and tagged with data */
+{
+    unsigned tail = *rp->sq_tail + rp->pending;
+    unsigned index = tail & *rp->sq_mask;
+    struct io_uring_sqe *sqe = &rp->sqes[index];
+
+    memset(sqe, '\0', sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    rp->sq_array[index] = index;
+    rp->pending++;
+    return(sqe);
+}
+
+static int ring_run(ring *rp, int *results)
+/* submit what's queued and wait for all of it; results by user_data */
+{
+    unsigned n = rp->pending, submit = n, done = 0, head;
+    long ret;
+
+    __atomic_store_n(rp->sq_tail, *rp->sq_tail + n, __ATOMIC_RELEASE);
+    rp->pending = 0;
+    while (done < n)
+    {
+	ret = syscall(__NR_io_uring_enter, rp->fd, submit, n - done,
+		      IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret >= 0)
+	    submit -= (ret < submit) ? ret : submit;
+	else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+	    return(FALSE);
+	head = *rp->cq_head;
+	while (head != __atomic_load_n(rp->cq_tail, __ATOMIC_ACQUIRE))
+	{
+	    struct io_uring_cqe *cqe = &rp->cqes[head & *rp->cq_mask];
+
+	    results[cqe->user_data] = cqe->res;
+	    head++;
+	    done++;
+	}
+	__atomic_store_n(rp->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return(TRUE);
+}
+#endif /* USE_IO_URING */
+
+/*************************************************************************
+ *
+ * Reading ahead
+ *
+ ************************************************************************/
+
+static void finish_read(input *ip, int fd, ssize_t got)
+/* read whatever the first read didn't get, and close up */
+{
+    if (got < 0)
+	ip->error = -got;
+    else
+    {
+	size_t room = FIRST_READ;
+
+	ip->size = got;
+	while (got > 0 && ip->size == room && room < MAX_PREFETCH)
+	{
+	    char *data = realloc(ip->data, room * 4);
+
+	    if (data == NULL)
+	    {
+		ip->error = ENOMEM;
+		break;
+	    }
+	    ip->data = data;
+	    room *= 4;
+	    while ((got = read(fd, ip->data + ip->size, room - ip->size)) > 0)
+		if ((ip->size += got) == room)
+		    break;
+	    if (got < 0)
+		ip->error = errno;
+	}
+	if (ip->size == room && room >= MAX_PREFETCH)
+	    ip->direct = TRUE;
+    }
+    if (ip->error || ip->direct || ip->size == 0)
+    {
+	free(ip->data);
+	ip->data = NULL;
+	if (ip->size == 0)
+	    ip->direct = TRUE;	/* fmemopen() won't take nothing */
+    }
+    close(fd);
+}
+
+static void load_plain(input **group, int n)
+/* load a group of inputs one call at a time */
+{
+    int i, fd;
+    ssize_t got;
+
+    for (i = 0; i < n; i++)
+	if ((fd = open(group[i]->name, O_RDONLY)) < 0)
+	    group[i]->error = errno;
+	else if ((group[i]->data = malloc(FIRST_READ)) == NULL)
+	    finish_read(group[i], fd, -ENOMEM);
+	else
+	{
+	    got = read(fd, group[i]->data, FIRST_READ);
+	    finish_read(group[i], fd, (got < 0) ? -errno : got);
+	}
+}
+
+#ifdef USE_IO_URING
+static ring read_ring, write_ring;
+static int have_read_ring, have_write_ring;
+static int *read_res, *read_fds, *write_res, *write_fds;
+
+static void load_ring(input **group, int n)
+/* load a group of inputs, with one system call for all the opens... */
+{
+    int *res = read_res, *fds = read_fds, i;
+    struct io_uring_sqe *sqe;
+
+    for (i = 0; i < n; i++)
+    {
+	sqe = ring_sqe(&read_ring, IORING_OP_OPENAT, AT_FDCWD, i);
+	sqe->addr = (unsigned long)group[i]->name;
+	sqe->open_flags = O_RDONLY;
+    }
+    if (!ring_run(&read_ring, fds))
+    {
+	have_read_ring = FALSE;
+	load_plain(group, n);
+	return;
+    }
+
+    /* ...one for the reads... */
+    for (i = 0; i < n; i++)
+	if (fds[i] < 0)
+	    group[i]->error = -fds[i];
+	else if ((group[i]->data = malloc(FIRST_READ)) == NULL)
+	{
+	    finish_read(group[i], fds[i], -ENOMEM);
+	    fds[i] = -1;
+	}
+	else
+	{
+	    sqe = ring_sqe(&read_ring, IORING_OP_READ, fds[i], i);
+	    sqe->addr = (unsigned long)group[i]->data;
+	    sqe->len = FIRST_READ;
+	    sqe->off = -1;		/* and move the file offset */
+	}
+    if (!ring_run(&read_ring, res))
+    {
+	/* some reads may have moved their offsets; start them all over */
+	have_read_ring = FALSE;
+	for (i = 0; i < n; i++)
+	    if (fds[i] >= 0 && (lseek(fds[i], 0L, SEEK_SET) < 0
+		|| (res[i] = read(fds[i], group[i]->data, FIRST_READ)) < 0))
+		res[i] = -errno;
+    }
+
+    /* ...and finish_read() mostly just closes */
+    for (i = 0; i < n; i++)
+	if (fds[i] >= 0)
+	    finish_read(group[i], fds[i], res[i]);
+}
+#endif /* USE_IO_URING */
+
+static void *reader(void *arg)
+/* read ahead of main(), keeping at most depth inputs in hand */
+{
+    input **group = arg;
+
+    pthread_mutex_lock(&batch.lock);
+    while (!batch.stopping && batch.next_load < batch.ninputs)
+    {
+	int n = 0, generation;
+
+	while (!batch.stopping
+	       && batch.next_load - batch.consumed >= batch.depth)
+	    pthread_cond_wait(&batch.changed, &batch.lock);
+	while (batch.next_load < batch.ninputs
+	       && batch.next_load - batch.consumed < batch.depth)
+	{
+	    input *ip = &batch.inputs[batch.next_load++];
+
+	    if (!ip->direct)
+		group[n++] = ip;
+	}
+	generation = batch.generation;
+	pthread_mutex_unlock(&batch.lock);
+
+#ifdef USE_IO_URING
+	if (have_read_ring)
+	    load_ring(group, n);
+	else
+#endif /* USE_IO_URING */
+	    load_plain(group, n);
+
+	pthread_mutex_lock(&batch.lock);
+	while (n-- > 0)
+	{
+	    group[n]->generation = generation;
+	    group[n]->loaded = TRUE;
+	}
+	pthread_cond_broadcast(&batch.changed);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    return NULL;
+}
+
+/*************************************************************************
+ *
+ * Writing behind
+ *
+ ************************************************************************/
+
+static void write_failed(output *op, int opening, int error)
+/* report a failure the way main() would have */
+{
+    if (opening)
+	fprintf(stderr, "sng: couldn't open %s for output (%d)\n",
+		op->name, error);
+    else
+	fprintf(stderr, "sng: couldn't write %s (%d)\n", op->name, error);
+    pthread_mutex_lock(&batch.lock);
+    batch.status = 1;
+    pthread_mutex_unlock(&batch.lock);
+}
+
+static void finish_write(output *op, int fd, ssize_t put)
+/* write whatever the first write didn't, and close up */
+{
+    size_t done = (put > 0) ? put : 0;
+
+    while (put >= 0 && done < op->size)
+	if ((put = write(fd, op->data + done, op->size - done)) > 0)
+	    done += put;
+	else if (put < 0 && errno == EINTR)
+	    put = 0;
+	else if (put == 0)
+	    put = -ENOSPC;
+	else
+	    put = -errno;
+    if (put < 0)
+	write_failed(op, FALSE, -put);
+    if (close(fd) != 0)
+	write_failed(op, FALSE, errno);
+}
+
+static void store_plain(output *group, int n)
+/* write a group of outputs one call at a time */
+{
+    int i, fd;
+
+    for (i = 0; i < n; i++)
+	if ((fd = open(group[i].name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	    write_failed(&group[i], TRUE, errno);
+	else
+	    finish_write(&group[i], fd, 0);
+}
+
+#ifdef USE_IO_URING
+static void store_ring(output *group, int n)
+/* write a group of outputs, a system call for each step */
+{
+    int *res = write_res, *fds = write_fds, i;
+    struct io_uring_sqe *sqe;
+
+    for (i = 0; i < n; i++)
+    {
+	sqe = ring_sqe(&write_ring, IORING_OP_OPENAT, AT_FDCWD, i);
+	sqe->addr = (unsigned long)group[i].name;
+	sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+	sqe->len = 0666;
+    }
+    if (!ring_run(&write_ring, fds))
+    {
+	have_write_ring = FALSE;
+	store_plain(group, n);
+	return;
+    }
+    for (i = 0; i < n; i++)
+    {
+	res[i] = 0;
+	if (fds[i] < 0)
+	    write_failed(&group[i], TRUE, -fds[i]);
+	else if (group[i].size)
+	{
+	    sqe = ring_sqe(&write_ring, IORING_OP_WRITE, fds[i], i);
+	    sqe->addr = (unsigned long)group[i].data;
+	    sqe->len = group[i].size;
+	    sqe->off = -1;		/* and move the file offset */
+	}
+    }
+    if (!ring_run(&write_ring, res))
+    {
+	/* some writes may have moved their offsets; start them all over */
+	have_write_ring = FALSE;
+	for (i = 0; i < n; i++)
+	    if (fds[i] >= 0 && lseek(fds[i], 0L, SEEK_SET) < 0)
+		res[i] = -errno;
+	    else
+		res[i] = 0;	/* finish_write() writes it all */
+    }
+    for (i = 0; i < n; i++)
+	if (fds[i] >= 0)
+	    finish_write(&group[i], fds[i], res[i]);
+}
+#endif /* USE_IO_URING */
+
+static void *writer(void *arg)
+/* put queued outputs on disk, a queue's worth at a time */
+{
+    output *group = arg;
+
+    pthread_mutex_lock(&batch.lock);
+    for (;;)
+    {
+	int n;
+
+	while (!batch.stopping && batch.out_count == 0)
+	    pthread_cond_wait(&batch.changed, &batch.lock);
+	if (batch.out_count == 0)
+	    break;
+	for (n = 0; batch.out_count > 0; n++, batch.out_count--)
+	{
+	    group[n] = batch.outputs[batch.out_head];
+	    batch.out_head = (batch.out_head + 1) % batch.depth;
+	}
+	batch.out_busy = n;
+	pthread_cond_broadcast(&batch.changed);
+	pthread_mutex_unlock(&batch.lock);
+
+#ifdef USE_IO_URING
+	if (have_write_ring)
+	    store_ring(group, n);
+	else
+#endif /* USE_IO_URING */
+	    store_plain(group, n);
+	while (n-- > 0)
+	{
+	    xfree(group[n].name);
+	    free(group[n].data);
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	batch.out_busy = 0;
+	pthread_cond_broadcast(&batch.changed);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    return NULL;
+}
+
+/*************************************************************************
+ *
+ * What main() sees
+ *
+ ************************************************************************/
+
+static int compare_names(const void *a, const void *b)
+/* order inputs by name, then by position */
+{
+    const input *ia = *(const input **)a, *ib = *(const input **)b;
+    int diff = strcmp(ia->name, ib->name);
+
+    return(diff ? diff : (ia < ib) ? -1 : (ia > ib));
+}
+
+static void mark_outputs(void)
+/*
+ * Leave main() inputs an earlier conversion writes, non-inputs, and
+ * anything but plain files: reading ahead takes a short read for the
+ * end of the file, which only a plain file promises.
+ */
+{
+    input **sorted = xalloc(batch.ninputs * sizeof(input *));
+    char outfile[BUFSIZ];
+    struct stat st;
+    int i, lo, hi, mid;
+
+    for (i = 0; i < batch.ninputs; i++)
+	sorted[i] = &batch.inputs[i];
+    qsort(sorted, batch.ninputs, sizeof(input *), compare_names);
+    for (i = 0; i < batch.ninputs; i++)
+    {
+	if (output_name(batch.inputs[i].name, outfile) < 0)
+	{
+	    batch.inputs[i].direct = TRUE;	/* main() won't open it */
+	    continue;
+	}
+	if (stat(batch.inputs[i].name, &st) == 0 && !S_ISREG(st.st_mode))
+	    batch.inputs[i].direct = TRUE;	/* a pipe, say */
+	for (lo = 0, hi = batch.ninputs; lo < hi; )
+	    if (strcmp(sorted[mid = (lo + hi) / 2]->name, outfile) < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	for (; lo < batch.ninputs && strcmp(sorted[lo]->name, outfile) == 0; lo++)
+	    if (sorted[lo] > &batch.inputs[i])
+		sorted[lo]->direct = TRUE;
+    }
+    xfree(sorted);
+}
+
+void batch_start(char **names, int n, int depth)
+/* begin reading ahead through the named files */
+{
+    int i;
+
+    memset(&batch, '\0', sizeof(batch));
+    batch.ninputs = n;
+    batch.depth = depth;
+    batch.inputs = xalloc(n * sizeof(input));
+    memset(batch.inputs, '\0', n * sizeof(input));
+    for (i = 0; i < n; i++)
+	batch.inputs[i].name = names[i];
+    mark_outputs();
+    batch.outputs = xalloc(depth * sizeof(output));
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+
+    batch.read_group = xalloc(depth * sizeof(input *));
+    batch.write_group = xalloc(depth * sizeof(output));
+
+#ifdef USE_IO_URING
+    read_res = xalloc(depth * sizeof(int));
+    read_fds = xalloc(depth * sizeof(int));
+    write_res = xalloc(depth * sizeof(int));
+    write_fds = xalloc(depth * sizeof(int));
+    have_read_ring = ring_init(&read_ring, depth);
+    have_write_ring = ring_init(&write_ring, depth);
+#endif /* USE_IO_URING */
+    if (pthread_create(&batch.reader, NULL, reader, batch.read_group) != 0)
+	return;
+    if (pthread_create(&batch.writer, NULL, writer, batch.write_group) != 0)
+    {
+	pthread_mutex_lock(&batch.lock);
+	batch.stopping = TRUE;
+	pthread_cond_broadcast(&batch.changed);
+	pthread_mutex_unlock(&batch.lock);
+	pthread_join(batch.reader, NULL);
+	return;
+    }
+    batch.threads = TRUE;
+}
+
+void batch_drain(void)
+/* wait until everything queued is on disk */
+{
+    pthread_mutex_lock(&batch.lock);
+    while (batch.out_count || batch.out_busy)
+	pthread_cond_wait(&batch.changed, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+}
+
+void batch_invalidate(void)
+/* files may have changed under us; don't trust anything already read */
+{
+    pthread_mutex_lock(&batch.lock);
+    batch.generation++;
+    pthread_mutex_unlock(&batch.lock);
+}
+
+FILE *batch_input(int n)
+/* open the nth input, which is the one after the last one asked for */
+{
+    input *ip = &batch.inputs[n];
+    int stale;
+    FILE *fp;
+
+    if (n > 0)
+    {
+	free(batch.inputs[n - 1].data);
+	batch.inputs[n - 1].data = NULL;
+    }
+    if (!batch.threads)
+	return(fopen(ip->name, "r"));
+
+    pthread_mutex_lock(&batch.lock);
+    batch.consumed = n;
+    pthread_cond_broadcast(&batch.changed);
+    while (!ip->direct && !ip->loaded)
+	pthread_cond_wait(&batch.changed, &batch.lock);
+    stale = (ip->generation != batch.generation);
+    batch.consumed = n + 1;
+    pthread_cond_broadcast(&batch.changed);
+    pthread_mutex_unlock(&batch.lock);
+
+    if (ip->direct || stale)
+    {
+	free(ip->data);
+	ip->data = NULL;
+	batch_drain();
+	return(fopen(ip->name, "r"));
+    }
+    if (ip->error)
+    {
+	errno = ip->error;
+	return(NULL);
+    }
+    if ((fp = fmemopen(ip->data, ip->size, "r")) == NULL)
+	return(fopen(ip->name, "r"));
+    return(fp);
+}
+
+void batch_output(char *name, char *data, size_t size)
+/* queue data to be written to the named file; we free data */
+{
+    output *op;
+
+    if (!batch.threads)
+    {
+	output out;
+	int fd;
+
+	out.name = name;
+	out.data = data;
+	out.size = size;
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	    write_failed(&out, TRUE, errno);
+	else
+	    finish_write(&out, fd, 0);
+	free(data);
+	return;
+    }
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.out_count == batch.depth)
+	pthread_cond_wait(&batch.changed, &batch.lock);
+    op = &batch.outputs[(batch.out_head + batch.out_count) % batch.depth];
+    op->name = xstrdup(name);
+    op->data = data;
+    op->size = size;
+    batch.out_count++;
+    pthread_cond_broadcast(&batch.changed);
+    pthread_mutex_unlock(&batch.lock);
+}
+
+int batch_finish(void)
+/* wait for the writes, stop the threads; returns 1 if a write failed */
+{
+    int i;
+
+    if (batch.threads)
+    {
+	pthread_mutex_lock(&batch.lock);
+	batch.stopping = TRUE;
+	pthread_cond_broadcast(&batch.changed);
+	pthread_mutex_unlock(&batch.lock);
+	pthread_join(batch.reader, NULL);
+	pthread_join(batch.writer, NULL);
+    }
+#ifdef USE_IO_URING
+    if (have_read_ring)
+	close(read_ring.fd);
+    if (have_write_ring)
+	close(write_ring.fd);
+    xfree(read_res);
+    xfree(read_fds);
+    xfree(write_res);
+    xfree(write_fds);
+#endif /* USE_IO_URING */
+    for (i = 0; i < batch.ninputs; i++)
+	free(batch.inputs[i].data);
+    xfree(batch.inputs);
+    xfree(batch.outputs);
+    xfree(batch.read_group);
+    xfree(batch.write_group);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.changed);
+    return(batch.status);
+}
+
+/* batch.c ends here */
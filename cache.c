@@ -0,0 +1,398 @@
+/*****************************************************************************
+
+NAME
+   cache.c -- skip conversions whose results we already have.
+
+   With --cache=DIR, each conversion in file mode is keyed by a 128-bit
+   hash of the input bytes together with everything else that decides
+   the output: the options, the sng, libpng and compression library
+   versions, the size and modification time of the rgb.txt that color
+   names come from, and for decompilation the input name, which the SNG
+   quotes.  A conversion that succeeds leaves a copy of its output in DIR
+   under that key; next time the same key comes up, the copy is put in
+   place and the input is never parsed.  Entries are written to a
+   temporary name and renamed, so several sngs may share a cache.
+
+   The compiler also keeps the IDAT chunks of each image it encodes in
+   DIR/idat, keyed by the pixels and the encoder settings, so an SNG
+   whose metadata alone has changed is compiled without compressing.
+
+*****************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "png.h"
+#include "sng.h"
+#include "config.h"
+
+char *cache_dir;
+
+static int hits, misses, stored;
+static char entry[BUFSIZ];		/* cache file for the current input */
+static int idat_hits, idat_misses;
+static char idat_entry[BUFSIZ];		/* and for the current image data */
+
+/*************************************************************************
+ *
+ * Hashing
+ *
+ * This is XXH64, run twice with different seeds for 128 bits, which is
+ * plenty to tell a few million files apart and still several gigabytes
+ * a second.  Words are read little-endian, as XXH64 specifies, so a
+ * hash is the same on every machine.  The seeds come from hashing a salt
+ * string, and data hashed a piece at a time is chained through them, so
+ * what we produce is sng's own and matches no xxhash tool's output.
+ *
+ ************************************************************************/
+
+#define P1	11400714785074694791ULL
+#define P2	14029467366897019727ULL
+#define P3	1609587929392839161ULL
+#define P4	9650029242287828579ULL
+#define P5	2870177450012600261ULL
+
+#define ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsigned long long get32(const unsigned char *p)
+{
+    return((unsigned long long)p[0] | (unsigned long long)p[1] << 8
+	   | (unsigned long long)p[2] << 16 | (unsigned long long)p[3] << 24);
+}
+
+static unsigned long long get64(const unsigned char *p)
+{
+    return((unsigned long long)get32(p)
+	   | (unsigned long long)get32(p + 4) << 32);
+}
+
+static unsigned long long round64(unsigned long long acc, unsigned long long in)
+{
+    acc += in * P2;
+    acc = ROTL(acc, 31);
+    return(acc * P1);
+}
+
+static unsigned long long merge64(unsigned long long acc, unsigned long long v)
+{
+    acc ^= round64(0, v);
+    return(acc * P1 + P4);
+}
+
+static unsigned long long xxh64(const unsigned char *p, size_t len,
+				unsigned long long seed)
+/* the 64-bit hash of len bytes at p */
+{
+    const unsigned char *end = p + len;
+    unsigned long long h;
+
+    if (len >= 32)
+    {
+	unsigned long long v1 = seed + P1 + P2, v2 = seed + P2;
+	unsigned long long v3 = seed, v4 = seed - P1;
+
+	do {
+	    v1 = round64(v1, get64(p));
+	    v2 = round64(v2, get64(p + 8));
+	    v3 = round64(v3, get64(p + 16));
+	    v4 = round64(v4, get64(p + 24));
+	    p += 32;
+	} while (p + 32 <= end);
+	h = ROTL(v1, 1) + ROTL(v2, 7) + ROTL(v3, 12) + ROTL(v4, 18);
+	h = merge64(h, v1);
+	h = merge64(h, v2);
+	h = merge64(h, v3);
+	h = merge64(h, v4);
+    }
+    else
+	h = seed + P5;
+    h += len;
+
+    for (; p + 8 <= end; p += 8)
+    {
+	h ^= round64(0, get64(p));
+	h = ROTL(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end)
+    {
+	h ^= get32(p) * P1;
+	h = ROTL(h, 23) * P2 + P3;
+	p += 4;
+    }
+    for (; p < end; p++)
+    {
+	h ^= *p * P5;
+	h = ROTL(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return(h);
+}
+
+void content_hash(const void *data, size_t len, const char *salt, char *hex)
+/* hash data and a salt string to 32 hex digits (and a NUL) at hex */
+{
+    unsigned long long s1 = xxh64((const unsigned char *)salt, strlen(salt), 0);
+    unsigned long long s2 = xxh64((const unsigned char *)salt, strlen(salt), P1);
+
+    sprintf(hex, "%016llx%016llx",
+	    xxh64(data, len, s1), xxh64(data, len, s2));
+}
+
+void content_hash_start(hash_state *hp, const char *salt)
+/*
+ * Begin hashing data that comes a piece at a time.  Each piece is hashed
+ * with the hash of those before it as the seed, so the result depends on
+ * how the data is divided as well as what it is.
+ */
+{
+    hp->h1 = xxh64((const unsigned char *)salt, strlen(salt), 0);
+    hp->h2 = xxh64((const unsigned char *)salt, strlen(salt), P1);
+}
+
+void content_hash_add(hash_state *hp, const void *data, size_t len)
+{
+    hp->h1 = xxh64(data, len, hp->h1);
+    hp->h2 = xxh64(data, len, hp->h2);
+}
+
+void content_hash_end(hash_state *hp, char *hex)
+/* the hash so far as 32 hex digits (and a NUL) at hex */
+{
+    sprintf(hex, "%016llx%016llx", hp->h1, hp->h2);
+}
+
+/*************************************************************************
+ *
+ * Entries
+ *
+ ************************************************************************/
+
+static int copy_file(char *from, char *to)
+/* copy a file by way of a temporary beside it; TRUE on success */
+{
+    char tmp[BUFSIZ + 16], buf[65536];
+    int in, out, ok = TRUE;
+    ssize_t n;
+
+    if ((in = open(from, O_RDONLY)) < 0)
+	return(FALSE);
+    sprintf(tmp, "%s.%ld~", to, (long)getpid());
+    if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+	close(in);
+	return(FALSE);
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+	if (write(out, buf, n) != n)
+	{
+	    ok = FALSE;
+	    break;
+	}
+    if (n < 0)
+	ok = FALSE;
+    close(in);
+    if (close(out) != 0 || !ok || rename(tmp, to) != 0)
+    {
+	unlink(tmp);
+	return(FALSE);
+    }
+    return(TRUE);
+}
+
+static int write_entry(char *to, const void *data, size_t len)
+/* write a file by way of a temporary beside it; TRUE on success */
+{
+    char tmp[BUFSIZ + 16];
+    FILE *fp;
+
+    sprintf(tmp, "%s.%ld~", to, (long)getpid());
+    if ((fp = fopen(tmp, "w")) == NULL)
+	return(FALSE);
+    if (fwrite(data, 1, len, fp) != len || fclose(fp) != 0
+	|| rename(tmp, to) != 0)
+    {
+	unlink(tmp);
+	return(FALSE);
+    }
+    return(TRUE);
+}
+
+static void make_parents(char *path)
+/* make the directories a cache entry goes in */
+{
+    char *cp;
+
+    for (cp = path; (cp = strchr(cp + 1, '/')) != NULL; )
+    {
+	*cp = '\0';
+	if (mkdir(path, 0777) != 0 && errno != EEXIST)
+	    fprintf(stderr, "sng: can't make cache directory %s (%d)\n",
+		    path, errno);
+	*cp = '/';
+    }
+}
+
+static char *cache_key(char *infile, int sng2png)
+/* everything besides the input bytes that shapes the output */
+{
+    static char key[BUFSIZ * 2];
+    struct stat st;
+
+    /* an edited color database changes what names come out, and go in */
+    if (stat(RGBTXT, &st) != 0)
+	st.st_size = st.st_mtime = 0;
+    sprintf(key, "sng %s/libpng %s/%s/%s %ld %ld/"
+	    "%s/%d %d %d %d %d %ld/%d %d %d %d/%s",
+	    VERSION, png_get_libpng_ver(NULL), deflate_backend(),
+	    RGBTXT, (long)st.st_size, (long)st.st_mtime,
+	    sng2png ? "compile" : "decompile",
+	    encoder.level, encoder.strategy, encoder.window_bits,
+	    encoder.mem_level, encoder.filters, encoder.idat_size,
+	    optimize, use_libpng, encoder_comment, idat,
+	    sng2png ? "" : infile);
+    return(key);
+}
+
+int cache_lookup(FILE *fpin, char *infile, char *outfile, int sng2png)
+/*
+ * Put the cached result of converting the newly opened fpin into outfile
+ * if there is one, returning TRUE.  Otherwise remember where cache_store()
+ * should put it, and leave fpin rewound.
+ */
+{
+    char hex[33], *data;
+    size_t len = 0, room = 65536, n;
+
+    entry[0] = '\0';
+    data = xalloc(room);
+    while ((n = fread(data + len, 1, room - len, fpin)) > 0)
+	if ((len += n) == room)
+	    data = xrealloc(data, room *= 2);
+    if (ferror(fpin) || fseek(fpin, 0L, SEEK_SET) != 0
+	|| strlen(cache_dir) > sizeof(entry) - 40
+	/* a bundle has outputs of its own */
+	|| (sng2png && len > 12 && memcmp(data, "#SNG: image ", 12) == 0))
+    {
+	xfree(data);
+	return(FALSE);
+    }
+    content_hash(data, len, cache_key(infile, sng2png), hex);
+    xfree(data);
+
+    sprintf(entry, "%s/%.2s/%s", cache_dir, hex, hex + 2);
+    if (access(entry, R_OK) == 0 && copy_file(entry, outfile))
+    {
+	hits++;
+	return(TRUE);
+    }
+    misses++;
+    return(FALSE);
+}
+
+void cache_store(char *outfile)
+/* keep a copy of the output cache_lookup() didn't have */
+{
+    if (!entry[0])
+	return;
+    make_parents(entry);
+    if (copy_file(outfile, entry))
+	stored++;
+    entry[0] = '\0';
+}
+
+void cache_store_data(const void *data, size_t len)
+/* the same, for output that isn't on disk yet */
+{
+    if (!entry[0])
+	return;
+    make_parents(entry);
+    if (write_entry(entry, data, len))
+	stored++;
+    entry[0] = '\0';
+}
+
+int idat_cache_lookup(png_const_bytep pixels, png_size_t size,
+		      const char *salt, membuf *idat)
+/*
+ * Fetch the IDAT chunks last made from these pixels with the settings
+ * in salt, returning TRUE.  Otherwise remember where idat_cache_store()
+ * should put them.
+ */
+{
+    char hex[33];
+    png_bytep cp;
+    png_size_t left, length;
+    FILE *fp;
+    long len;
+
+    idat_entry[0] = '\0';
+    if (strlen(cache_dir) > sizeof(idat_entry) - 48)
+	return(FALSE);
+    content_hash(pixels, size, salt, hex);
+    sprintf(idat_entry, "%s/idat/%.2s/%s", cache_dir, hex, hex + 2);
+
+    memset(idat, '\0', sizeof(membuf));
+    if ((fp = fopen(idat_entry, "r")) != NULL)
+    {
+	if (fseek(fp, 0L, SEEK_END) == 0 && (len = ftell(fp)) > 0)
+	{
+	    idat->data = xalloc(idat->room = len);
+	    rewind(fp);
+	    if (fread(idat->data, 1, len, fp) == len)
+		idat->size = len;
+	}
+	fclose(fp);
+    }
+
+    /* a damaged entry is just a miss */
+    for (cp = idat->data, left = idat->size; left >= 12; )
+    {
+	length = png_get_uint_32(cp);
+	if (memcmp(cp + 4, "IDAT", 4) != 0 || length > left - 12
+	    || chunk_crc(0, cp + 4, length + 4)
+	       != png_get_uint_32(cp + 8 + length))
+	    break;
+	cp += length + 12;
+	left -= length + 12;
+    }
+    if (idat->size == 0 || left != 0)
+    {
+	membuf_free(idat);
+	idat_misses++;
+	return(FALSE);
+    }
+    idat_entry[0] = '\0';
+    idat_hits++;
+    return(TRUE);
+}
+
+void idat_cache_store(membuf *idat)
+/* keep the IDAT chunks idat_cache_lookup() didn't have */
+{
+    if (!idat_entry[0] || idat->size == 0)
+	return;
+    make_parents(idat_entry);
+    write_entry(idat_entry, idat->data, idat->size);
+    idat_entry[0] = '\0';
+}
+
+void cache_report(void)
+/* hit and miss counts, for -v */
+{
+    printf("sng: cache %s: %d hits, %d misses, %d stored",
+	   cache_dir, hits, misses, stored);
+    if (idat_hits + idat_misses)
+	printf("; image data %d hits, %d misses", idat_hits, idat_misses);
+    putchar('\n');
+}
+
+/* cache.c ends here */
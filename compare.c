@@ -0,0 +1,540 @@
+/*****************************************************************************
+
+NAME
+   compare.c -- compare and digest the pixels of images, for --cmp and
+   --digest.
+
+   `sng --cmp A B' says whether two images, PNG or SNG in any mix, hold
+   the same pixels, however differently they are encoded.  Both are read
+   through libpng in lockstep, a row at a time, with every row expanded
+   to 16-bit RGBA -- palettes looked up, transparency made alpha, low bit
+   depths scaled up and gray made RGB -- so that the rows can be compared
+   with memcmp() and only a difference needs looking at closely.  Memory
+   stays at a row per image, except for an SNG file, which is compiled
+   in memory first, and an interlaced image, which is read whole.
+
+   Like cmp(1), we stop at the first difference and say where it is:
+   the pixel, the channel and the two values.  The values are 16-bit if
+   either image is, and 8-bit otherwise, so a sample of a 1, 2 or 4-bit
+   image is given scaled up to 8 bits, as it was compared, rather than
+   at its own depth.  With --cmp=all we carry on and count the samples
+   and pixels that differ as well.  The exit status is 0 if the pixels are
+   the same, 1 if they differ and 2 if either image couldn't be read.
+
+   Metadata is compared separately, a chunk at a time, by type, length
+   and CRC: the n-th chunk of each type in one image against the n-th of
+   that type in the other.  Chunks that differ or are in only one image
+   are reported whatever the pixels do, but don't affect the status.
+
+   `sng --digest FILE...' hashes the same normalized rows, led by the
+   width and height, with cache.c's hash, each row's hash seeding the
+   next's, so two files have the same digest just when --cmp would find
+   their pixels the same.  The chaining makes the digest sng's own: it
+   is neither XXH64 nor XXH3 of anything, and only other sngs' digests
+   are comparable with it.  With --digest=meta, the ancillary chunks,
+   framing and data, are hashed separately in the order they come.  No
+   SNG text is made, and the files are shared among serve.c's workers.
+   The digests go to standard output in the manner of md5sum(1); given
+   several files, those whose pixels are the same are listed together,
+   in the order the first of each appeared, with a blank line between
+   groups.  Digests depend on nothing but the image, so they can be
+   compared across machines.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "png.h"
+#include "sng.h"
+
+#define RGBA16	8		/* bytes in a normalized pixel */
+
+typedef struct
+{
+    png_byte		type[5];
+    png_uint_32		length;
+    png_uint_32		crc;
+}
+chunk_info;
+
+typedef struct
+{
+    char		*name;
+    FILE		*fp;
+    char		*compiled;	/* a compiled SNG file */
+    size_t		compiled_size;
+    png_structp		png;
+    png_infop		info;
+    png_uint_32		width, height;
+    int			bit_depth;
+    image_buffer	image;		/* all of an interlaced image */
+    png_bytep		row;		/* otherwise, one row */
+    png_uint_32		rows_read;
+
+    /* the chunks, as they go past */
+    chunk_info		*chunks;
+    int			nchunks;
+    png_byte		frame[12];	/* a chunk's header and CRC */
+    int			have;
+    png_uint_32		left;		/* bytes to skip before more framing */
+    int			hashing;	/* keeping this chunk for the digest? */
+    membuf		chunk;		/* if so, the chunk so far */
+    hash_state		metadata;
+}
+source;
+
+int digest_metadata;
+
+/*************************************************************************
+ *
+ * Reading, and watching the chunks go by
+ *
+ ************************************************************************/
+
+static void note_chunk(source *sp)
+/* file away the chunk whose framing is in sp->frame */
+{
+    chunk_info *cp;
+
+    if (memcmp(sp->frame + 4, "IDAT", 4) == 0
+	|| memcmp(sp->frame + 4, "IEND", 4) == 0)
+	return;
+    sp->chunks = xrealloc(sp->chunks, (sp->nchunks + 1) * sizeof(chunk_info));
+    cp = &sp->chunks[sp->nchunks++];
+    memcpy(cp->type, sp->frame + 4, 4);
+    cp->type[4] = '\0';
+    cp->length = png_get_uint_32(sp->frame);
+    cp->crc = png_get_uint_32(sp->frame + 8);
+}
+
+static void keep(membuf *mp, png_bytep data, png_size_t length)
+/* add to a chunk being kept for the metadata digest */
+{
+    if (mp->size + length > mp->room)
+	mp->data = xrealloc(mp->data, mp->room = 2 * (mp->size + length));
+    memcpy(mp->data + mp->size, data, length);
+    mp->size += length;
+}
+
+static void read_source(png_structp png, png_bytep data, png_size_t length)
+/* libpng read callback, keeping track of the chunk boundaries */
+{
+    source *sp = (source *)png_get_io_ptr(png);
+    png_size_t n;
+
+    if (fread(data, 1, length, sp->fp) != length)
+	png_error(png, "unexpected end of file");
+    while (length > 0)
+	if (sp->left)
+	{
+	    n = (sp->left < length) ? sp->left : length;
+	    if (sp->hashing)
+		keep(&sp->chunk, data, n);
+	    sp->left -= n;
+	    data += n;
+	    length -= n;
+	}
+	else
+	{
+	    sp->frame[sp->have++] = *data++;
+	    length--;
+	    if (sp->have == 8)
+	    {
+		sp->left = png_get_uint_32(sp->frame);
+
+		/* ancillary chunks are the ones with a lowercase type */
+		sp->hashing = digest_metadata && (sp->frame[4] & 0x20);
+		sp->chunk.size = 0;
+		if (sp->hashing)
+		    keep(&sp->chunk, sp->frame, 8);
+	    }
+	    else if (sp->have == 12)
+	    {
+		note_chunk(sp);
+		if (sp->hashing)
+		    content_hash_add(&sp->metadata, sp->chunk.data,
+				     sp->chunk.size);
+		sp->have = 0;
+	    }
+	}
+}
+
+static int open_source(source *sp, char *name)
+/* get ready to read an image's rows; FALSE if it can't be read */
+{
+    FILE *fpin, *fpout;
+    int c, status;
+
+    memset(sp, '\0', sizeof(source));
+    sp->name = name;
+    sp->left = 8;			/* the signature */
+    content_hash_start(&sp->metadata, "metadata");
+    if ((sp->fp = fopen(name, "r")) == NULL)
+    {
+	fprintf(stderr, "sng: couldn't open %s for input\n", name);
+	return(FALSE);
+    }
+
+    /* SNG is compiled first, and the PNG that makes read instead */
+    ungetc(c = getc(sp->fp), sp->fp);
+    if (c != EOF && isprint(c))
+    {
+	fpin = sp->fp;
+	sp->fp = NULL;
+	if ((fpout = open_memstream(&sp->compiled, &sp->compiled_size)) == NULL)
+	{
+	    fclose(fpin);
+	    return(FALSE);
+	}
+	status = convert_stream(fpin, name, fpout, FALSE);
+	fclose(fpout);
+	png_ptr = NULL;
+	info_ptr = NULL;
+	file = NULL;
+	if (status != 0 || sp->compiled_size == 0
+	    || (sp->fp = fmemopen(sp->compiled, sp->compiled_size, "r")) == NULL)
+	    return(FALSE);
+    }
+
+    if ((sp->png = mem_create_read_struct()) == NULL
+	|| (sp->info = png_create_info_struct(sp->png)) == NULL)
+	return(FALSE);
+    if (setjmp(png_jmpbuf(sp->png)))
+    {
+	fprintf(stderr, "sng: %s: can't read the image\n", name);
+	return(FALSE);
+    }
+    png_set_read_fn(sp->png, sp, read_source);
+    png_read_info(sp->png, sp->info);
+    sp->width = png_get_image_width(sp->png, sp->info);
+    sp->height = png_get_image_height(sp->png, sp->info);
+    sp->bit_depth = png_get_bit_depth(sp->png, sp->info);
+
+    /* everything becomes 16-bit RGBA */
+    png_set_expand(sp->png);
+    png_set_expand_16(sp->png);
+    png_set_gray_to_rgb(sp->png);
+    png_set_add_alpha(sp->png, 0xffff, PNG_FILLER_AFTER);
+    if (png_get_interlace_type(sp->png, sp->info) != PNG_INTERLACE_NONE)
+    {
+	png_set_interlace_handling(sp->png);
+	png_read_update_info(sp->png, sp->info);
+	if (!image_alloc(&sp->image, sp->height,
+			 png_get_rowbytes(sp->png, sp->info)))
+	    png_error(sp->png, "out of memory");
+	png_read_image(sp->png, sp->image.rows);
+    }
+    else
+    {
+	png_read_update_info(sp->png, sp->info);
+	sp->row = xalloc(png_get_rowbytes(sp->png, sp->info));
+    }
+    return(TRUE);
+}
+
+static png_bytep next_row(source *sp, png_uint_32 y)
+/* row y, normalized, or NULL if it can't be read */
+{
+    if (setjmp(png_jmpbuf(sp->png)))
+    {
+	fprintf(stderr, "sng: %s: can't read row %lu\n",
+		sp->name, (unsigned long)y);
+	return(NULL);
+    }
+    if (sp->image.rows)
+	return(sp->image.rows[y]);
+    png_read_row(sp->png, sp->row, NULL);
+    sp->rows_read++;
+    return(sp->row);
+}
+
+static void ignore_warning(png_structp png, png_const_charp message)
+{
+}
+
+static int finish_source(source *sp)
+/* read the chunks after the image; FALSE if they can't be read */
+{
+    if (setjmp(png_jmpbuf(sp->png)))
+	return(FALSE);
+
+    /* libpng complains of the image data we stopped reading */
+    if (sp->row && sp->rows_read < sp->height)
+	png_set_error_fn(sp->png, NULL, NULL, ignore_warning);
+    png_read_end(sp->png, NULL);
+    return(TRUE);
+}
+
+static void close_source(source *sp)
+{
+    if (sp->png)
+	png_destroy_read_struct(&sp->png, sp->info ? &sp->info : NULL, NULL);
+    if (sp->fp)
+	fclose(sp->fp);
+    if (sp->image.data)
+	image_free(&sp->image);
+    xfree(sp->row);
+    free(sp->compiled);
+    xfree(sp->chunks);
+    xfree(sp->chunk.data);
+}
+
+/*************************************************************************
+ *
+ * Comparison
+ *
+ ************************************************************************/
+
+static void compare_chunks(source *a, source *b)
+/* report chunks that differ, or that only one image has */
+{
+    int i, j, n, na, nb;
+
+    for (i = 0; i < a->nchunks; i++)
+    {
+	/* the n-th of its type in a, against the n-th in b */
+	for (n = 0, j = 0; j < i; j++)
+	    n += (strcmp((char *)a->chunks[j].type, (char *)a->chunks[i].type) == 0);
+	for (j = 0; j < b->nchunks; j++)
+	    if (strcmp((char *)b->chunks[j].type, (char *)a->chunks[i].type) == 0
+		&& n-- == 0)
+		break;
+	if (j == b->nchunks)
+	    printf("%s %s: %s chunk only in %s\n",
+		   a->name, b->name, a->chunks[i].type, a->name);
+	else if (a->chunks[i].length != b->chunks[j].length
+		 || a->chunks[i].crc != b->chunks[j].crc)
+	    printf("%s %s: %s chunks differ\n",
+		   a->name, b->name, a->chunks[i].type);
+    }
+
+    /* what's left over in b */
+    for (j = 0; j < b->nchunks; j++)
+    {
+	for (na = 0, i = 0; i < a->nchunks; i++)
+	    na += (strcmp((char *)a->chunks[i].type, (char *)b->chunks[j].type) == 0);
+	for (nb = 0, i = 0; i < j; i++)
+	    nb += (strcmp((char *)b->chunks[i].type, (char *)b->chunks[j].type) == 0);
+	if (nb >= na)
+	    printf("%s %s: %s chunk only in %s\n",
+		   a->name, b->name, b->chunks[j].type, b->name);
+    }
+}
+
+static png_size_t first_difference(png_bytep ra, png_bytep rb, png_size_t n)
+/* the offset of the first sample of n bytes that differs */
+{
+    png_size_t i;
+
+    for (i = 0; i < n && ra[i] == rb[i]; i++)
+	continue;
+    return(i & ~(png_size_t)1);
+}
+
+int compare(char *name_a, char *name_b, int all)
+/* compare two images' pixels, and their chunks; cmp(1)'s exit status */
+{
+    static const char *channels[] = {"red", "green", "blue", "alpha"};
+    source a, b;
+    png_bytep ra, rb;
+    png_size_t rowbytes, i, x;
+    png_uint_32 y;
+    unsigned long samples = 0, pixels = 0;
+    int status = 0, shift;
+
+    if (!open_source(&a, name_a) | !open_source(&b, name_b))
+	status = 2;
+    else if (a.width != b.width || a.height != b.height)
+    {
+	printf("%s %s differ: %lux%lu against %lux%lu\n", name_a, name_b,
+	       (unsigned long)a.width, (unsigned long)a.height,
+	       (unsigned long)b.width, (unsigned long)b.height);
+	status = 1;
+    }
+    else
+    {
+	/* values are reported as 16-bit samples if either image has them */
+	shift = (a.bit_depth > 8 || b.bit_depth > 8) ? 0 : 8;
+	rowbytes = (png_size_t)a.width * RGBA16;
+	for (y = 0; y < a.height && (status == 0 || all); y++)
+	{
+	    if ((ra = next_row(&a, y)) == NULL || (rb = next_row(&b, y)) == NULL)
+	    {
+		status = 2;
+		break;
+	    }
+	    if (memcmp(ra, rb, rowbytes) == 0)
+		continue;
+
+	    i = first_difference(ra, rb, rowbytes);
+	    if (status == 0)
+		printf("%s %s differ: pixel (%lu, %lu), %s, %u against %u\n",
+		       name_a, name_b,
+		       (unsigned long)(i / RGBA16), (unsigned long)y,
+		       channels[i % RGBA16 / 2],
+		       png_get_uint_16(ra + i) >> shift,
+		       png_get_uint_16(rb + i) >> shift);
+	    status = 1;
+	    if (!all)
+		break;
+	    for (x = i / RGBA16 * RGBA16; x < rowbytes; x += RGBA16)
+		if (memcmp(ra + x, rb + x, RGBA16))
+		{
+		    pixels++;
+		    for (i = x; i < x + RGBA16; i += 2)
+			samples += (ra[i] != rb[i] || ra[i + 1] != rb[i + 1]);
+		}
+	}
+	if (all && status == 1)
+	    printf("%s %s: %lu samples differ, in %lu pixels\n",
+		   name_a, name_b, samples, pixels);
+
+	/* the chunks after the image data are only seen at the end */
+	if (status < 2)
+	{
+	    if (!finish_source(&a) | !finish_source(&b))
+		status = 2;
+	    else
+		compare_chunks(&a, &b);
+	}
+    }
+    close_source(&a);
+    close_source(&b);
+    return(status);
+}
+
+/*************************************************************************
+ *
+ * Digests
+ *
+ ************************************************************************/
+
+int digest_file(char *name, FILE *fpout)
+/* hash one image's pixels, as a worker, writing the digests to fpout */
+{
+    source src;
+    png_bytep row;
+    png_byte size[8];
+    png_size_t rowbytes;
+    png_uint_32 y;
+    hash_state pixels;
+    char hex[33], meta[33];
+    int status = 1;
+
+    if (open_source(&src, name))
+    {
+	content_hash_start(&pixels, "pixels");
+	png_save_uint_32(size, src.width);
+	png_save_uint_32(size + 4, src.height);
+	content_hash_add(&pixels, size, sizeof(size));
+	rowbytes = (png_size_t)src.width * RGBA16;
+	for (y = 0; y < src.height; y++)
+	    if ((row = next_row(&src, y)) == NULL)
+		break;
+	    else
+		content_hash_add(&pixels, row, rowbytes);
+	if (y == src.height && finish_source(&src))
+	{
+	    content_hash_end(&pixels, hex);
+	    if (digest_metadata)
+	    {
+		content_hash_end(&src.metadata, meta);
+		fprintf(fpout, "%s %s  %s\n", hex, meta, name);
+	    }
+	    else
+		fprintf(fpout, "%s  %s\n", hex, name);
+	    status = 0;
+	}
+    }
+    close_source(&src);
+    return(status);
+}
+
+static char *collect(int w, int *failures)
+/* the line a worker wrote, or NULL if it failed */
+{
+    char *out = NULL;
+    size_t size;
+
+    if (pool_receive(w, &out, &size) != 0 || size == 0)
+    {
+	++*failures;
+	free(out);
+	return(NULL);
+    }
+    out[size] = '\0';		/* over what it said on stderr, now passed on */
+    return(out);
+}
+
+static char **lines;		/* what each worker said, by file */
+
+static int by_digest(const void *a, const void *b)
+/* order files by pixel digest, and those with the same one as given */
+{
+    int i = *(const int *)a, j = *(const int *)b;
+    int c = strncmp(lines[i], lines[j], 32);
+
+    return(c ? c : i - j);
+}
+
+static int by_first(const void *a, const void *b)
+/* order groups, each of which begins with its earliest file, as given */
+{
+    return(**(int *const *)a - **(int *const *)b);
+}
+
+int digest(int nfiles, char **files)
+/* digest every file among the workers, then list them by their pixels */
+{
+    int *workers = xalloc((nfiles + 1) * sizeof(int));
+    int *order = xalloc((nfiles + 1) * sizeof(int));
+    int **groups = xalloc((nfiles + 1) * sizeof(int *));
+    int sent, done, failures = 0, n = 0, ngroups = 0, i, w;
+    int *ip;
+
+    lines = xalloc((nfiles + 1) * sizeof(char *));
+    pool_start();
+    for (sent = done = 0; sent < nfiles; sent++)
+    {
+	while ((w = pool_send("digest", files[sent], files[sent],
+			      strlen(files[sent]))) < 0)
+	{
+	    lines[done] = collect(workers[done], &failures);
+	    done++;
+	}
+	workers[sent] = w;
+    }
+    for (; done < nfiles; done++)
+	lines[done] = collect(workers[done], &failures);
+    pool_stop();
+
+    /* the pixel digest leads each line, so sorting brings duplicates together */
+    for (i = 0; i < nfiles; i++)
+	if (lines[i])
+	    order[n++] = i;
+    qsort(order, n, sizeof(int), by_digest);
+    for (i = 0; i < n; i++)
+	if (i == 0 || strncmp(lines[order[i - 1]], lines[order[i]], 32) != 0)
+	    groups[ngroups++] = &order[i];
+    qsort(groups, ngroups, sizeof(int *), by_first);
+    order[n] = -1;
+    for (i = 0; i < ngroups; i++)
+    {
+	if (i > 0)
+	    putchar('\n');
+	ip = groups[i];
+	do
+	    fputs(lines[*ip], stdout);
+	while (*++ip >= 0 && strncmp(lines[*ip], lines[*groups[i]], 32) == 0);
+    }
+    for (i = 0; i < nfiles; i++)
+	free(lines[i]);
+    xfree(lines);
+    xfree(workers);
+    xfree(order);
+    xfree(groups);
+    return(failures > 0);
+}
+
+/* compare.c ends here */
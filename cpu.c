@@ -0,0 +1,256 @@
+/*****************************************************************************
+
+NAME
+   cpu.c -- choose the kernels this CPU runs best.
+
+   The row filters, the unfilterer and the chunk CRC come in variants
+   for different instruction sets.  Rather than have each one test the
+   CPU on every call, kernels_init() asks cpuid once, at startup, which
+   features the CPU and the operating system support, and points
+   `kernels' at the best set of variants that can run.  The sets are
+   cumulative, each needing what the one before it did and more:
+
+	scalar	portable C, and zlib's CRC
+	sse2	unfiltering a pixel at a time
+	sse4	the CRC by carry-less multiplication too
+	avx2	filtering and filter costs 16 or 32 bytes at a time too
+
+   Setting SNG_KERNELS in the environment to one of those names uses
+   that set instead, if the CPU can run it; that is how to test the
+   others, or rule them out when something looks wrong.  `sng -V' says
+   which set is in use, and `sng --check-kernels' runs every set the CPU
+   can against the scalar one and reports any difference.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+#include "sng.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <cpuid.h>
+#endif
+
+static const kernel_set kernel_sets[] = {
+    {"scalar", 0, filter_costs_scalar, filter_row_scalar,
+     unfilter_row_scalar, chunk_crc_scalar},
+#ifdef X86_KERNELS
+    {"sse2", CPU_SSE2, filter_costs_scalar, filter_row_scalar,
+     unfilter_row_sse2, chunk_crc_scalar},
+    {"sse4", CPU_SSE2 | CPU_SSE41 | CPU_PCLMUL, filter_costs_scalar,
+     filter_row_scalar, unfilter_row_sse2, chunk_crc_pclmul},
+    {"avx2", CPU_SSE2 | CPU_SSE41 | CPU_PCLMUL | CPU_AVX2, filter_costs_avx2,
+     filter_row_avx2, unfilter_row_sse2, chunk_crc_pclmul},
+#endif /* X86_KERNELS */
+};
+#define NSETS	(sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+/* the scalar set until kernels_init() knows better */
+const kernel_set *kernels = &kernel_sets[0];
+
+static int cpu_features;
+
+static int cpu_detect(void)
+/* the CPU_* features both the processor and the kernel support */
+{
+    int features = 0;
+#ifdef X86_KERNELS
+    unsigned int eax, ebx, ecx, edx, xcr0 = 0, xcr0_high;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	return(0);
+    if (edx & bit_SSE2)
+	features |= CPU_SSE2;
+    if (ecx & bit_SSE4_1)
+	features |= CPU_SSE41;
+    if (ecx & bit_SSE4_2)
+	features |= CPU_SSE42;
+    if (ecx & bit_PCLMUL)
+	features |= CPU_PCLMUL;
+
+    /* the wide registers are no use unless the kernel saves them */
+    if (ecx & bit_OSXSAVE)
+	__asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+    if ((xcr0 & 0x06) == 0x06
+	&& __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+	if (ebx & bit_AVX2)
+	    features |= CPU_AVX2;
+	if ((xcr0 & 0xe6) == 0xe6
+	    && (ebx & bit_AVX512F) && (ebx & bit_AVX512BW))
+	    features |= CPU_AVX512;
+    }
+#endif /* X86_KERNELS */
+    return(features);
+}
+
+static int runs(const kernel_set *kp)
+{
+    return((kp->needs & cpu_features) == kp->needs);
+}
+
+void kernels_init(void)
+/* pick the best kernels this CPU runs, or the ones SNG_KERNELS names */
+{
+    const char *want = getenv("SNG_KERNELS");
+    const kernel_set *kp, *named = NULL;
+
+    cpu_features = cpu_detect();
+    for (kp = kernel_sets; kp < kernel_sets + NSETS; kp++)
+    {
+	if (runs(kp))
+	    kernels = kp;
+	if (want && strcmp(want, kp->name) == 0)
+	    named = kp;
+    }
+    if (want == NULL || *want == '\0')
+	return;
+    if (named == NULL)
+    {
+	fprintf(stderr, "sng: SNG_KERNELS=%s isn't one of", want);
+	for (kp = kernel_sets; kp < kernel_sets + NSETS; kp++)
+	    fprintf(stderr, " %s", kp->name);
+	fprintf(stderr, "; using %s\n", kernels->name);
+    }
+    else if (!runs(named))
+	fprintf(stderr, "sng: this CPU can't run the %s kernels; using %s\n",
+		named->name, kernels->name);
+    else
+	kernels = named;
+}
+
+const char *cpu_description(void)
+/* the features we look for that this CPU has, for -V */
+{
+    static const struct {int bit; const char *name;} names[] = {
+	{CPU_SSE2, "sse2"}, {CPU_SSE41, "sse4.1"}, {CPU_SSE42, "sse4.2"},
+	{CPU_PCLMUL, "pclmul"}, {CPU_AVX2, "avx2"}, {CPU_AVX512, "avx512"},
+    };
+    static char buf[64];
+    int i;
+
+    buf[0] = '\0';
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+	if (cpu_features & names[i].bit)
+	    strcat(strcat(buf, buf[0] ? " " : ""), names[i].name);
+    return(buf[0] ? buf : "none of the extensions sng uses");
+}
+
+/*****************************************************************************
+ *
+ * Checking the variants against each other
+ *
+ *****************************************************************************/
+
+#define CHECK_ROW	1100		/* longest row tried */
+
+static unsigned long seed;
+
+static int noise(void)
+/* a fixed pseudorandom byte sequence */
+{
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return((int)(seed >> 33) & 0xff);
+}
+
+static void fill(png_bytep p, png_size_t n, int extremes)
+/* random bytes, or with extremes just 0s and 255s, the worst for costs */
+{
+    png_size_t i;
+
+    for (i = 0; i < n; i++)
+	p[i] = extremes ? ((noise() & 1) ? 0xff : 0x00) : noise();
+}
+
+static int differs(const kernel_set *kp, const char *what,
+		   int type, int bpp, png_size_t n)
+{
+    fprintf(stderr, "sng: %s %s differs from scalar", kp->name, what);
+    if (type >= 0)
+	fprintf(stderr, " for filter type %d", type);
+    if (bpp)
+	fprintf(stderr, " at %d bytes per pixel", bpp);
+    fprintf(stderr, " on %lu bytes\n", (unsigned long)n);
+    return(1);
+}
+
+static int check_set(const kernel_set *kp)
+/* compare one set with the scalar kernels; the number of differences */
+{
+    const kernel_set *sp = &kernel_sets[0];
+    static png_byte row[CHECK_ROW], prev[CHECK_ROW];
+    static png_byte want[CHECK_ROW], got[CHECK_ROW];
+    png_uint_32 want_cost[FILTER_COUNT], got_cost[FILTER_COUNT];
+    png_uint_32 want_crc, got_crc;
+    png_size_t n, off;
+    int bpp, type, extremes, failures = 0;
+
+    for (extremes = 0; extremes < 2; extremes++)
+	for (n = 1; n < CHECK_ROW; n += (n < 300) ? 1 : 97)
+	    for (bpp = 1; bpp <= 8; bpp++)
+	    {
+		fill(row, n, extremes);
+		fill(prev, n, extremes);
+
+		memset(want_cost, '\0', sizeof(want_cost));
+		memset(got_cost, '\0', sizeof(got_cost));
+		sp->costs(row, prev, n, bpp, want_cost);
+		kp->costs(row, prev, n, bpp, got_cost);
+		if (memcmp(want_cost, got_cost, sizeof(want_cost)))
+		    failures += differs(kp, "filter costs", -1, bpp, n);
+
+		for (type = 0; type < FILTER_COUNT; type++)
+		{
+		    sp->filter(type, want, row, prev, n, bpp);
+		    kp->filter(type, got, row, prev, n, bpp);
+		    if (memcmp(want, got, n))
+			failures += differs(kp, "filter", type, bpp, n);
+
+		    memcpy(want, row, n);
+		    memcpy(got, row, n);
+		    sp->unfilter(type, want, prev, n, bpp);
+		    kp->unfilter(type, got, prev, n, bpp);
+		    if (memcmp(want, got, n))
+			failures += differs(kp, "unfilter", type, bpp, n);
+		}
+	    }
+
+    /* every length, from every alignment */
+    fill(row, CHECK_ROW, FALSE);
+    for (n = 0; n < 600; n++)
+	for (off = 0; off < 16; off++)
+	{
+	    png_uint_32 crc = (png_uint_32)seed;
+
+	    want_crc = sp->crc(crc, row + off, n);
+	    got_crc = kp->crc(crc, row + off, n);
+	    if (want_crc != got_crc)
+		failures += differs(kp, "CRC", -1, 0, n);
+	}
+    return(failures);
+}
+
+int kernels_check(void)
+/* compare every set this CPU runs with the scalar one; 1 if any differ */
+{
+    const kernel_set *kp;
+    int failures = 0, n;
+
+    for (kp = kernel_sets + 1; kp < kernel_sets + NSETS; kp++)
+	if (runs(kp))
+	{
+	    seed = 1;
+	    failures += (n = check_set(kp));
+	    if (verbose && n == 0)
+		fprintf(stderr, "sng: the %s kernels match the scalar ones\n",
+			kp->name);
+	}
+	else if (verbose)
+	    fprintf(stderr, "sng: this CPU can't run the %s kernels\n",
+		    kp->name);
+    return(failures > 0);
+}
+
+/* cpu.c ends here */
@@ -0,0 +1,109 @@
+/*****************************************************************************
+
+NAME
+   decode.c -- decode the image data of common PNG types without libpng.
+
+   For non-interlaced 8-bit grayscale, RGB, RGBA and colormapped images,
+   sngd hands us the IDAT data in one piece.  We inflate it in one go
+   into the end of an image buffer, then move each row up to its aligned
+   place, led by its filter type, and unfilter it there while it is still
+   in cache.  That saves all of libpng's per-row bookkeeping.  Anything
+   we don't like the look of goes back to libpng, so that its
+   diagnostics are what the user sees.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+#include "sng.h"
+
+int native_decodable(png_uint_32 width, png_uint_32 height,
+		     int bit_depth, int color_type, int interlace_type)
+/* is this an image the native decoder handles? */
+{
+    if (use_libpng || idat)
+	return(FALSE);
+    if (bit_depth != 8 || interlace_type != PNG_INTERLACE_NONE)
+	return(FALSE);
+    if (width == 0 || height == 0 || width > PNG_UINT_31_MAX / 4
+	|| height > PNG_UINT_31_MAX)
+	return(FALSE);
+    switch (color_type)
+    {
+    case PNG_COLOR_TYPE_GRAY:
+    case PNG_COLOR_TYPE_RGB:
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+    case PNG_COLOR_TYPE_PALETTE:
+	return(TRUE);
+    default:
+	return(FALSE);
+    }
+}
+
+int native_decode(membuf *zdata, png_uint_32 width, png_uint_32 height,
+		  int color_type, image_buffer *ip)
+/*
+ * Inflate and unfilter the zlib stream in zdata.  Returns FALSE, leaving
+ * nothing allocated, if the data is damaged in any way.
+ */
+{
+    static const int channels[] = {1, 0, 3, 1, 2, 0, 4};
+    int bpp = channels[color_type];
+    png_size_t rowbytes = (png_size_t)width * bpp;
+    png_size_t expected = height * (rowbytes + 1), actual = expected;
+    png_bytep zeros, packed, row, prev;
+    png_uint_32 y;
+    int phase = PHASE_PUSH(PHASE_INFLATE);
+
+    /* running out of memory is libpng's problem too, so just fall back */
+    if (!image_alloc(ip, height, rowbytes))
+    {
+	PHASE_SET(phase);
+	return(FALSE);
+    }
+
+    /*
+     * The rows as inflated, each one byte longer than its pixels, end
+     * where the aligned rows do; since a row's place is never less than
+     * a byte more than its pixels, moving one up never touches the next.
+     */
+    packed = ip->data + ip->size - expected;
+    if (!inflate_buffer(packed, &actual, zdata->data, zdata->size)
+	|| actual != expected)
+    {
+	image_free(ip);
+	PHASE_SET(phase);
+	return(FALSE);
+    }
+    PHASE_SET(PHASE_UNFILTER);
+
+    /* the row above the first is all zeros */
+    zeros = mem_alloc(rowbytes);
+    if (zeros == NULL)
+    {
+	image_free(ip);
+	PHASE_SET(phase);
+	return(FALSE);
+    }
+    memset(zeros, '\0', rowbytes);
+    prev = zeros;
+    for (y = 0; y < height; y++)
+    {
+	row = ip->rows[y] - 1;
+	memmove(row, packed + y * (rowbytes + 1), rowbytes + 1);
+	if (!unfilter_row(row[0], row + 1, prev, rowbytes, bpp))
+	{
+	    xfree(zeros);
+	    image_free(ip);
+	    PHASE_SET(phase);
+	    return(FALSE);
+	}
+	prev = ip->rows[y];
+    }
+    xfree(zeros);
+    PHASE_SET(phase);
+    return(TRUE);
+}
+
+/* decode.c ends here */
@@ -0,0 +1,155 @@
+/*****************************************************************************
+
+NAME
+   deflate.c -- whole-buffer compression through the best available library.
+
+   libpng does its own streaming compression through zlib.  Where sng has
+   a complete buffer to squeeze or expand in one go, it comes here, and
+   we use libdeflate or zlib-ng when configure found one, zlib otherwise.
+   All of them read and write the zlib format, so which one ran never
+   shows in the files we produce beyond their size.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+#include "zlib.h"
+#include "sng.h"
+#include "config.h"
+
+#if defined(HAVE_LIBDEFLATE)
+#include <libdeflate.h>
+#elif defined(HAVE_LIBZ_NG)
+#include <zlib-ng.h>
+#endif
+
+const char *deflate_backend(void)
+/* name and version of the library behind deflate_buffer() */
+{
+    static char name[64];
+
+#if defined(HAVE_LIBDEFLATE)
+    sprintf(name, "libdeflate %s", LIBDEFLATE_VERSION_STRING);
+#elif defined(HAVE_LIBZ_NG)
+    sprintf(name, "zlib-ng %s", zlibng_version());
+#elif defined(ZLIBNG_VERSION)
+    sprintf(name, "zlib-ng %s (zlib compatible)", ZLIBNG_VERSION);
+#else
+    sprintf(name, "zlib %s", zlibVersion());
+#endif
+    return(name);
+}
+
+int deflate_is_zlib(void)
+/* is the backend the same zlib libpng uses, so recompressing is futile? */
+{
+#if defined(HAVE_LIBDEFLATE) || defined(HAVE_LIBZ_NG)
+    return(FALSE);
+#else
+    return(TRUE);
+#endif
+}
+
+png_size_t deflate_bound(png_size_t length)
+/* the most deflate_buffer() can produce from length bytes */
+{
+#if defined(HAVE_LIBDEFLATE)
+    /* older libdeflates insist on a compressor to ask */
+    struct libdeflate_compressor *c = libdeflate_alloc_compressor(1);
+    png_size_t bound;
+
+    if (c == NULL)
+	return(compressBound(length) + length / 1000 + 64);
+    bound = libdeflate_zlib_compress_bound(c, length);
+    libdeflate_free_compressor(c);
+    return(bound);
+#elif defined(HAVE_LIBZ_NG)
+    return(zng_compressBound(length));
+#else
+    return(compressBound(length));
+#endif
+}
+
+int deflate_buffer(png_bytep dest, png_size_t *destlen,
+		   png_const_bytep src, png_size_t srclen, int level)
+/*
+ * Compress src into a zlib stream at dest, with a 32K window.  Levels
+ * are zlib's, with DEFLATE_BEST meaning the backend's slowest and best.
+ * Returns TRUE on success; *destlen is the room on entry, the size on exit.
+ */
+{
+#if defined(HAVE_LIBDEFLATE)
+    struct libdeflate_compressor *c;
+    size_t n;
+
+    /* libdeflate goes past zlib's 9 */
+    if (level == DEFLATE_BEST)
+	level = 12;
+    if ((c = libdeflate_alloc_compressor(level)) == NULL)
+	return(FALSE);
+    n = libdeflate_zlib_compress(c, src, srclen, dest, *destlen);
+    libdeflate_free_compressor(c);
+    if (n == 0)
+	return(FALSE);
+    *destlen = n;
+    return(TRUE);
+#elif defined(HAVE_LIBZ_NG)
+    size_t n = *destlen;
+
+    if (level == DEFLATE_BEST)
+	level = Z_BEST_COMPRESSION;
+    if (zng_compress2(dest, &n, src, srclen, level) != Z_OK)
+	return(FALSE);
+    *destlen = n;
+    return(TRUE);
+#else
+    uLongf n = *destlen;
+
+    if (level == DEFLATE_BEST)
+	level = Z_BEST_COMPRESSION;
+    if (compress2(dest, &n, src, srclen, level) != Z_OK)
+	return(FALSE);
+    *destlen = n;
+    return(TRUE);
+#endif
+}
+
+int inflate_buffer(png_bytep dest, png_size_t *destlen,
+		   png_const_bytep src, png_size_t srclen)
+/*
+ * Expand the zlib stream at src.  Returns TRUE if it was valid and fit;
+ * *destlen is the room on entry, the size on exit.
+ */
+{
+#if defined(HAVE_LIBDEFLATE)
+    struct libdeflate_decompressor *d;
+    enum libdeflate_result status;
+    size_t n;
+
+    if ((d = libdeflate_alloc_decompressor()) == NULL)
+	return(FALSE);
+    status = libdeflate_zlib_decompress(d, src, srclen, dest, *destlen, &n);
+    libdeflate_free_decompressor(d);
+    if (status != LIBDEFLATE_SUCCESS)
+	return(FALSE);
+    *destlen = n;
+    return(TRUE);
+#elif defined(HAVE_LIBZ_NG)
+    size_t n = *destlen;
+
+    if (zng_uncompress(dest, &n, src, srclen) != Z_OK)
+	return(FALSE);
+    *destlen = n;
+    return(TRUE);
+#else
+    uLongf n = *destlen;
+
+    if (uncompress(dest, &n, src, srclen) != Z_OK)
+	return(FALSE);
+    *destlen = n;
+    return(TRUE);
+#endif
+}
+
+/* deflate.c ends here */
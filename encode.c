@@ -0,0 +1,282 @@
+/*****************************************************************************
+
+NAME
+   encode.c -- encode the image data of common PNG types without libpng.
+
+   For non-interlaced 8-bit images written without transforms, sngc lets
+   libpng write the signature and the chunks ahead of the image data from
+   the info structure as usual, and then comes here.  We filter the rows
+   ourselves, push them through deflate, and write the compressed stream
+   as IDAT chunks as large as the user likes, with CRCs from chunk_crc().
+   Anything out of the ordinary stays with png_write_png().  IDAT chunks
+   that are ready made, such as those from the cache, go the same way.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+#include "zlib.h"
+#include "sng.h"
+
+/* IDAT chunk size when the user didn't ask for one */
+#define NATIVE_IDAT_SIZE	(256 * 1024)
+
+static const int channels[] = {1, 0, 3, 1, 2, 0, 4};
+
+/* what native_encode() holds, for native_cleanup() after a png_error() */
+static png_bytep zeros, work, out;
+static z_stream zs;
+static int zs_live;
+
+static int idat_last(png_structp png_ptr, png_infop info_ptr)
+/* is IEND all that follows the image data? */
+{
+    png_unknown_chunkp unknowns;
+    int i, n;
+
+    /* png_write_end() has its own ideas about where these go */
+    n = png_get_unknown_chunks(png_ptr, info_ptr, &unknowns);
+    for (i = 0; i < n; i++)
+	if ((unknowns[i].location & PNG_AFTER_IDAT)
+	    || memcmp(unknowns[i].name, "IDAT", 4) == 0)
+	    return(FALSE);
+    return(TRUE);
+}
+
+int native_encodable(png_structp png_ptr, png_infop info_ptr, int transforms)
+/* can the native encoder write the rows attached to info_ptr? */
+{
+    png_uint_32 width, height;
+    int bit_depth, color_type, interlace_type;
+
+    if (use_libpng || transforms != PNG_TRANSFORM_IDENTITY
+	|| png_get_rows(png_ptr, info_ptr) == NULL)
+	return(FALSE);
+    png_get_IHDR(png_ptr, info_ptr, &width, &height,
+		 &bit_depth, &color_type, &interlace_type, NULL, NULL);
+    if (bit_depth != 8 || interlace_type != PNG_INTERLACE_NONE)
+	return(FALSE);
+    if (color_type < 0 || color_type > 6 || channels[color_type] == 0)
+	return(FALSE);
+    return(idat_last(png_ptr, info_ptr));
+}
+
+static void write_idat(png_structp png_ptr, FILE *fp,
+		       png_const_bytep data, png_size_t length)
+/* write one IDAT chunk, framing and all */
+{
+    png_byte header[8], trailer[4];
+    png_uint_32 crc;
+    int phase = PHASE_PUSH(PHASE_WRITE);
+
+    png_save_uint_32(header, length);
+    memcpy(header + 4, "IDAT", 4);
+    crc = chunk_crc(0, header + 4, 4);
+    png_save_uint_32(trailer, chunk_crc(crc, data, length));
+    if (fwrite(header, 1, 8, fp) != 8
+	|| fwrite(data, 1, length, fp) != length
+	|| fwrite(trailer, 1, 4, fp) != 4)
+	png_error(png_ptr, "Write Error");
+    PHASE_SET(phase);
+}
+
+static void write_zdata(png_structp png_ptr, FILE *fp,
+			png_const_bytep data, png_size_t length,
+			png_size_t chunksize)
+/* write a complete zlib stream as IDAT chunks */
+{
+    png_size_t done, len;
+
+    for (done = 0; done < length; done += len)
+    {
+	len = length - done;
+	if (len > chunksize)
+	    len = chunksize;
+	write_idat(png_ptr, fp, data + done, len);
+    }
+}
+
+static void filter_image(png_bytepp rows, png_uint_32 height,
+			 png_size_t rowbytes, int bpp, int filters,
+			 png_const_bytep prev, png_bytep out, png_size_t stride)
+/* filter rows below prev, each led by its filter type, stride bytes apart */
+{
+    png_uint_32 y;
+    int phase = PHASE_PUSH(PHASE_FILTER);
+
+    for (y = 0; y < height; y++)
+    {
+	int f = best_filter(rows[y], prev, rowbytes, bpp, filters);
+
+	out[0] = f;
+	filter_row(f, out + 1, rows[y], prev, rowbytes, bpp);
+	prev = rows[y];
+	out += stride;
+    }
+    PHASE_SET(phase);
+}
+
+void native_cleanup(void)
+/* free whatever native_encode() was holding when it finished or failed */
+{
+    if (zs_live)
+    {
+	deflateEnd(&zs);
+	zs_live = FALSE;
+    }
+    xfree(zeros);
+    xfree(work);
+    xfree(out);
+    zeros = work = out = NULL;
+}
+
+void native_encode(png_structp png_ptr, png_infop info_ptr,
+		   FILE *fp, encoder_settings *ep)
+/*
+ * Write the PNG for info_ptr to fp.  The settings are the merged file and
+ * command-line ones, with filters already resolved to a PNG_FILTER_* mask.
+ * If this ends in png_error(), the caller must call native_cleanup().
+ */
+{
+    png_bytepp rows = png_get_rows(png_ptr, info_ptr);
+    png_uint_32 width, height, y;
+    int bit_depth, color_type, interlace_type, bpp;
+    int level, strategy, window_bits, mem_level;
+    png_size_t rowbytes, rawsize, chunksize;
+    png_colorp palette;
+    int num_palette;
+
+    png_get_IHDR(png_ptr, info_ptr, &width, &height,
+		 &bit_depth, &color_type, &interlace_type, NULL, NULL);
+    bpp = channels[color_type];
+    rowbytes = (png_size_t)width * bpp;
+    rawsize = (rowbytes + 1) * height;
+    chunksize = (ep->idat_size != ENCODER_DEFAULT)
+	? ep->idat_size : NATIVE_IDAT_SIZE;
+
+    /* the same zlib parameters libpng would use */
+    level = (ep->level != ENCODER_DEFAULT) ? ep->level : Z_DEFAULT_COMPRESSION;
+    if (ep->strategy != ENCODER_DEFAULT)
+	strategy = ep->strategy;
+    else
+	strategy = (ep->filters != PNG_FILTER_NONE) ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+    mem_level = (ep->mem_level != ENCODER_DEFAULT) ? ep->mem_level : 8;
+    window_bits = (ep->window_bits != ENCODER_DEFAULT) ? ep->window_bits : 15;
+    if (rawsize <= 16384)
+    {
+	/* a window larger than the data only wastes decoder memory */
+	unsigned int half_window = 1U << (window_bits - 1);
+
+	while (rawsize + 262 <= half_window && window_bits > 9)
+	{
+	    half_window >>= 1;
+	    --window_bits;
+	}
+    }
+    if (window_bits < 9)		/* zlib no longer does 8 */
+	window_bits = 9;
+
+    png_write_info(png_ptr, info_ptr);
+    PHASE_SET(PHASE_DEFLATE);
+
+    mem_subsystem = MEM_PIXELS;		/* the filtered rows */
+    zeros = xalloc(rowbytes);
+    memset(zeros, '\0', rowbytes);
+    if (!deflate_is_zlib() && ep->strategy == ENCODER_DEFAULT
+	&& ep->window_bits == ENCODER_DEFAULT && ep->mem_level == ENCODER_DEFAULT)
+    {
+	/* the backend has no knobs but level, and wants it all at once */
+	png_size_t zsize = deflate_bound(rawsize);
+
+	work = xalloc(rawsize);
+	out = xalloc(zsize);
+	mem_subsystem = MEM_OTHER;
+	filter_image(rows, height, rowbytes, bpp, ep->filters,
+		     zeros, work, rowbytes + 1);
+	if (!deflate_buffer(out, &zsize, work, rawsize,
+			    level == Z_DEFAULT_COMPRESSION ? 6 : level))
+	    png_error(png_ptr, "compression failed");
+	write_zdata(png_ptr, fp, out, zsize, chunksize);
+    }
+    else
+    {
+	int ret;
+
+	work = xalloc(rowbytes + 1);
+	mem_subsystem = MEM_OTHER;
+	memset(&zs, '\0', sizeof(zs));
+	zs.zalloc = mem_zalloc;
+	zs.zfree = mem_zfree;
+	if (deflateInit2(&zs, level, Z_DEFLATED, window_bits,
+			 mem_level, strategy) != Z_OK)
+	    png_error(png_ptr, zs.msg ? zs.msg : "zlib failed to initialize");
+	zs_live = TRUE;
+
+	/* no sense in a buffer bigger than the whole stream can be */
+	if (chunksize > deflateBound(&zs, rawsize))
+	    chunksize = deflateBound(&zs, rawsize);
+	out = xalloc(chunksize);
+	zs.next_out = out;
+	zs.avail_out = chunksize;
+	for (y = 0; y <= height; y++)
+	{
+	    if (y < height)
+	    {
+		filter_image(rows + y, 1, rowbytes, bpp, ep->filters,
+			     y ? rows[y - 1] : zeros, work, rowbytes + 1);
+		zs.next_in = work;
+		zs.avail_in = rowbytes + 1;
+	    }
+	    do {
+		ret = deflate(&zs, y < height ? Z_NO_FLUSH : Z_FINISH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+		    png_error(png_ptr, zs.msg ? zs.msg : "zlib error");
+		if (zs.avail_out == 0 || ret == Z_STREAM_END)
+		{
+		    if (zs.next_out > out)
+			write_idat(png_ptr, fp, out, zs.next_out - out);
+		    zs.next_out = out;
+		    zs.avail_out = chunksize;
+		}
+	    } while (y < height ? zs.avail_in > 0 : ret != Z_STREAM_END);
+	}
+    }
+    native_cleanup();
+
+    /*
+     * The one check png_write_end() makes on the image data.  libpng's
+     * scan stops short of the last pixel in each row, and an index equal
+     * to num_palette gets by; we go along, so both encoders agree.
+     */
+    if (color_type == PNG_COLOR_TYPE_PALETTE
+	&& png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette))
+    {
+	int max = 0;
+	png_size_t x;
+
+	for (y = 0; y < height; y++)
+	    for (x = 0; x + 1 < rowbytes; x++)
+		if (rows[y][x] > max)
+		    max = rows[y][x];
+	if (max > num_palette)
+	    png_benign_error(png_ptr, "Wrote palette index exceeding num_palette");
+    }
+
+    png_write_chunk(png_ptr, (png_const_bytep)"IEND", NULL, 0);
+}
+
+int native_splice(png_structp png_ptr, png_infop info_ptr,
+		  FILE *fp, membuf *idat)
+/* write the PNG for info_ptr with ready-made IDAT chunks, if we can */
+{
+    if (use_libpng || !idat_last(png_ptr, info_ptr))
+	return(FALSE);
+    png_write_info(png_ptr, info_ptr);
+    if (fwrite(idat->data, 1, idat->size, fp) != idat->size)
+	png_error(png_ptr, "Write Error");
+    png_write_chunk(png_ptr, (png_const_bytep)"IEND", NULL, 0);
+    return(TRUE);
+}
+
+/* encode.c ends here */
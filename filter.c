@@ -0,0 +1,519 @@
+/*****************************************************************************
+
+NAME
+   filter.c -- PNG row filtering outside libpng.
+
+   On output we choose the filter for each row as libpng writes it.
+   This is the same minimum-sum-of-absolute-differences heuristic libpng
+   uses for adaptive filtering, but all five candidate costs come out of
+   a single pass over the row, vectorized where the CPU allows; cpu.c
+   decides which of the variants here to use.  The choice is handed to
+   libpng with png_set_filter() from a user transform callback, which
+   runs just before libpng filters each row.
+
+   The native encoder applies the filters itself as well, and on input,
+   the native decoder undoes them.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+#include "sng.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* cost of a residual byte, taken as a signed quantity */
+#define COST(r)	((png_byte)(r) < 128 ? (png_byte)(r) : 256 - (png_byte)(r))
+
+static const int filter_bits[FILTER_COUNT] = {
+    PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+    PNG_FILTER_AVG, PNG_FILTER_PAETH,
+};
+
+static int paeth_predictor(int a, int b, int c)
+{
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - c - c);
+
+    if (pa <= pb && pa <= pc)
+	return a;
+    else if (pb <= pc)
+	return b;
+    else
+	return c;
+}
+
+static void costs_scalar(png_const_bytep row, png_const_bytep prev,
+			 png_size_t start, png_size_t n, int bpp,
+			 png_uint_32 cost[FILTER_COUNT])
+/* accumulate the cost of each filter over bytes start..n-1 of a row */
+{
+    png_size_t i;
+
+    for (i = start; i < n; i++)
+    {
+	int x = row[i], b = prev[i];
+	int a = (i >= bpp) ? row[i - bpp] : 0;
+	int c = (i >= bpp) ? prev[i - bpp] : 0;
+
+	cost[FILTER_NONE] += COST(x);
+	cost[FILTER_SUB] += COST(x - a);
+	cost[FILTER_UP] += COST(x - b);
+	cost[FILTER_AVG] += COST(x - ((a + b) >> 1));
+	cost[FILTER_PAETH] += COST(x - paeth_predictor(a, b, c));
+    }
+}
+
+void filter_costs_scalar(png_const_bytep row, png_const_bytep prev,
+			 png_size_t n, int bpp, png_uint_32 cost[FILTER_COUNT])
+{
+    costs_scalar(row, prev, 0, n, bpp, cost);
+}
+
+#ifdef X86_KERNELS
+__attribute__((target("avx2")))
+static __m256i cost16(__m256i x, __m256i pred)
+/* per-lane COST() of x - pred, in 16-bit lanes */
+{
+    __m256i r = _mm256_and_si256(_mm256_sub_epi16(x, pred),
+				 _mm256_set1_epi16(0xff));
+
+    return _mm256_min_epi16(r, _mm256_sub_epi16(_mm256_set1_epi16(256), r));
+}
+
+__attribute__((target("avx2")))
+void filter_costs_avx2(png_const_bytep row, png_const_bytep prev,
+		       png_size_t n, int bpp, png_uint_32 cost[FILTER_COUNT])
+/* as costs_scalar() over the whole row, 16 bytes at a time */
+{
+    __m256i acc[FILTER_COUNT], ones = _mm256_set1_epi16(1);
+    png_size_t i;
+    int f;
+
+    if (n <= bpp)
+    {
+	costs_scalar(row, prev, 0, n, bpp, cost);
+	return;
+    }
+    for (f = 0; f < FILTER_COUNT; f++)
+	acc[f] = _mm256_setzero_si256();
+
+    /* the first pixel has no left neighbour */
+    costs_scalar(row, prev, 0, bpp, bpp, cost);
+
+    for (i = bpp; i + 16 <= n; i += 16)
+    {
+	__m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i)));
+	__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i - bpp)));
+	__m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(prev + i)));
+	__m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(prev + i - bpp)));
+	__m256i pa, pb, pc, not_a, not_b, paeth;
+
+	pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+	pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+	pc = _mm256_abs_epi16(_mm256_add_epi16(_mm256_sub_epi16(b, c),
+					       _mm256_sub_epi16(a, c)));
+	not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb),
+				_mm256_cmpgt_epi16(pa, pc));
+	not_b = _mm256_cmpgt_epi16(pb, pc);
+	paeth = _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, not_b), not_a);
+
+	acc[FILTER_NONE] = _mm256_add_epi32(acc[FILTER_NONE],
+	    _mm256_madd_epi16(cost16(x, _mm256_setzero_si256()), ones));
+	acc[FILTER_SUB] = _mm256_add_epi32(acc[FILTER_SUB],
+	    _mm256_madd_epi16(cost16(x, a), ones));
+	acc[FILTER_UP] = _mm256_add_epi32(acc[FILTER_UP],
+	    _mm256_madd_epi16(cost16(x, b), ones));
+	acc[FILTER_AVG] = _mm256_add_epi32(acc[FILTER_AVG],
+	    _mm256_madd_epi16(cost16(x, _mm256_srli_epi16(_mm256_add_epi16(a, b), 1)), ones));
+	acc[FILTER_PAETH] = _mm256_add_epi32(acc[FILTER_PAETH],
+	    _mm256_madd_epi16(cost16(x, paeth), ones));
+    }
+
+    for (f = 0; f < FILTER_COUNT; f++)
+    {
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc[f]),
+				  _mm256_extracti128_si256(acc[f], 1));
+
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+	cost[f] += _mm_cvtsi128_si32(s);
+    }
+
+    costs_scalar(row, prev, i, n, bpp, cost);
+}
+#endif /* X86_KERNELS */
+
+void filter_costs(png_const_bytep row, png_const_bytep prev,
+		  png_size_t n, int bpp, png_uint_32 cost[FILTER_COUNT])
+/* heuristic cost of each filter type for a row; prev is the row above */
+{
+    memset(cost, '\0', FILTER_COUNT * sizeof(png_uint_32));
+    if (use_libpng)
+	costs_scalar(row, prev, 0, n, bpp, cost);
+    else
+	kernels->costs(row, prev, n, bpp, cost);
+}
+
+/*****************************************************************************
+ *
+ * Per-row filter selection
+ *
+ *****************************************************************************/
+
+static void choose_filter(png_structp png_ptr, png_row_infop row_info,
+			  png_bytep data)
+/* user transform callback: set the filter libpng will use on this row */
+{
+    filter_chooser *fc = (filter_chooser *)png_get_user_transform_ptr(png_ptr);
+    png_size_t n = row_info->rowbytes;
+    int best, phase = PHASE_PUSH(PHASE_FILTER);
+
+    /* every interlace pass starts over with an all-zero row above */
+    if (fc->pass != png_get_current_pass_number(png_ptr) || fc->room < n)
+    {
+	if (fc->room < n)
+	{
+	    png_bytep prev = mem_realloc(fc->prev, n);
+
+	    if (prev == NULL)
+		png_error(png_ptr, "out of memory");
+	    fc->prev = prev;
+	    fc->room = n;
+	}
+	memset(fc->prev, '\0', n);
+	fc->pass = png_get_current_pass_number(png_ptr);
+    }
+
+    best = best_filter(data, fc->prev, n, (row_info->pixel_depth + 7) >> 3,
+		       fc->filters);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filter_bits[best]);
+    memcpy(fc->prev, data, n);
+    PHASE_SET(phase);
+}
+
+int filter_chooser_init(png_structp png_ptr, png_infop info_ptr,
+			filter_chooser *fc, int filters)
+/*
+ * Arrange for each row to be written with the cheapest of the given
+ * filters.  Does nothing, and returns FALSE, where libpng has only one
+ * choice to make anyway.
+ */
+{
+    int single = !(filters & (filters - 1));
+
+    fc->filters = filters;
+    fc->pass = -1;
+    if (use_libpng || single
+	|| png_get_image_width(png_ptr, info_ptr) == 1
+	|| png_get_image_height(png_ptr, info_ptr) == 1)
+	return(FALSE);
+
+    /* libpng only keeps the previous row if it might need it from the start */
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filters);
+    png_set_user_transform_info(png_ptr, fc, 0, 0);
+    png_set_write_user_transform_fn(png_ptr, choose_filter);
+    return(TRUE);
+}
+
+void filter_chooser_free(filter_chooser *fc)
+{
+    xfree(fc->prev);
+    fc->prev = NULL;
+    fc->room = 0;
+}
+
+/*****************************************************************************
+ *
+ * Filtering
+ *
+ *****************************************************************************/
+
+static void filter_scalar(int type, png_bytep out, png_const_bytep row,
+			  png_const_bytep prev, png_size_t start, png_size_t n,
+			  int bpp)
+/* filter bytes start..n-1 of a row into out */
+{
+    png_size_t i;
+
+    for (i = start; i < n; i++)
+    {
+	int x = row[i], b = prev[i];
+	int a = (i >= bpp) ? row[i - bpp] : 0;
+	int c = (i >= bpp) ? prev[i - bpp] : 0;
+
+	switch (type)
+	{
+	case FILTER_NONE:	out[i] = x; break;
+	case FILTER_SUB:	out[i] = x - a; break;
+	case FILTER_UP:		out[i] = x - b; break;
+	case FILTER_AVG:	out[i] = x - ((a + b) >> 1); break;
+	case FILTER_PAETH:	out[i] = x - paeth_predictor(a, b, c); break;
+	}
+    }
+}
+
+void filter_row_scalar(int type, png_bytep out, png_const_bytep row,
+		       png_const_bytep prev, png_size_t n, int bpp)
+{
+    filter_scalar(type, out, row, prev, 0, n, bpp);
+}
+
+#ifdef X86_KERNELS
+__attribute__((target("avx2")))
+void filter_row_avx2(int type, png_bytep out, png_const_bytep row,
+		     png_const_bytep prev, png_size_t n, int bpp)
+/*
+ * Unlike unfiltering, every output byte depends only on the input
+ * rows, so any filter type vectorizes at any pixel size.
+ */
+{
+    png_size_t i = bpp;
+
+    if (n <= bpp)
+    {
+	filter_scalar(type, out, row, prev, 0, n, bpp);
+	return;
+    }
+    filter_scalar(type, out, row, prev, 0, bpp, bpp);
+    switch (type)
+    {
+    case FILTER_NONE:
+	memcpy(out, row, n);
+	return;
+
+    case FILTER_SUB:
+	for (; i + 32 <= n; i += 32)
+	    _mm256_storeu_si256((__m256i *)(out + i),
+		_mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(row + i)),
+				_mm256_loadu_si256((const __m256i *)(row + i - bpp))));
+	break;
+
+    case FILTER_UP:
+	for (; i + 32 <= n; i += 32)
+	    _mm256_storeu_si256((__m256i *)(out + i),
+		_mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(row + i)),
+				_mm256_loadu_si256((const __m256i *)(prev + i))));
+	break;
+
+    case FILTER_AVG:
+	for (; i + 32 <= n; i += 32)
+	{
+	    __m256i a = _mm256_loadu_si256((const __m256i *)(row + i - bpp));
+	    __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+	    /* _mm256_avg_epu8 rounds up; PNG wants the floor */
+	    __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+		_mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+
+	    _mm256_storeu_si256((__m256i *)(out + i),
+		_mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(row + i)), avg));
+	}
+	break;
+
+    case FILTER_PAETH:
+	for (; i + 16 <= n; i += 16)
+	{
+	    __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i)));
+	    __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i - bpp)));
+	    __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(prev + i)));
+	    __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(prev + i - bpp)));
+	    __m256i pa, pb, pc, not_a, not_b, r;
+
+	    pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+	    pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+	    pc = _mm256_abs_epi16(_mm256_add_epi16(_mm256_sub_epi16(b, c),
+						   _mm256_sub_epi16(a, c)));
+	    not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb),
+				    _mm256_cmpgt_epi16(pa, pc));
+	    not_b = _mm256_cmpgt_epi16(pb, pc);
+	    r = _mm256_sub_epi16(x, _mm256_blendv_epi8(a,
+				 _mm256_blendv_epi8(b, c, not_b), not_a));
+	    r = _mm256_and_si256(r, _mm256_set1_epi16(0xff));
+	    r = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, r),
+					 _MM_SHUFFLE(3, 1, 2, 0));
+	    _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(r));
+	}
+	break;
+    }
+    filter_scalar(type, out, row, prev, i, n, bpp);
+}
+#endif /* X86_KERNELS */
+
+void filter_row(int type, png_bytep out, png_const_bytep row,
+		png_const_bytep prev, png_size_t n, int bpp)
+/* apply filter type to a row of n bytes; prev is the unfiltered row above */
+{
+    kernels->filter(type, out, row, prev, n, bpp);
+}
+
+int best_filter(png_const_bytep row, png_const_bytep prev,
+		png_size_t n, int bpp, int filters)
+/* the cheapest of the PNG_FILTER_* mask for this row, as a filter type */
+{
+    png_uint_32 cost[FILTER_COUNT], best_cost = 0;
+    int f, best = -1;
+
+    if (!(filters & (filters - 1)))	/* only one choice */
+    {
+	for (f = 0; f < FILTER_COUNT; f++)
+	    if (filters & filter_bits[f])
+		return(f);
+	return(FILTER_NONE);
+    }
+
+    filter_costs(row, prev, n, bpp, cost);
+    for (f = 0; f < FILTER_COUNT; f++)
+	if ((filters & filter_bits[f]) && (best < 0 || cost[f] < best_cost))
+	{
+	    best = f;
+	    best_cost = cost[f];
+	}
+    return(best);
+}
+
+/*****************************************************************************
+ *
+ * Unfiltering
+ *
+ *****************************************************************************/
+
+void unfilter_row_scalar(int type, png_bytep row, png_const_bytep prev,
+			 png_size_t n, int bpp)
+{
+    png_size_t i;
+
+    switch (type)
+    {
+    case FILTER_SUB:
+	for (i = bpp; i < n; i++)
+	    row[i] += row[i - bpp];
+	break;
+    case FILTER_UP:
+	for (i = 0; i < n; i++)
+	    row[i] += prev[i];
+	break;
+    case FILTER_AVG:
+	for (i = 0; i < bpp; i++)
+	    row[i] += prev[i] >> 1;
+	for (; i < n; i++)
+	    row[i] += (row[i - bpp] + prev[i]) >> 1;
+	break;
+    case FILTER_PAETH:
+	for (i = 0; i < bpp; i++)
+	    row[i] += prev[i];
+	for (; i < n; i++)
+	    row[i] += paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
+	break;
+    }
+}
+
+#ifdef X86_KERNELS
+/*
+ * Sub, Avg and Paeth depend on the pixel to the left, so the most we can
+ * do in parallel is the bytes of one pixel; these handle 3 and 4 bytes
+ * per pixel.  Up has no such dependency and goes 16 bytes at a time.
+ */
+
+__attribute__((target("sse2")))
+static __m128i load_pixel(png_const_bytep p, int bpp)
+{
+    png_uint_32 v = 0;
+
+    memcpy(&v, p, bpp);
+    return _mm_cvtsi32_si128(v);
+}
+
+__attribute__((target("sse2")))
+static void store_pixel(png_bytep p, __m128i x, int bpp)
+{
+    png_uint_32 v = _mm_cvtsi128_si32(x);
+
+    memcpy(p, &v, bpp);
+}
+
+__attribute__((target("sse2")))
+void unfilter_row_sse2(int type, png_bytep row, png_const_bytep prev,
+		       png_size_t n, int bpp)
+{
+    __m128i zero = _mm_setzero_si128(), a = zero, c = zero;
+    png_size_t i;
+
+    if (type != FILTER_UP && bpp != 3 && bpp != 4)
+    {
+	unfilter_row_scalar(type, row, prev, n, bpp);
+	return;
+    }
+    switch (type)
+    {
+    case FILTER_SUB:
+	for (i = 0; i < n; i += bpp)
+	{
+	    a = _mm_add_epi8(a, load_pixel(row + i, bpp));
+	    store_pixel(row + i, a, bpp);
+	}
+	break;
+
+    case FILTER_UP:
+	for (i = 0; i + 16 <= n; i += 16)
+	    _mm_storeu_si128((__m128i *)(row + i),
+			     _mm_add_epi8(_mm_loadu_si128((__m128i *)(row + i)),
+					  _mm_loadu_si128((const __m128i *)(prev + i))));
+	for (; i < n; i++)
+	    row[i] += prev[i];
+	break;
+
+    case FILTER_AVG:
+	for (i = 0; i < n; i += bpp)
+	{
+	    __m128i b = load_pixel(prev + i, bpp);
+	    /* _mm_avg_epu8 rounds up; PNG wants the floor */
+	    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+				       _mm_and_si128(_mm_xor_si128(a, b),
+						     _mm_set1_epi8(1)));
+
+	    a = _mm_add_epi8(load_pixel(row + i, bpp), avg);
+	    store_pixel(row + i, a, bpp);
+	}
+	break;
+
+    case FILTER_PAETH:
+	for (i = 0; i < n; i += bpp)
+	{
+	    __m128i b = _mm_unpacklo_epi8(load_pixel(prev + i, bpp), zero);
+	    __m128i pa, pb, pc, not_a, not_b, pred;
+
+	    pa = _mm_sub_epi16(b, c);
+	    pb = _mm_sub_epi16(a, c);
+	    pc = _mm_add_epi16(pa, pb);
+	    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+	    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+	    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+	    not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	    not_b = _mm_cmpgt_epi16(pb, pc);
+	    pred = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+	    pred = _mm_or_si128(_mm_and_si128(not_a, pred), _mm_andnot_si128(not_a, a));
+
+	    a = _mm_add_epi8(load_pixel(row + i, bpp), _mm_packus_epi16(pred, pred));
+	    store_pixel(row + i, a, bpp);
+	    a = _mm_unpacklo_epi8(a, zero);
+	    c = b;
+	}
+	break;
+    }
+}
+#endif /* X86_KERNELS */
+
+int unfilter_row(int type, png_bytep row, png_const_bytep prev,
+		 png_size_t n, int bpp)
+/* undo the filter on a row of n bytes in place; FALSE if type is bogus */
+{
+    if (type < FILTER_NONE || type >= FILTER_COUNT)
+	return(FALSE);
+    kernels->unfilter(type, row, prev, n, bpp);
+    return(TRUE);
+}
+
+/* filter.c ends here */
@@ -0,0 +1,340 @@
+/*****************************************************************************
+
+NAME
+   idat.c -- capture PNG output in memory and splice IDAT chunks into it.
+
+   Also home to the chunk CRC, which we compute with carry-less multiply
+   instructions where the CPU has them and cpu.c says to.  That is the
+   folding method of Gopal et al., "Fast CRC Computation for Generic
+   Polynomials Using PCLMULQDQ Instruction" (Intel, 2009), with the
+   constants for the bit-reflected PNG/zlib polynomial given at the end
+   of the paper.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+#include "zlib.h"
+#include "sng.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*****************************************************************************
+ *
+ * Memory output
+ *
+ *****************************************************************************/
+
+void membuf_write(png_structp png_ptr, png_bytep data, png_size_t length)
+/* libpng write callback accumulating output in the membuf at io_ptr */
+{
+    membuf *mp = (membuf *)png_get_io_ptr(png_ptr);
+
+    if (mp->size + length > mp->room)
+    {
+	png_size_t room = mp->room ? mp->room : BUFSIZ;
+	png_bytep data;
+
+	while (room < mp->size + length)
+	    room *= 2;
+	/* this may run on a worker thread, so don't use xrealloc() */
+	if ((data = mem_realloc(mp->data, room)) == NULL)
+	    png_error(png_ptr, "out of memory");
+	mp->data = data;
+	mp->room = room;
+    }
+    memcpy(mp->data + mp->size, data, length);
+    mp->size += length;
+}
+
+void membuf_flush(png_structp png_ptr)
+{
+}
+
+void membuf_free(membuf *mp)
+{
+    xfree(mp->data);
+    memset(mp, '\0', sizeof(membuf));
+}
+
+void extract_idat(membuf *png, membuf *idat)
+/* copy the IDAT chunks of a complete PNG datastream, framing and all */
+{
+    png_bytep end = png->data + png->size, cp;
+    int pass;
+
+    memset(idat, '\0', sizeof(membuf));
+    for (pass = 0; pass < 2; pass++)
+    {
+	if (pass == 1)
+	    idat->data = xalloc(idat->room = idat->size);
+	idat->size = 0;
+	for (cp = png->data + 8; cp + 12 <= end; cp += png_get_uint_32(cp) + 12)
+	    if (memcmp(cp + 4, "IDAT", 4) == 0)
+	    {
+		png_size_t chunklen = png_get_uint_32(cp) + 12;
+
+		if (pass == 1)
+		    memcpy(idat->data + idat->size, cp, chunklen);
+		idat->size += chunklen;
+	    }
+    }
+}
+
+void join_idat(membuf *idat, membuf *zdata)
+/* concatenate the data of a run of IDAT chunks into one zlib stream */
+{
+    png_bytep end = idat->data + idat->size, cp;
+
+    memset(zdata, '\0', sizeof(membuf));
+    zdata->data = xalloc(idat->size);
+    for (cp = idat->data; cp + 12 <= end; cp += png_get_uint_32(cp) + 12)
+    {
+	png_size_t len = png_get_uint_32(cp);
+
+	memcpy(zdata->data + zdata->size, cp + 8, len);
+	zdata->size += len;
+    }
+    zdata->room = idat->size;
+}
+
+/*****************************************************************************
+ *
+ * Chunk CRCs
+ *
+ *****************************************************************************/
+
+#ifdef X86_KERNELS
+__attribute__((target("pclmul,sse4.1")))
+static png_uint_32 crc_pclmul(png_uint_32 crc, png_const_bytep buf,
+			      png_size_t len)
+/* fold len bytes into the inverted crc; len is a multiple of 16, >= 64 */
+{
+    static const unsigned long long k1k2[] __attribute__((aligned(16))) =
+	{0x0154442bd4, 0x01c6e41596};
+    static const unsigned long long k3k4[] __attribute__((aligned(16))) =
+	{0x01751997d0, 0x00ccaa009e};
+    static const unsigned long long k5k0[] __attribute__((aligned(16))) =
+	{0x0163cd6124, 0x0000000000};
+    static const unsigned long long poly[] __attribute__((aligned(16))) =
+	{0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold four 128-bit lanes in parallel */
+    while (len >= 64)
+    {
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+	x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+	x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+	x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+	y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+	x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+	x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+	x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+	buf += 64;
+	len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* then any remaining 16-byte blocks */
+    while (len >= 16)
+    {
+	x2 = _mm_loadu_si128((const __m128i *)buf);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	buf += 16;
+	len -= 16;
+    }
+
+    /* 128 bits down to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* and a Barrett reduction to 32 */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return((png_uint_32)_mm_extract_epi32(x1, 1));
+}
+
+png_uint_32 chunk_crc_pclmul(png_uint_32 crc, png_const_bytep buf,
+			     png_size_t len)
+{
+    if (len >= 64)
+    {
+	png_size_t bulk = len & ~(png_size_t)15;
+
+	crc = ~crc_pclmul(~crc, buf, bulk);
+	buf += bulk;
+	len -= bulk;
+    }
+    return((png_uint_32)crc32(crc, buf, len));
+}
+#endif /* X86_KERNELS */
+
+png_uint_32 chunk_crc_scalar(png_uint_32 crc, png_const_bytep buf,
+			     png_size_t len)
+{
+    return((png_uint_32)crc32(crc, buf, len));
+}
+
+png_uint_32 chunk_crc(png_uint_32 crc, png_const_bytep buf, png_size_t len)
+/* update a running CRC-32 as zlib's crc32() would; start with crc 0 */
+{
+    return(kernels->crc(crc, buf, len));
+}
+
+void make_idat(membuf *zdata, png_size_t chunksize, membuf *idat)
+/* frame a zlib stream as IDAT chunks of at most chunksize bytes */
+{
+    png_size_t done, nchunks = (zdata->size + chunksize - 1) / chunksize;
+    png_bytep cp;
+
+    memset(idat, '\0', sizeof(membuf));
+    idat->room = zdata->size + 12 * nchunks;
+    cp = idat->data = xalloc(idat->room);
+    for (done = 0; done < zdata->size; done += chunksize)
+    {
+	png_size_t len = zdata->size - done;
+
+	if (len > chunksize)
+	    len = chunksize;
+	png_save_uint_32(cp, len);
+	memcpy(cp + 4, "IDAT", 4);
+	memcpy(cp + 8, zdata->data + done, len);
+	png_save_uint_32(cp + 8 + len, chunk_crc(0, cp + 4, len + 4));
+	cp += len + 12;
+    }
+    idat->size = cp - idat->data;
+}
+
+png_size_t raw_idat_size(png_uint_32 width, png_uint_32 height,
+			 int bit_depth, int color_type, int interlace_type)
+/* size of the filtered image data before compression */
+{
+    static const int channels[] = {1, 0, 3, 1, 2, 0, 4};
+    int pixel_depth = bit_depth * channels[color_type];
+    png_size_t size = 0;
+    int pass;
+
+    if (interlace_type == PNG_INTERLACE_NONE)
+	return(height * (((png_size_t)width * pixel_depth + 7) / 8 + 1));
+    for (pass = 0; pass < 7; pass++)
+    {
+	png_uint_32 cols = PNG_PASS_COLS(width, pass);
+	png_uint_32 rows = PNG_PASS_ROWS(height, pass);
+
+	if (cols && rows)
+	    size += rows * (((png_size_t)cols * pixel_depth + 7) / 8 + 1);
+    }
+    return(size);
+}
+
+/*****************************************************************************
+ *
+ * IDAT splicing
+ *
+ *****************************************************************************/
+
+static void splice_put(png_structp png_ptr, splicer *sp,
+		       png_bytep data, png_size_t length)
+{
+    if (length && fwrite(data, 1, length, sp->fp) != length)
+	png_error(png_ptr, "Write Error");
+}
+
+void splice_write(png_structp png_ptr, png_bytep data, png_size_t length)
+/*
+ * libpng write callback that passes everything through to the output file
+ * except the IDAT chunks, which are replaced by the ones in sp->idat.
+ */
+{
+    splicer *sp = (splicer *)png_get_io_ptr(png_ptr);
+
+    while (length)
+    {
+	if (sp->skip)
+	{
+	    png_size_t n = length < sp->skip ? length : sp->skip;
+
+	    if (!sp->in_idat)
+		splice_put(png_ptr, sp, data, n);
+	    sp->skip -= n;
+	    data += n;
+	    length -= n;
+	}
+	else
+	{
+	    sp->header[sp->nheader++] = *data++;
+	    length--;
+	    if (sp->nheader == 8)
+	    {
+		sp->in_idat = !memcmp(sp->header + 4, "IDAT", 4);
+		if (!sp->in_idat)
+		    splice_put(png_ptr, sp, sp->header, 8);
+		else if (!sp->spliced++)
+		    splice_put(png_ptr, sp, sp->idat->data, sp->idat->size);
+		sp->skip = png_get_uint_32(sp->header) + 4;
+		sp->nheader = 0;
+	    }
+	}
+    }
+}
+
+void splice_flush(png_structp png_ptr)
+{
+    fflush(((splicer *)png_get_io_ptr(png_ptr))->fp);
+}
+
+void splice_init(splicer *sp, FILE *fp, membuf *idat)
+/* set up to write a PNG to fp with the IDAT chunks replaced by idat */
+{
+    memset(sp, '\0', sizeof(splicer));
+    sp->fp = fp;
+    sp->idat = idat;
+    sp->skip = 8;		/* the PNG signature */
+}
+
+/* idat.c ends here */
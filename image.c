@@ -0,0 +1,77 @@
+/*****************************************************************************
+
+NAME
+   image.c -- image buffers shared by the codecs.
+
+   Wherever sng holds a whole image -- compiled from SNG, decoded by
+   decode.c, or read through libpng -- it is in one of these: a single
+   allocation with every row starting on an IMAGE_ALIGN boundary, so the
+   filter, unfilter and formatting kernels can use aligned vector loads
+   on any row, and the row pointers libpng and the kernels want stored
+   after the pixels.  The byte before each row is always spare, which is
+   where decode.c keeps the row's filter type and encoders may too.
+
+   Images of HUGE_PAGE bytes or more are aligned to a huge page and, where
+   the system has transparent huge pages, the kernel is asked to back
+   them with those; walking a large image then costs a fraction of the
+   TLB misses.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "png.h"
+#include "sng.h"
+#include "config.h"
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MADVISE)
+#include <sys/mman.h>
+#endif
+
+#define HUGE_PAGE	(2 * 1024 * 1024)
+
+int image_alloc(image_buffer *ip, png_uint_32 height, png_size_t rowbytes)
+/*
+ * Room for height rows of rowbytes each, aligned and in one piece.
+ * Returns FALSE, with nothing allocated, if there's no memory for it.
+ */
+{
+    png_size_t stride, size, total, align = IMAGE_ALIGN;
+    png_uint_32 y;
+    int was = mem_subsystem;
+
+    if (rowbytes >= SIZE_MAX - IMAGE_ALIGN)
+	return(FALSE);
+    stride = (rowbytes + IMAGE_ALIGN) & ~(png_size_t)(IMAGE_ALIGN - 1);
+    if (height > (SIZE_MAX - IMAGE_ALIGN) / (stride + sizeof(png_bytep)))
+	return(FALSE);
+    size = IMAGE_ALIGN + height * stride;	/* room for row 0's spare byte */
+    total = size + height * sizeof(png_bytep);
+    if (total >= HUGE_PAGE)
+	align = HUGE_PAGE;
+
+    mem_subsystem = MEM_PIXELS;
+    ip->data = mem_aligned_alloc(align, total);
+    mem_subsystem = was;
+    if (ip->data == NULL)
+	return(FALSE);
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+    if (align == HUGE_PAGE)
+	madvise(ip->data, total & ~(png_size_t)(HUGE_PAGE - 1), MADV_HUGEPAGE);
+#endif
+    ip->rows = (png_bytepp)(ip->data + size);
+    for (y = 0; y < height; y++)
+	ip->rows[y] = ip->data + IMAGE_ALIGN + y * stride;
+    ip->stride = stride;
+    ip->size = size;
+    return(TRUE);
+}
+
+void image_free(image_buffer *ip)
+{
+    xfree(ip->data);
+    ip->data = NULL;
+    ip->rows = NULL;
+}
+
+/* image.c ends here */
@@ -5,12 +5,27 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <limits.h>
 #include "png.h"
 #include "sng.h"
 #include "config.h"
 
 int verbose;
 int idat;
+int encoder_comment;
+encoder_settings encoder;
+int optimize;
+int jobs;
+int use_libpng;
+char *bundle;
+char bundle_image[BUFSIZ];	/* what the image being bundled is called */
+
+static int queue_depth = 16;	/* files read ahead, see batch.c */
+static char *serve_socket, *connect_socket;
+static int want_stats, want_tar, want_watch, want_check_kernels, want_verify;
+static int want_cmp, want_digest;
+static char *forward[64];	/* options to pass on to a server */
+static int nforward;
 
 png_struct *png_ptr;
 png_info *info_ptr;
@@ -54,7 +69,7 @@ void fatal(const char *fmt, ... )
 
 void *xalloc(unsigned long s)
 {
-    void *p=malloc((size_t)s);
+    void *p=mem_alloc(s);
 
     if (p==NULL) {
 	fatal("out of memory");
@@ -65,7 +80,7 @@ void *xalloc(unsigned long s)
 
 void *xrealloc(void *p, unsigned long s)
 {
-    p=realloc(p,(size_t)s);
+    p=mem_realloc(p,s);
 
     if (p==NULL) {
 	fatal("out of memory");
@@ -103,6 +118,7 @@ void initialize_hash(int hashfunc(color_item *),
 	char line[BUFSIZ], namebuf[BUFSIZ];
 
 	(*initialized)++;
+	mem_subsystem = MEM_COLORS;
 
 	if ((fp = fopen(RGBTXT, "r")) == NULL)
 	    fatal("RGB database %s is missing.", RGBTXT);
@@ -144,6 +160,7 @@ void initialize_hash(int hashfunc(color_item *),
 	    }
 	    fclose(fp);
 	}
+	mem_subsystem = MEM_OTHER;
     }
 }
 
@@ -158,6 +175,434 @@ static int max(int x, int y)
     return x > y ? x : y;
 }
 
+static int from_request;	/* are the options a server request's? */
+static int option_errors;
+
+static int bad_option(void)
+/* after a complaint, exit, or for a request just count it; TRUE */
+{
+    if (!from_request)
+	exit(1);
+    option_errors++;
+    return TRUE;
+}
+
+static long numeric_option(char *name, char *value, long lo, long hi)
+/* validate the value of a --name=value option */
+{
+    long result;
+    char *vp;
+
+    if (!value || !*value)
+    {
+	fprintf(stderr, "sng: option --%s requires a value\n", name);
+	bad_option();
+	return(lo);
+    }
+    result = strtol(value, &vp, 0);
+    if (*vp || result < lo || result > hi)
+    {
+	fprintf(stderr, "sng: value %s out of range for option --%s\n",
+		value, name);
+	bad_option();
+	return(lo);
+    }
+    return result;
+}
+
+static int long_option(char *arg)
+/* process a --name=value option; return FALSE if we don't recognize it */
+{
+    char *value = strchr(arg, '=');
+
+    if (value)
+	*value++ = '\0';
+
+    if (strcmp(arg, "level") == 0)
+	encoder.level = numeric_option(arg, value, 0, 9);
+    else if (strcmp(arg, "strategy") == 0)
+    {
+	if (!value || (encoder.strategy = encoder_strategy(value)) == ENCODER_DEFAULT)
+	{
+	    fprintf(stderr, "sng: unknown compression strategy %s\n",
+		    value ? value : "(none)");
+	    return(bad_option());
+	}
+    }
+    else if (strcmp(arg, "window-bits") == 0)
+	encoder.window_bits = numeric_option(arg, value, 8, 15);
+    else if (strcmp(arg, "mem-level") == 0)
+	encoder.mem_level = numeric_option(arg, value, 1, 9);
+    else if (strcmp(arg, "filters") == 0)
+    {
+	char *name;
+
+	if (!value || !*value)
+	{
+	    fprintf(stderr, "sng: option --filters requires a value\n");
+	    return(bad_option());
+	}
+	encoder.filters = 0;
+	for (name = strtok(value, ","); name; name = strtok(NULL, ","))
+	{
+	    int filter = encoder_filter(name);
+
+	    if (filter == ENCODER_DEFAULT)
+	    {
+		fprintf(stderr, "sng: unknown row filter %s\n", name);
+		return(bad_option());
+	    }
+	    encoder.filters |= filter;
+	}
+	if (!encoder.filters)
+	{
+	    fprintf(stderr, "sng: option --filters requires a value\n");
+	    return(bad_option());
+	}
+    }
+    else if (strcmp(arg, "idat-size") == 0)
+	encoder.idat_size = numeric_option(arg, value, 1, 2147483647L);
+    else if (strcmp(arg, "optimize") == 0 && !value)
+	++optimize;
+    else if (strcmp(arg, "libpng") == 0 && !value)
+	++use_libpng;
+    else if (strcmp(arg, "jobs") == 0)
+	jobs = numeric_option(arg, value, 1, 1024);
+    else if (strcmp(arg, "queue-depth") == 0)
+	queue_depth = numeric_option(arg, value, 0, 4096);
+    else if (strcmp(arg, "bundle") == 0)
+    {
+	if (!value || !*value)
+	{
+	    fprintf(stderr, "sng: option --bundle requires a value\n");
+	    return(bad_option());
+	}
+	bundle = value;
+    }
+    else if (strcmp(arg, "serve") == 0 || strcmp(arg, "connect") == 0)
+    {
+	if (!value || !*value)
+	{
+	    fprintf(stderr, "sng: option --%s requires a value\n", arg);
+	    return(bad_option());
+	}
+	if (arg[0] == 's')
+	    serve_socket = value;
+	else
+	    connect_socket = value;
+    }
+    else if (strcmp(arg, "stats") == 0 && !value)
+	++want_stats;
+    else if (strcmp(arg, "memory") == 0 && !value)
+	memory_report = TRUE;
+    else if (strcmp(arg, "memory-budget") == 0)
+    {
+	memory_budget = numeric_option(arg, value, 1, 2147483647L);
+	memory_report = TRUE;
+    }
+    else if (strcmp(arg, "tar") == 0 && !value)
+	++want_tar;
+    else if (strcmp(arg, "watch") == 0 && !value)
+	++want_watch;
+    else if (strcmp(arg, "check-kernels") == 0 && !value)
+	++want_check_kernels;
+    else if (strcmp(arg, "verify") == 0 && !value)
+	++want_verify;
+    else if (strcmp(arg, "cmp") == 0)
+    {
+	if (value && strcmp(value, "all") != 0)
+	{
+	    fprintf(stderr, "sng: --cmp takes no value but all\n");
+	    return(bad_option());
+	}
+	want_cmp = value ? 2 : 1;
+    }
+    else if (strcmp(arg, "digest") == 0)
+    {
+	if (value && strcmp(value, "meta") != 0)
+	{
+	    fprintf(stderr, "sng: --digest takes no value but meta\n");
+	    return(bad_option());
+	}
+	digest_metadata = (value != NULL);
+	++want_digest;
+    }
+    else if (strcmp(arg, "cache") == 0)
+    {
+	if (!value || !*value)
+	{
+	    fprintf(stderr, "sng: option --cache requires a value\n");
+	    return(bad_option());
+	}
+	cache_dir = value;
+    }
+    else
+	return FALSE;
+
+    return TRUE;
+}
+
+int apply_option(char *arg)
+/* apply an option word as the command line would; FALSE if it's bad */
+{
+    char *cp;
+    int known;
+
+    if (arg[0] != '-')
+	return FALSE;
+    else if (arg[1] == '-')
+    {
+	/* a bad value fails the request, where it would end the program */
+	from_request = TRUE;
+	option_errors = 0;
+	known = arg[2] && long_option(arg + 2);
+	from_request = FALSE;
+	return known && option_errors == 0;
+    }
+    for (cp = arg + 1; *cp; cp++)
+	switch (*cp)
+	{
+	case 'v':
+	    ++verbose;
+	    break;
+	case 'i':
+	    ++idat;
+	    break;
+	case 'c':
+	    ++encoder_comment;
+	    break;
+	default:
+	    return FALSE;
+	}
+    return TRUE;
+}
+
+int output_name(char *infile, char *outfile)
+/*
+ * Work out the output file for a conversion: TRUE for SNG to PNG, FALSE
+ * for PNG to SNG, -1 if the name says neither.  outfile has BUFSIZ bytes.
+ */
+{
+    int dot = strlen(infile) - 4;
+
+    if (dot < 0 || dot >= BUFSIZ - 4 || infile[dot] != '.')
+	return -1;
+    strncpy(outfile, infile, dot);
+    outfile[dot] = '\0';
+    if (strcmp(infile + dot, ".sng") == 0)
+    {
+	strcat(outfile, ".png");
+	return TRUE;
+    }
+    else if (strcmp(infile + dot, ".png") == 0)
+    {
+	strcat(outfile, ".sng");
+	return FALSE;
+    }
+    return -1;
+}
+
+/*************************************************************************
+ *
+ * Bundles
+ *
+ * A bundle is an SNG stream holding several images, each introduced by
+ * a line of the form `#SNG: image NAME' giving the PNG it compiles to.
+ *
+ ************************************************************************/
+
+#define BUNDLE_HEADER	"#SNG: image "
+
+static int bundle_path(char *name, char *image, char *outfile)
+/*
+ * Where a bundle's image goes: its name taken relative to the directory
+ * the bundle is in.  The bundle may come from anywhere, so it may not
+ * say where outside that directory to write; FALSE if it tries.
+ */
+{
+    char *cp, *dir_end = strrchr(name, '/');
+    int dirlen = dir_end ? dir_end - name + 1 : 0;
+
+    if (image[0] == '/')
+	return FALSE;
+    for (cp = image; *cp; cp += strcspn(cp, "/"), cp += (*cp == '/'))
+	if (strncmp(cp, "..", 2) == 0 && (cp[2] == '/' || cp[2] == '\0'))
+	    return FALSE;
+    if (dirlen + strlen(image) >= BUFSIZ)
+	return FALSE;
+    memcpy(outfile, name, dirlen);
+    strcpy(outfile + dirlen, image);
+    return TRUE;
+}
+
+static char bundle_dir[PATH_MAX];	/* where --bundle's file is, resolved */
+
+static int bundle_start(char *name)
+/* note the directory the bundle being written is in; FALSE if it has none */
+{
+    char dir[PATH_MAX], *cp = strrchr(name, '/');
+
+    if (strcmp(name, "-") == 0 || cp == NULL)
+	strcpy(dir, ".");
+    else if (cp == name)
+	strcpy(dir, "/");
+    else if (cp - name >= (int)sizeof(dir))
+	return FALSE;
+    else
+    {
+	memcpy(dir, name, cp - name);
+	dir[cp - name] = '\0';
+    }
+    return(realpath(dir, bundle_dir) != NULL);
+}
+
+static int bundle_name(char *infile, char *image)
+/*
+ * The name a file goes under in the bundle being written: its path from
+ * the bundle's directory, which is what compile_bundle() will take it
+ * as.  FALSE if the file isn't beneath that directory.
+ */
+{
+    char dir[PATH_MAX], real[PATH_MAX], *rel, *base = strrchr(infile, '/');
+    size_t len = strlen(bundle_dir);
+
+    if (base == NULL)
+    {
+	strcpy(dir, ".");
+	base = infile;
+    }
+    else if (base - infile >= (int)sizeof(dir))
+	return FALSE;
+    else
+    {
+	memcpy(dir, infile, base - infile);
+	strcpy(dir + (base - infile), base == infile ? "/" : "");
+	base++;
+    }
+    if (realpath(dir, real) == NULL)
+	return FALSE;
+
+    if (strcmp(real, bundle_dir) == 0)
+	rel = "";
+    else if (strcmp(bundle_dir, "/") == 0)
+	rel = real + 1;
+    else if (strncmp(real, bundle_dir, len) == 0 && real[len] == '/')
+	rel = real + len + 1;
+    else
+	return FALSE;
+    if (strlen(rel) + strlen(base) + 2 > BUFSIZ)
+	return FALSE;
+    sprintf(image, "%s%s%s", rel, *rel ? "/" : "", base);
+    return TRUE;
+}
+
+static int compile_bundle(FILE *fpin, char *name)
+/* compile each image in a bundle to the file its header names */
+{
+    int error_status = 0;
+    char *header;
+
+    while ((header = sngc_header(fpin)) != NULL)
+    {
+	char image[BUFSIZ], outfile[BUFSIZ], *cp;
+	FILE *fpout;
+
+	if (strncmp(header, BUNDLE_HEADER, strlen(BUNDLE_HEADER)) == 0)
+	    strncpy(image, header + strlen(BUNDLE_HEADER), sizeof(image) - 1);
+	else
+	    image[0] = '\0';
+	image[sizeof(image) - 1] = '\0';
+	for (cp = image + strlen(image); cp > image && isspace(cp[-1]); cp--)
+	    continue;
+	*cp = '\0';
+
+	if (image[0] == '\0')
+	{
+	    fprintf(stderr, "sng: %s: bundle image has no name\n", name);
+	    error_status = max(error_status, 1);
+	}
+	else if (!bundle_path(name, image, outfile))
+	{
+	    fprintf(stderr, "sng: %s: bundle image %s is outside the bundle's"
+		    " directory\n", name, image);
+	    error_status = max(error_status, 1);
+	}
+	else if ((fpout = fopen(outfile, "w")) == NULL)
+	{
+	    fprintf(stderr,
+		    "sng: couldn't open %s for output (%d)\n", outfile, errno);
+	    error_status = max(error_status, 1);
+	}
+	else
+	{
+	    if (verbose)
+		printf("sng: converting %s to %s\n", name, outfile);
+	    error_status = max(error_status, sngc(fpin, name, fpout));
+	    fclose(fpout);
+	    sngc_skip(fpin);
+	    continue;
+	}
+	sngc_pass(fpin);		/* an image with nowhere to go */
+    }
+    return error_status;
+}
+
+static int compile_stream(FILE *fpin, char *name, FILE *fpout, int many)
+/* compile a single image, a bundle, or if many is set a run of images */
+{
+    char *header = sngc_header(fpin);
+    int error_status;
+
+    if (header && strncmp(header, BUNDLE_HEADER, strlen(BUNDLE_HEADER)) == 0)
+	return compile_bundle(fpin, name);
+
+    error_status = sngc(fpin, name, fpout);
+    sngc_skip(fpin);
+    while (many && sngc_header(fpin) != NULL)
+    {
+	/* each PNG goes out as soon as it's done */
+	fflush(fpout);
+	error_status = max(error_status, sngc(fpin, name, fpout));
+	sngc_skip(fpin);
+    }
+    if (sngc_header(fpin) != NULL)
+    {
+	fprintf(stderr,
+		"sng: %s: more than one image; name them with `%sNAME' lines\n",
+		name, BUNDLE_HEADER);
+	error_status = max(error_status, 1);
+    }
+    return error_status;
+}
+
+int convert_stream(FILE *fpin, char *name, FILE *fpout, int bundles)
+/* convert a stream of either kind, as in pipe mode; closes fpin */
+{
+    int c = getc(fpin), error_status;
+    char *header;
+
+    ungetc(c, fpin);
+    if (!isprint(c))
+	return sngd_stream(fpin, name, fpout);
+
+    header = sngc_header(fpin);
+    if (!bundles && header
+	&& strncmp(header, BUNDLE_HEADER, strlen(BUNDLE_HEADER)) == 0)
+    {
+	fprintf(stderr, "sng: %s: can't compile a bundle here\n", name);
+	error_status = 1;
+    }
+    else
+	error_status = compile_stream(fpin, name, fpout, TRUE);
+    sngc_done(fpin);
+    fclose(fpin);
+    return error_status;
+}
+
+#ifdef SNG_MICROBENCH
+#define main sng_main	/* sng_microbench has a main() of its own */
+#endif
+
 int main(int argc, char *argv[])
 {
     int i = 1;
@@ -167,8 +612,32 @@ int main(int argc, char *argv[])
     _wildcard(&argc, &argv);   /* Unix-like globbing for OS/2 and DOS */
 #endif
 
+    kernels_init();
+    encoder_init(&encoder);
+#ifdef _SC_NPROCESSORS_ONLN
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (jobs < 1)
+	jobs = 1;
+
     while(argc > 1 && argv[1][0] == '-')
     {
+	if (i == 1 && nforward < sizeof(forward)/sizeof(forward[0]))
+	    forward[nforward++] = xstrdup(argv[1]);
+	if (i == 1 && argv[1][1] == '-')
+	{
+	    if (argv[1][2] && !long_option(argv[1] + 2))
+	    {
+		fprintf(stderr, "sng: unknown option %s\n", argv[1]);
+		exit(1);
+	    }
+	    argc--;
+	    argv++;
+	    if (argv[0][2] == '\0')	/* `--' ends the options */
+		break;
+	    continue;
+	}
+
 	switch(argv[1][i]) {
 	case '\0':
 	    argc--;
@@ -183,8 +652,20 @@ int main(int argc, char *argv[])
 	    ++idat;
 	    i++;
 	    break;
+	case 'c':
+	    ++encoder_comment;
+	    i++;
+	    break;
+	case 'T':
+	    ++timing;
+	    i++;
+	    break;
 	case 'V':
 	    fprintf(stdout, "sng version " VERSION " by Eric S. Raymond.\n");
+	    fprintf(stdout, "libpng %s, compression backend %s.\n",
+		    png_get_libpng_ver(NULL), deflate_backend());
+	    fprintf(stdout, "%s kernels, for a CPU with %s.\n",
+		    kernels->name, cpu_description());
 	    exit(0);
 	case 'h':
 	default:
@@ -193,69 +674,163 @@ int main(int argc, char *argv[])
 	}
     }
 
+    if (verbose)
+	fprintf(stderr, "sng: using the %s kernels\n", kernels->name);
+    if (want_check_kernels)
+	exit(kernels_check());
+    else if (serve_socket)
+	exit(serve(serve_socket));
+    else if (connect_socket)
+	exit(client(connect_socket, want_stats, forward, nforward,
+		    argc - 1, argv + 1));
+    else if (want_tar)
+    {
+	if (argc > 1)
+	{
+	    fprintf(stderr, "sng: --tar reads standard input only\n");
+	    exit(1);
+	}
+	exit(tar_stream(stdin, stdout));
+    }
+    else if (want_watch)
+	exit(watch(argc - 1, argv + 1));
+    else if (want_verify)
+	exit(verify(argc - 1, argv + 1));
+    else if (want_cmp)
+    {
+	if (argc != 3)
+	{
+	    fprintf(stderr, "sng: --cmp compares two files\n");
+	    exit(2);
+	}
+	exit(compare(argv[1], argv[2], want_cmp > 1));
+    }
+    else if (want_digest)
+	exit(digest(argc - 1, argv + 1));
+
     if (argc == 1)
     {
 	if (isatty(0))
-	    fprintf(stderr, "sng: usage sng [-v] [file...]\n");
+	    fprintf(stderr, "sng: usage sng [-cTv] [--option=value...] [file...]\n");
 	else
 	{
-	    int	c = getchar();
-
-	    ungetc(c, stdin);
-
-	    if (isprint(c))
-		exit(sngc(stdin, "stdin", stdout));
-	    else
-		exit(sngd(stdin, "stdin", stdout));
+	    if (timing)
+	    {
+		timing_init(FALSE);
+		timing_start("stdin");
+	    }
+	    if (memory_report)
+		memory_start("stdin");
+	    /* a pipe may carry any number of images, back to back */
+	    error_status = convert_stream(stdin, "stdin", stdout, TRUE);
+	    if (timing)
+		timing_report();
+	    if (memory_report)
+		error_status = max(error_status, memory_finish());
+	    exit(error_status);
 	}
     } 
     else
     {
+	FILE	*fpbundle = NULL;
+	int	batched = (argc > 2 && queue_depth > 0);
+
+	if (bundle)
+	{
+	    if (strcmp(bundle, "-") == 0)
+		fpbundle = stdout;
+	    else if ((fpbundle = fopen(bundle, "w")) == NULL)
+	    {
+		fprintf(stderr,
+			"sng: couldn't open %s for output (%d)\n",
+			bundle, errno);
+		exit(1);
+	    }
+	    if (!bundle_start(bundle))
+	    {
+		fprintf(stderr, "sng: can't find the directory of %s (%d)\n",
+			bundle, errno);
+		exit(1);
+	    }
+	}
+
+	if (batched)
+	    batch_start(argv + 1, argc - 1, queue_depth);
+	if (timing)
+	    timing_init(argc > 2);
+
 	for (i = 1; i < argc; i++)
 	{
-	    int sng2png, dot = strlen(argv[i]) - 4;
-	    char outfile[BUFSIZ];
+	    int sng2png, status;
+	    char outfile[BUFSIZ], *data = NULL;
+	    size_t size = 0;
 	    FILE	*fpin, *fpout;
 
-	    if (argv[i][dot] != '.')
+	    if (timing)
+		timing_start(argv[i]);
+	    if (memory_report)
+		memory_start(argv[i]);
+	    if ((sng2png = output_name(argv[i], outfile)) < 0)
 	    {
 		fprintf(stderr, "sng: %s is neither SNG nor PNG\n", argv[i]);
 		error_status = max(error_status, 1);
 		continue;
 	    }
-	    else if (strcmp(argv[i] + dot, ".sng") == 0)
-	    {
-		sng2png = TRUE;
-		strncpy(outfile, argv[i], dot);
-		outfile[dot] = '\0';
-		strcat(outfile, ".png");
-	    }
-	    else if (strcmp(argv[i] + dot, ".png") == 0)
+
+	    if (!sng2png && fpbundle)
 	    {
-		sng2png = FALSE;
-		strncpy(outfile, argv[i], dot);
-		outfile[dot] = '\0';
-		strcat(outfile, ".sng");
+		/* compiling the bundle must put the image back where it was */
+		if (!bundle_name(argv[i], bundle_image))
+		{
+		    fprintf(stderr, "sng: %s isn't beneath the directory %s is"
+			    " in, so it can't be bundled\n", argv[i], bundle);
+		    error_status = max(error_status, 1);
+		    continue;
+		}
+		strcpy(outfile, bundle);
 	    }
-	    else
+
+	    PHASE_SET(PHASE_READ);
+	    if ((fpin = batched ? batch_input(i - 1) : fopen(argv[i], "r")) == NULL)
 	    {
-		fprintf(stderr, "sng: %s is neither SNG nor PNG\n", argv[i]);
+		fprintf(stderr,
+			"sng: couldn't open %s for input (%d)\n",
+			argv[i], errno);
 		error_status = max(error_status, 1);
 		continue;
 	    }
 
-	    if (verbose)
-		printf("sng: converting %s to %s\n", argv[i], outfile);
+	    if (cache_dir && !(fpbundle && !sng2png)
+		&& cache_lookup(fpin, argv[i], outfile, sng2png))
+	    {
+		if (verbose)
+		    printf("sng: %s is unchanged, %s is from the cache\n",
+			   argv[i], outfile);
+		fclose(fpin);
+		continue;
+	    }
 
-	    if ((fpin = fopen(argv[i], "r")) == NULL)
+	    /* a bundle names its own output files */
+	    if (sng2png && sngc_header(fpin) && strncmp(sngc_header(fpin),
+			BUNDLE_HEADER, strlen(BUNDLE_HEADER)) == 0)
 	    {
-		fprintf(stderr,
-			"sng: couldn't open %s for input (%d)\n",
-			argv[i], errno);
-		error_status = max(error_status, 1);
+		if (batched)
+		    batch_drain();
+		error_status = max(error_status, compile_bundle(fpin, argv[i]));
+		fclose(fpin);
+		if (batched)
+		    batch_invalidate();
 		continue;
 	    }
-	    if ((fpout = fopen(outfile, "w")) == NULL)
+
+	    if (verbose)
+		printf("sng: converting %s to %s\n", argv[i], outfile);
+
+	    if (!sng2png && fpbundle)
+		fpout = fpbundle;
+	    else if ((fpout = batched
+		      ? open_memstream(&data, &size)	/* batch.c writes it */
+		      : fopen(outfile, "w")) == NULL)
 	    {
 		fprintf(stderr,
 			"sng: couldn't open %s for output (%d)\n",
@@ -265,10 +840,42 @@ int main(int argc, char *argv[])
 	    }
 
 	    if (sng2png)
-		error_status = max(error_status, sngc(fpin, argv[i], fpout));
+	    {
+		status = compile_stream(fpin, argv[i], fpout, FALSE);
+		sngc_done(fpin);
+		fclose(fpin);
+	    }
 	    else
-		error_status = max(error_status, sngd(fpin, argv[i], fpout));
+		status = sngd(fpin, argv[i], fpout);
+	    error_status = max(error_status, status);
+
+	    PHASE_SET(PHASE_WRITE);
+	    if (fpout != fpbundle)
+	    {
+		if (fclose(fpout) != 0)
+		    status = 1;
+		if (batched)
+		{
+		    if (cache_dir && status == 0)
+			cache_store_data(data, size);
+		    batch_output(outfile, data, size);
+		}
+		else if (cache_dir && status == 0)
+		    cache_store(outfile);
+	    }
 	}
+
+	if (timing)
+	    timing_report();
+	if (memory_report)
+	    error_status = max(error_status, memory_finish());
+	if (batched)
+	    error_status = max(error_status, batch_finish());
+
+	if (fpbundle && fpbundle != stdout)
+	    fclose(fpbundle);
+	if (cache_dir && verbose)
+	    cache_report();
     }
 
     return error_status;
@@ -0,0 +1,344 @@
+/*****************************************************************************
+
+NAME
+   memory.c -- allocation accounting, for --memory.
+
+   Everything sng allocates goes through here: xalloc() and friends, the
+   buffers the image codecs get without xalloc() so they can fail
+   gracefully, and, by way of png_create_*_struct_2(), libpng's own
+   allocations and those of the zlib streams it runs.  Normally that
+   costs a test and a call.  With --memory, each live block is entered
+   in a table by address, and allocations, bytes and peak live bytes are
+   counted for each file converted and each subsystem:
+
+	libpng	what libpng and zlib allocate for themselves
+	pixels	image buffers, compiled or decoded
+	text	the chunks compiled from SNG, other than the image
+	colors	the color-name database
+	arena	the blocks arena.c carves per-conversion memory from
+	other	everything else
+
+   Code sets mem_subsystem around what it allocates for a subsystem;
+   whatever libpng allocates meanwhile goes to that subsystem too.  A
+   block is charged to the subsystem it was first allocated for, however
+   it grows.  The report for each file goes to standard error.  With
+   --memory-budget, a file whose peak is over the budget is an error,
+   which is what `make memcheck' looks for.
+
+   Memory stdio allocates for streams is not counted, nor are blocks
+   freed by code that doesn't come through here.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "png.h"
+#include "sng.h"
+
+int memory_report;
+long memory_budget;
+int mem_subsystem = MEM_OTHER;
+
+static const char *subsystem_names[MEM_COUNT] = {
+    "other", "libpng", "pixels", "text", "colors", "arena",
+};
+
+typedef struct
+{
+    unsigned long	allocations;
+    unsigned long	bytes;		/* allocated, over the file */
+    unsigned long	live;
+    unsigned long	peak;		/* of live, over the file */
+}
+usage;
+
+static usage total, subsystems[MEM_COUNT];
+static char *current_file;
+static int over_budget;
+
+/* the live blocks, an open-addressed table keyed by address */
+typedef struct
+{
+    void		*p;
+    unsigned long	size;
+    int			subsystem;
+}
+block;
+
+static block *blocks;
+static unsigned long nblocks, table_size;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*************************************************************************
+ *
+ * The table of live blocks
+ *
+ ************************************************************************/
+
+static unsigned long slot(void *p)
+/* where p's entry is, or would go */
+{
+    unsigned long i = ((unsigned long)p >> 4) * 2654435761UL;
+
+    for (i &= table_size - 1; blocks[i].p && blocks[i].p != p;
+	 i = (i + 1) & (table_size - 1))
+	continue;
+    return(i);
+}
+
+static void grow_table(void)
+/* double the table, or make the first one */
+{
+    block *old = blocks;
+    unsigned long i, old_size = table_size;
+
+    table_size = table_size ? 2 * table_size : 4096;
+    if ((blocks = calloc(table_size, sizeof(block))) == NULL)
+    {
+	/* carry on uncounted rather than fail the conversion */
+	fputs("sng: out of memory for allocation accounting\n", stderr);
+	blocks = old;
+	table_size = old_size;
+	memory_report = FALSE;
+	return;
+    }
+    for (i = 0; i < old_size; i++)
+	if (old[i].p)
+	    blocks[slot(old[i].p)] = old[i];
+    free(old);
+}
+
+static void enter(void *p, unsigned long size, int subsystem,
+		  unsigned long grown)
+/* count a block, new if grown is its size, otherwise reallocated */
+{
+    usage *up = &subsystems[subsystem];
+
+    if (2 * (nblocks + 1) > table_size)
+	grow_table();
+    if (!memory_report)
+	return;
+    blocks[slot(p)] = (block){p, size, subsystem};
+    nblocks++;
+
+    if (grown == size)
+    {
+	total.allocations++;
+	up->allocations++;
+    }
+    total.bytes += grown;
+    up->bytes += grown;
+    if ((total.live += size) > total.peak)
+	total.peak = total.live;
+    if ((up->live += size) > up->peak)
+	up->peak = up->live;
+}
+
+static int remove_block(void *p, unsigned long *size)
+/* forget a block, returning its subsystem, or -1 if we never knew it */
+{
+    unsigned long i, j, k;
+    int subsystem;
+
+    if (table_size == 0 || blocks[i = slot(p)].p == NULL)
+	return(-1);
+    *size = blocks[i].size;
+    subsystem = blocks[i].subsystem;
+    total.live -= *size;
+    subsystems[subsystem].live -= *size;
+    nblocks--;
+
+    /* close the gap, so later entries stay reachable */
+    for (j = i; ; )
+    {
+	blocks[i].p = NULL;
+	for (;;)
+	{
+	    j = (j + 1) & (table_size - 1);
+	    if (blocks[j].p == NULL)
+		return(subsystem);
+	    k = (((unsigned long)blocks[j].p >> 4) * 2654435761UL)
+		& (table_size - 1);
+	    if (i <= j ? (i >= k || k > j) : (i >= k && k > j))
+		break;
+	}
+	blocks[i] = blocks[j];
+	i = j;
+    }
+}
+
+/*************************************************************************
+ *
+ * Allocation
+ *
+ ************************************************************************/
+
+static void *counted_alloc(unsigned long s, int subsystem, unsigned long align)
+{
+    void *p;
+
+    if (align == 0)
+	p = malloc((size_t)s);
+    else if (posix_memalign(&p, (size_t)align, (size_t)s) != 0)
+	p = NULL;
+
+    if (memory_report && p)
+    {
+	pthread_mutex_lock(&lock);
+	enter(p, s, subsystem, s);
+	pthread_mutex_unlock(&lock);
+    }
+    return(p);
+}
+
+void *mem_alloc(unsigned long s)
+/* malloc, counted; NULL if there's no memory */
+{
+    return(counted_alloc(s, mem_subsystem, 0));
+}
+
+void *mem_aligned_alloc(unsigned long align, unsigned long s)
+/* mem_alloc(), starting on a multiple of align, a power of two */
+{
+    return(counted_alloc(s, mem_subsystem, align));
+}
+
+void *mem_realloc(void *p, unsigned long s)
+/*
+ * realloc, counted; NULL, leaving p alone, if there's no memory.  A block
+ * that grows is still one allocation, and only its growth is new bytes.
+ */
+{
+    unsigned long size = 0;
+    int subsystem;
+    void *q;
+
+    if (!memory_report || p == NULL)
+	return(p ? realloc(p, (size_t)s) : mem_alloc(s));
+
+    /* p may be handed out again as soon as it is freed */
+    pthread_mutex_lock(&lock);
+    if ((subsystem = remove_block(p, &size)) < 0)
+	subsystem = mem_subsystem;
+    if ((q = realloc(p, (size_t)s)) != NULL)
+	enter(q, s, subsystem, s > size ? s - size : 0);
+    else if (size)
+	enter(p, size, subsystem, 0);
+    pthread_mutex_unlock(&lock);
+    return(q);
+}
+
+void xfree(void *p)
+/* free anything allocated here */
+{
+    unsigned long size;
+
+    if (memory_report && p)
+    {
+	pthread_mutex_lock(&lock);
+	remove_block(p, &size);
+	pthread_mutex_unlock(&lock);
+    }
+    free(p);
+}
+
+static png_voidp png_alloc(png_structp png_ptr, png_alloc_size_t size)
+/* libpng's allocator; what libpng asks for is its own unless we say */
+{
+    return(counted_alloc(size, mem_subsystem == MEM_OTHER
+			 ? MEM_LIBPNG : mem_subsystem, 0));
+}
+
+static void png_release(png_structp png_ptr, png_voidp p)
+{
+    xfree(p);
+}
+
+png_structp mem_create_read_struct(void)
+/* png_create_read_struct(), with the allocations counted */
+{
+    return(png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+				    NULL, png_alloc, png_release));
+}
+
+png_structp mem_create_write_struct(png_error_ptr warn_fn)
+/* png_create_write_struct(), with the allocations counted */
+{
+    return(png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL,
+				     warn_fn, NULL, png_alloc, png_release));
+}
+
+void *mem_zalloc(void *opaque, unsigned int items, unsigned int size)
+/* zlib's allocator, for the streams we run ourselves */
+{
+    return(counted_alloc((unsigned long)items * size, MEM_LIBPNG, 0));
+}
+
+void mem_zfree(void *opaque, void *p)
+{
+    xfree(p);
+}
+
+/*************************************************************************
+ *
+ * Reporting
+ *
+ ************************************************************************/
+
+void memory_start(char *name)
+/* begin counting for a file, reporting on the last one if need be */
+{
+    int i;
+
+    memory_stop();
+    pthread_mutex_lock(&lock);
+    total.allocations = total.bytes = 0;
+    total.peak = total.live;
+    for (i = 0; i < MEM_COUNT; i++)
+    {
+	subsystems[i].allocations = subsystems[i].bytes = 0;
+	subsystems[i].peak = subsystems[i].live;
+    }
+    pthread_mutex_unlock(&lock);
+    current_file = name;
+}
+
+void memory_stop(void)
+/* report on the file being counted */
+{
+    int i;
+
+    if (current_file == NULL)
+	return;
+    fprintf(stderr, "sng: %s: %lu allocations, %lu bytes, peak %lu bytes live\n",
+	    current_file, total.allocations, total.bytes, total.peak);
+    fprintf(stderr, "    %-9s %12s %12s %12s\n",
+	    "subsystem", "allocations", "bytes", "peak");
+    for (i = 1; i <= MEM_COUNT; i++)
+    {
+	usage *up = &subsystems[i % MEM_COUNT];	/* other goes last */
+
+	if (up->allocations || up->peak)
+	    fprintf(stderr, "    %-9s %12lu %12lu %12lu\n",
+		    subsystem_names[i % MEM_COUNT],
+		    up->allocations, up->bytes, up->peak);
+    }
+    if (memory_budget && total.peak > memory_budget)
+    {
+	fprintf(stderr,
+		"sng: %s: peak of %lu bytes is over the budget of %ld\n",
+		current_file, total.peak, memory_budget);
+	over_budget = TRUE;
+    }
+    current_file = NULL;
+}
+
+int memory_finish(void)
+/* report on the last file; 1 if any went over budget */
+{
+    memory_stop();
+    return(over_budget);
+}
+
+/* memory.c ends here */
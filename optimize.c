@@ -0,0 +1,293 @@
+/*****************************************************************************
+
+NAME
+   optimize.c -- find the smallest IDAT encoding by trial compression.
+
+   Every combination of row filter, zlib level and zlib strategy we try
+   is a complete libpng write of the image rows into memory.  The trials
+   run on worker threads; the smallest IDAT stream wins and is spliced
+   into the real output by sngc().
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "png.h"
+#include "zlib.h"
+#include "sng.h"
+
+#ifdef PNG_INFO_IMAGE_SUPPORTED
+
+static struct {
+    char	*name;
+    int		value;
+} trial_filters[] = {
+    {"none",		PNG_FILTER_NONE},
+    {"sub",		PNG_FILTER_SUB},
+    {"up",		PNG_FILTER_UP},
+    {"avg",		PNG_FILTER_AVG},
+    {"paeth",		PNG_FILTER_PAETH},
+    {"adaptive",	PNG_ALL_FILTERS},
+}, trial_strategies[] = {
+    {"default",		Z_DEFAULT_STRATEGY},
+    {"filtered",	Z_FILTERED},
+    {"rle",		Z_RLE},
+};
+
+#define NFILTERS	(sizeof(trial_filters)/sizeof(trial_filters[0]))
+#define NSTRATEGIES	(sizeof(trial_strategies)/sizeof(trial_strategies[0]))
+#define MAX_TRIALS	(NFILTERS * NSTRATEGIES)
+
+typedef struct {
+    char	*filter_name, *strategy_name;
+    int		filters, level, strategy;
+} trial;
+
+/* everything the workers share; members below `lock' are guarded by it */
+static struct {
+    png_structp		png_ptr;	/* the image being compiled */
+    png_infop		info_ptr;
+    int			transforms;
+    encoder_settings	settings;
+    trial		trials[MAX_TRIALS];
+    int			ntrials;
+
+    pthread_mutex_t	lock;
+    int			next;		/* next trial to hand out */
+    int			best;		/* index of smallest result */
+    membuf		best_png;
+} job;
+
+static void trial_warning(png_structp png_ptr, png_const_charp msg)
+/* the real write will issue any warnings that matter */
+{
+}
+
+static void run_trial(trial *tp, membuf *out)
+/* write the image rows into memory with one set of encoder parameters */
+{
+    png_structp tpng;
+    png_infop tinfo;
+    png_uint_32 width, height;
+    int bit_depth, color_type, interlace_type;
+    png_colorp palette;
+    int num_palette;
+    png_color_8p sig_bit;
+    filter_chooser fc;
+
+    memset(out, '\0', sizeof(membuf));
+    memset(&fc, '\0', sizeof(filter_chooser));
+    tpng = mem_create_write_struct(trial_warning);
+    if (tpng == NULL)
+	return;
+    tinfo = png_create_info_struct(tpng);
+    if (tinfo == NULL || setjmp(png_jmpbuf(tpng)))
+    {
+	png_destroy_write_struct(&tpng, &tinfo);
+	filter_chooser_free(&fc);
+	membuf_free(out);
+	return;
+    }
+    png_set_write_fn(tpng, out, membuf_write, membuf_flush);
+
+    /* only the chunks that affect the IDAT stream matter here */
+    png_get_IHDR(job.png_ptr, job.info_ptr, &width, &height,
+		 &bit_depth, &color_type, &interlace_type, NULL, NULL);
+    png_set_IHDR(tpng, tinfo, width, height, bit_depth, color_type,
+		 interlace_type, PNG_COMPRESSION_TYPE_DEFAULT,
+		 PNG_FILTER_TYPE_DEFAULT);
+    if (png_get_PLTE(job.png_ptr, job.info_ptr, &palette, &num_palette))
+	png_set_PLTE(tpng, tinfo, palette, num_palette);
+    if (png_get_sBIT(job.png_ptr, job.info_ptr, &sig_bit))
+	png_set_sBIT(tpng, tinfo, sig_bit);
+
+    png_set_compression_level(tpng, tp->level);
+    png_set_compression_strategy(tpng, tp->strategy);
+    png_set_compression_window_bits(tpng, job.settings.window_bits);
+    png_set_compression_mem_level(tpng, job.settings.mem_level);
+    if (job.settings.idat_size != ENCODER_DEFAULT)
+	png_set_compression_buffer_size(tpng, job.settings.idat_size);
+    png_set_filter(tpng, PNG_FILTER_TYPE_BASE, tp->filters);
+    filter_chooser_init(tpng, tinfo, &fc, tp->filters);
+
+    png_set_rows(tpng, tinfo, png_get_rows(job.png_ptr, job.info_ptr));
+    png_write_png(tpng, tinfo, job.transforms, NULL);
+    png_destroy_write_struct(&tpng, &tinfo);
+    filter_chooser_free(&fc);
+}
+
+static void *trial_worker(void *arg)
+/* run trials until there are none left, keeping only the best result */
+{
+    for (;;)
+    {
+	int	n;
+	membuf	out;
+
+	pthread_mutex_lock(&job.lock);
+	n = job.next++;
+	pthread_mutex_unlock(&job.lock);
+	if (n >= job.ntrials)
+	    break;
+
+	run_trial(&job.trials[n], &out);
+
+	pthread_mutex_lock(&job.lock);
+	if (out.size && (job.best < 0 || out.size < job.best_png.size
+			 || (out.size == job.best_png.size && n < job.best)))
+	{
+	    membuf_free(&job.best_png);
+	    job.best_png = out;
+	    job.best = n;
+	}
+	else
+	    membuf_free(&out);
+	pthread_mutex_unlock(&job.lock);
+    }
+    return NULL;
+}
+
+static void add_trials(encoder_settings *ep)
+/* enumerate the combinations the encoder settings leave open */
+{
+    int f, s;
+
+    job.ntrials = 0;
+    for (f = 0; f < NFILTERS; f++)
+    {
+	if (ep->filters != ENCODER_DEFAULT
+	    && trial_filters[f].value != ep->filters)
+	    continue;
+	for (s = 0; s < NSTRATEGIES; s++)
+	{
+	    trial *tp = &job.trials[job.ntrials];
+
+	    if (ep->strategy != ENCODER_DEFAULT
+		&& trial_strategies[s].value != ep->strategy)
+		continue;
+	    tp->filter_name = trial_filters[f].name;
+	    tp->filters = trial_filters[f].value;
+	    tp->strategy_name = trial_strategies[s].name;
+	    tp->strategy = trial_strategies[s].value;
+	    tp->level = (ep->level != ENCODER_DEFAULT) ? ep->level : 9;
+	    job.ntrials++;
+	}
+    }
+
+    /* a filter set or strategy we don't enumerate is tried as given */
+    if (job.ntrials == 0)
+    {
+	trial *tp = &job.trials[job.ntrials++];
+
+	tp->filter_name = "as given";
+	tp->filters = (ep->filters != ENCODER_DEFAULT) ? ep->filters : PNG_ALL_FILTERS;
+	tp->strategy_name = "as given";
+	tp->strategy = (ep->strategy != ENCODER_DEFAULT) ? ep->strategy : Z_DEFAULT_STRATEGY;
+	tp->level = (ep->level != ENCODER_DEFAULT) ? ep->level : 9;
+    }
+}
+
+static int recompress_idat(membuf *idat)
+/* see if the whole-buffer backend can squeeze the winner's rows further */
+{
+    png_uint_32 width, height;
+    int bit_depth, color_type, interlace_type, ok;
+    membuf zdata, raw, better, check;
+
+    /* zlib has already had its best shot, and others want a 32K window */
+    if (deflate_is_zlib() || job.settings.window_bits != 15)
+	return(FALSE);
+
+    png_get_IHDR(job.png_ptr, job.info_ptr, &width, &height,
+		 &bit_depth, &color_type, &interlace_type, NULL, NULL);
+    join_idat(idat, &zdata);
+    raw.room = raw.size = raw_idat_size(width, height,
+					bit_depth, color_type, interlace_type);
+    raw.data = xalloc(raw.room);
+    better.room = better.size = deflate_bound(raw.room);
+    better.data = xalloc(better.room);
+    check.room = check.size = raw.room;
+    check.data = xalloc(check.room);
+
+    ok = inflate_buffer(raw.data, &raw.size, zdata.data, zdata.size)
+	&& raw.size == raw.room
+	&& deflate_buffer(better.data, &better.size, raw.data, raw.size,
+			  job.settings.level != ENCODER_DEFAULT
+			  ? job.settings.level : DEFLATE_BEST)
+	&& better.size < zdata.size
+	/* don't write anything we can't read back */
+	&& inflate_buffer(check.data, &check.size, better.data, better.size)
+	&& check.size == raw.size
+	&& memcmp(check.data, raw.data, raw.size) == 0;
+    if (ok)
+    {
+	membuf_free(idat);
+	make_idat(&better, job.settings.idat_size != ENCODER_DEFAULT
+		  ? job.settings.idat_size : PNG_ZBUF_SIZE, idat);
+    }
+
+    membuf_free(&zdata);
+    membuf_free(&raw);
+    membuf_free(&better);
+    membuf_free(&check);
+    return(ok);
+}
+
+int optimize_idat(png_structp png_ptr, png_infop info_ptr, int transforms,
+		  encoder_settings *ep, membuf *idat)
+/* trial-compress the rows attached to info_ptr; return the best IDATs */
+{
+    pthread_t workers[MAX_TRIALS];
+    int i, nworkers, recompressed;
+
+    job.png_ptr = png_ptr;
+    job.info_ptr = info_ptr;
+    job.transforms = transforms;
+    job.settings = *ep;
+    if (job.settings.window_bits == ENCODER_DEFAULT)
+	job.settings.window_bits = 15;
+    if (job.settings.mem_level == ENCODER_DEFAULT)
+	job.settings.mem_level = 9;
+    add_trials(&job.settings);
+
+    pthread_mutex_init(&job.lock, NULL);
+    job.next = 0;
+    job.best = -1;
+    memset(&job.best_png, '\0', sizeof(membuf));
+
+    nworkers = (jobs < job.ntrials) ? jobs : job.ntrials;
+    for (i = 0; i < nworkers; i++)
+	if (pthread_create(&workers[i], NULL, trial_worker, NULL) != 0)
+	    break;
+    if (i == 0)			/* no threads to be had; do it ourselves */
+	trial_worker(NULL);
+    nworkers = i;
+    for (i = 0; i < nworkers; i++)
+	pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+
+    if (job.best < 0)
+	return(FALSE);
+
+    extract_idat(&job.best_png, idat);
+    membuf_free(&job.best_png);
+    recompressed = recompress_idat(idat);
+
+    fprintf(stderr,
+	    "sng: %s: best of %d trials is filter %s, level %d, strategy %s"
+	    "%s%s (%lu bytes of IDAT)\n",
+	    file, job.ntrials,
+	    job.trials[job.best].filter_name,
+	    job.trials[job.best].level,
+	    job.trials[job.best].strategy_name,
+	    recompressed ? ", recompressed with " : "",
+	    recompressed ? deflate_backend() : "",
+	    (unsigned long)idat->size);
+    return(TRUE);
+}
+
+#endif /* PNG_INFO_IMAGE_SUPPORTED */
+
+/* optimize.c ends here */
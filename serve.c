@@ -0,0 +1,848 @@
+/*****************************************************************************
+
+NAME
+   serve.c -- a conversion daemon on a Unix socket, and its client.
+
+   `sng --serve=SOCKET' loads the color tables once and forks a pool of
+   workers that accept connections on the socket, so a busy caller pays
+   for exec, dynamic linking and rgb.txt only at startup.  Each request
+   is framed by a header line:
+
+	SNG/1 convert LENGTH NAME [option...]	LENGTH bytes of PNG or SNG
+	SNG/1 path LENGTH NAME [option...]	LENGTH bytes naming a file
+	SNG/1 verify LENGTH NAME [option...]	LENGTH bytes naming a file
+	SNG/1 digest LENGTH NAME [option...]	LENGTH bytes naming a file
+	SNG/1 stats 0
+
+   NAME is used in messages, with `%XX' standing for awkward bytes.  The
+   options are sng's own encoder options and -c, -i, -v; a bad value
+   fails the request rather than the worker.  The direction is taken
+   from the data, as in pipe mode.  A verify request puts the file
+   through verify.c's round trip instead, and a digest request has
+   compare.c hash its pixels.  Every request is answered by
+
+	SNG/1 STATUS OUTLEN ERRLEN
+
+   followed by OUTLEN bytes of converted output and ERRLEN bytes of what
+   sng would have said on stderr.  A connection may carry any number of
+   requests.  `sng --connect=SOCKET' is the client, and behaves like sng.
+   The same workers, each on a socket pair rather than a named socket,
+   do the converting for --tar and --watch, and the checking for --verify
+   and --digest.
+
+   Path, verify and digest requests name files on the server's side,
+   which the worker opens with the server's permissions, wherever they
+   are.  Whoever can connect can read anything the server can, so the
+   socket is made accessible to its owner alone; loosen that only for
+   users trusted that far.
+
+*****************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "png.h"
+#include "sng.h"
+
+#define PROTOCOL	"SNG/1"
+#define MAX_WORKERS	64
+#define MAX_REQUESTS	1000		/* recycle a worker after this many */
+#define MAX_PAYLOAD	(1L << 30)	/* refuse requests larger than this */
+#define MAX_OPTIONS	32
+
+/*************************************************************************
+ *
+ * Counters
+ *
+ * These live in memory shared by the whole pool.  Latencies go into a
+ * histogram with eight buckets per power of two of microseconds, which
+ * is close enough for percentiles.
+ *
+ ************************************************************************/
+
+#define LATENCY_BUCKETS	(8 * 40)
+
+static struct counters {
+    unsigned long	requests, errors, bytes_in, bytes_out;
+    unsigned long	latency[LATENCY_BUCKETS];
+} *counters;
+
+static int latency_bucket(unsigned long usec)
+/* histogram bucket for a latency */
+{
+    int e, b;
+
+    if (usec < 8)
+	return(usec);
+    for (e = 3; (usec >> e) > 1; e++)
+	continue;
+    b = (e - 2) * 8 + ((usec >> (e - 3)) & 7);
+    return((b < LATENCY_BUCKETS) ? b : LATENCY_BUCKETS - 1);
+}
+
+static unsigned long bucket_latency(int b)
+/* the smallest latency falling in a bucket */
+{
+    int e = b / 8 + 2;
+
+    if (b < 8)
+	return(b);
+    return((8UL + b % 8) << (e - 3));
+}
+
+static unsigned long percentile(int p)
+/* latency in microseconds under which p percent of requests finished */
+{
+    unsigned long total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++)
+	total += counters->latency[b];
+    for (b = 0; b < LATENCY_BUCKETS; b++)
+	if ((seen += counters->latency[b]) * 100 >= total * p && total)
+	    return(bucket_latency(b));
+    return(0);
+}
+
+static void count_request(int status, size_t in, size_t out,
+			  struct timespec *start)
+/* record one finished request */
+{
+    struct timespec end;
+    unsigned long usec;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    usec = (end.tv_sec - start->tv_sec) * 1000000UL
+	+ (end.tv_nsec - start->tv_nsec) / 1000;
+    __sync_fetch_and_add(&counters->requests, 1);
+    if (status)
+	__sync_fetch_and_add(&counters->errors, 1);
+    __sync_fetch_and_add(&counters->bytes_in, in);
+    __sync_fetch_and_add(&counters->bytes_out, out);
+    __sync_fetch_and_add(&counters->latency[latency_bucket(usec)], 1);
+}
+
+static void report_counters(FILE *fp)
+/* the answer to a stats request */
+{
+    fprintf(fp, "requests %lu\n", counters->requests);
+    fprintf(fp, "errors %lu\n", counters->errors);
+    fprintf(fp, "bytes-in %lu\n", counters->bytes_in);
+    fprintf(fp, "bytes-out %lu\n", counters->bytes_out);
+    fprintf(fp, "latency-p50 %luus\n", percentile(50));
+    fprintf(fp, "latency-p90 %luus\n", percentile(90));
+    fprintf(fp, "latency-p99 %luus\n", percentile(99));
+}
+
+/*************************************************************************
+ *
+ * Framing
+ *
+ ************************************************************************/
+
+static void escape_name(const char *name, char *buf, size_t size)
+/* encode a name so it is one word of a header line */
+{
+    const unsigned char *cp;
+    char *bp = buf;
+
+    for (cp = (const unsigned char *)name; *cp && bp + 4 < buf + size; cp++)
+	if (*cp <= ' ' || *cp == '%' || *cp >= 127)
+	    bp += sprintf(bp, "%%%02X", *cp);
+	else
+	    *bp++ = *cp;
+    *bp = '\0';
+}
+
+static void unescape_name(char *name)
+/* undo escape_name() in place */
+{
+    char *in, *out;
+    unsigned int c;
+
+    for (in = out = name; *in; out++)
+	if (in[0] == '%' && isxdigit(in[1]) && isxdigit(in[2])
+	    && sscanf(in + 1, "%2x", &c) == 1)
+	{
+	    *out = c;
+	    in += 3;
+	}
+	else
+	    *out = *in++;
+    *out = '\0';
+}
+
+static int read_fully(FILE *fp, char *buf, size_t len)
+/* read exactly len bytes; FALSE on a short read */
+{
+    return(len == 0 || fread(buf, 1, len, fp) == len);
+}
+
+static int read_all(FILE *fp, char **buf, size_t *len)
+/* slurp the rest of fp; FALSE on a read error */
+{
+    size_t room = BUFSIZ, n;
+
+    *buf = xalloc(room);
+    *len = 0;
+    while ((n = fread(*buf + *len, 1, room - *len, fp)) > 0)
+	if ((*len += n) == room)
+	    *buf = xrealloc(*buf, room *= 2);
+    return(!ferror(fp));
+}
+
+/*************************************************************************
+ *
+ * Workers
+ *
+ ************************************************************************/
+
+static int allowed_option(char *word)
+/* can a request carry this option? */
+{
+    static char *allowed[] = {"level", "strategy", "window-bits", "mem-level",
+			      "filters", "idat-size", "optimize", "libpng",
+			      "jobs"};
+    size_t i, n;
+
+    if (word[0] != '-')
+	return(FALSE);
+    if (word[1] != '-')
+	return(word[1] && strspn(word + 1, "civ") == strlen(word + 1));
+    n = strcspn(word + 2, "=");
+    for (i = 0; i < sizeof(allowed)/sizeof(allowed[0]); i++)
+	if (strlen(allowed[i]) == n && strncmp(word + 2, allowed[i], n) == 0)
+	    return(TRUE);
+    return(FALSE);
+}
+
+static int run_request(char *op, char *name, char *data, size_t len,
+		       FILE *fpout)
+/* carry out one conversion, with stderr already redirected */
+{
+    FILE *fpin;
+
+    if (strcmp(op, "digest") == 0)
+    {
+	char *path = xalloc(len + 1);
+	int status;
+
+	memcpy(path, data, len);
+	path[len] = '\0';
+	status = digest_file(path, fpout);
+	free(path);
+	return(status);
+    }
+    else if (strcmp(op, "path") == 0 || strcmp(op, "verify") == 0)
+    {
+	char *path = xalloc(len + 1);
+
+	memcpy(path, data, len);
+	path[len] = '\0';
+	fpin = fopen(path, "r");
+	if (fpin == NULL)
+	    fprintf(stderr, "sng: couldn't open %s for input (%d)\n", path, errno);
+	free(path);
+	if (fpin && strcmp(op, "verify") == 0)
+	{
+	    char *contents;
+	    size_t size;
+	    int status = 1;
+
+	    if (read_all(fpin, &contents, &size))
+		status = verify_file(name, contents, size, fpout);
+	    else
+		fprintf(stderr, "sng: %s: read error\n", name);
+	    fclose(fpin);
+	    free(contents);
+	    return(status);
+	}
+    }
+    else if (len == 0)
+    {
+	fputs("sng: no data in file\n", stderr);
+	return(1);
+    }
+    else
+	fpin = fmemopen(data, len, "r");
+    if (fpin == NULL)
+	return(1);
+    return(convert_stream(fpin, name, fpout, FALSE));
+}
+
+static int serve_request(FILE *rfp, FILE *wfp, int errfd)
+/* read, run and answer one request; FALSE when the connection is done */
+{
+    char line[BUFSIZ], *word[MAX_OPTIONS + 4], *cp, *data = NULL, *out = NULL;
+    char *err = NULL;
+    int nwords = 0, status = 0, i, stderr_fd;
+    size_t outlen = 0, errlen = 0;
+    long len;
+    struct timespec start;
+    FILE *fpout;
+
+    /* per-request options must not outlive the request */
+    int save_verbose = verbose, save_idat = idat, save_comment = encoder_comment;
+    int save_optimize = optimize, save_jobs = jobs, save_libpng = use_libpng;
+    encoder_settings save_encoder = encoder;
+
+    if (fgets(line, sizeof(line), rfp) == NULL)
+	return(FALSE);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (cp = strtok(line, " \t\r\n"); cp && nwords < MAX_OPTIONS + 4;
+	 cp = strtok(NULL, " \t\r\n"))
+	word[nwords++] = cp;
+    if (nwords < 3 || strcmp(word[0], PROTOCOL) != 0
+	|| (len = atol(word[2])) < 0 || len > MAX_PAYLOAD)
+	return(FALSE);
+    data = xalloc(len + 1);
+    if (!read_fully(rfp, data, len))
+    {
+	free(data);
+	return(FALSE);
+    }
+
+    /* fd 2 shares errfd's offset, so what's said lands at its start */
+    fflush(stderr);
+    stderr_fd = dup(2);
+    lseek(errfd, 0, SEEK_SET);
+    dup2(errfd, 2);
+    fpout = open_memstream(&out, &outlen);
+
+    if (strcmp(word[1], "stats") == 0)
+	report_counters(fpout);
+    else if ((strcmp(word[1], "convert") == 0 || strcmp(word[1], "path") == 0
+	      || strcmp(word[1], "verify") == 0
+	      || strcmp(word[1], "digest") == 0) && nwords >= 4)
+    {
+	unescape_name(word[3]);
+	for (i = 4; i < nwords; i++)
+	    if (!allowed_option(word[i]))
+	    {
+		fprintf(stderr, "sng: unknown option %s\n", word[i]);
+		status = 1;
+	    }
+	    else if (!apply_option(word[i]))
+	    {
+		fprintf(stderr, "sng: bad option %s\n", word[i]);
+		status = 1;
+	    }
+	if (status == 0)
+	    status = run_request(word[1], word[3], data, len, fpout);
+	png_ptr = NULL;
+	info_ptr = NULL;
+	file = NULL;
+    }
+    else
+    {
+	fprintf(stderr, "sng: unknown request %s\n", word[1]);
+	status = 1;
+    }
+
+    fclose(fpout);
+    fflush(stderr);
+    dup2(stderr_fd, 2);
+    close(stderr_fd);
+    verbose = save_verbose;
+    idat = save_idat;
+    encoder_comment = save_comment;
+    optimize = save_optimize;
+    jobs = save_jobs;
+    use_libpng = save_libpng;
+    encoder = save_encoder;
+
+    errlen = lseek(errfd, 0, SEEK_CUR);
+    err = xalloc(errlen + 1);
+    if (pread(errfd, err, errlen, 0) != errlen)
+	errlen = 0;
+
+    fprintf(wfp, "%s %d %lu %lu\n", PROTOCOL, status,
+	    (unsigned long)outlen, (unsigned long)errlen);
+    fwrite(out, 1, outlen, wfp);
+    fwrite(err, 1, errlen, wfp);
+    fflush(wfp);
+    if (strcmp(word[1], "stats") != 0)
+	count_request(status, len, outlen, &start);
+
+    free(data);
+    free(out);
+    free(err);
+    return(!ferror(wfp));
+}
+
+static FILE *worker_init(void)
+/* what every worker does first; returns the file stderr is caught in */
+{
+    FILE *errfp = tmpfile();
+
+    if (errfp == NULL)
+    {
+	perror("sng: worker can't make a scratch file");
+	exit(2);
+    }
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    return(errfp);
+}
+
+static void worker(int sock)
+/* accept connections and serve them until it's time to make way */
+{
+    FILE *errfp = worker_init();
+    int served = 0;
+
+    while (served < MAX_REQUESTS)
+    {
+	int fd = accept(sock, NULL, NULL);
+	FILE *rfp, *wfp;
+
+	if (fd < 0)
+	{
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    perror("sng: accept");
+	    exit(2);
+	}
+	rfp = fdopen(fd, "r");
+	wfp = fdopen(dup(fd), "w");
+	if (rfp == NULL || wfp == NULL)
+	    close(fd);
+	else
+	    while (served < MAX_REQUESTS
+		   && serve_request(rfp, wfp, fileno(errfp)))
+		served++;
+	if (rfp)
+	    fclose(rfp);
+	if (wfp)
+	    fclose(wfp);
+    }
+    exit(0);
+}
+
+/*************************************************************************
+ *
+ * The pool
+ *
+ ************************************************************************/
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig)
+{
+    stopping = sig;
+}
+
+static int listen_on(char *path)
+/* make the listening socket, replacing a dead one left at path */
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+	fprintf(stderr, "sng: socket name %s is too long\n", path);
+	return(-1);
+    }
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+	perror("sng: socket");
+	return(-1);
+    }
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	{
+	    fprintf(stderr, "sng: a server is already listening on %s\n", path);
+	    close(sock);
+	    return(-1);
+	}
+	unlink(path);
+	close(sock);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    /* the socket is as good as a login, so only its owner gets one */
+    mask = umask(077);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	|| listen(sock, 64) != 0)
+    {
+	umask(mask);
+	fprintf(stderr, "sng: can't listen on %s (%d)\n", path, errno);
+	close(sock);
+	return(-1);
+    }
+    umask(mask);
+    return(sock);
+}
+
+int serve(char *path)
+/* run the conversion daemon until told to stop */
+{
+    pid_t pids[MAX_WORKERS];
+    int sock, nworkers, i;
+    struct sigaction sa;
+
+    nworkers = (jobs < MAX_WORKERS) ? jobs : MAX_WORKERS;
+    counters = mmap(NULL, sizeof(*counters), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counters == MAP_FAILED)
+    {
+	perror("sng: can't share counters");
+	return(2);
+    }
+    memset(counters, '\0', sizeof(*counters));
+    if ((sock = listen_on(path)) < 0)
+	return(2);
+
+    /* the warm state every worker inherits */
+    sngc_preload();
+    sngd_preload();
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = stop;		/* no SA_RESTART, so waitpid wakes up */
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    for (i = 0; i < nworkers; i++)
+	pids[i] = -1;
+    while (!stopping)
+    {
+	pid_t pid;
+
+	for (i = 0; i < nworkers; i++)
+	    if (pids[i] < 0)
+	    {
+		fflush(NULL);
+		if ((pids[i] = fork()) == 0)
+		    worker(sock);
+		else if (pids[i] < 0)
+		{
+		    perror("sng: fork");
+		    stopping = SIGTERM;
+		}
+	    }
+	if (stopping)
+	    break;
+	if ((pid = waitpid(-1, NULL, 0)) > 0)
+	{
+	    for (i = 0; i < nworkers; i++)
+		if (pids[i] == pid)
+		    pids[i] = -1;
+	}
+	else if (errno == ECHILD)
+	    sleep(1);			/* forks are failing; don't spin */
+    }
+
+    for (i = 0; i < nworkers; i++)
+	if (pids[i] > 0)
+	    kill(pids[i], SIGTERM);
+    while (wait(NULL) > 0 || errno == EINTR)
+	continue;
+    close(sock);
+    unlink(path);
+    return(0);
+}
+
+/*************************************************************************
+ *
+ * The client
+ *
+ ************************************************************************/
+
+static int send_request(FILE *wfp, char *op, char *name,
+			char **options, int noptions, char *data, size_t len)
+/* send one request; FALSE if the other end is gone */
+{
+    char escaped[BUFSIZ];
+    int i;
+
+    escape_name(name, escaped, sizeof(escaped));
+    fprintf(wfp, "%s %s %lu %s", PROTOCOL, op, (unsigned long)len, escaped);
+    for (i = 0; i < noptions; i++)
+	fprintf(wfp, " %s", options[i]);
+    fputc('\n', wfp);
+    fwrite(data, 1, len, wfp);
+    return(fflush(wfp) == 0);
+}
+
+static int receive_reply(FILE *rfp, char **out, size_t *outlen)
+/* collect the answer to a request, passing on what it said to stderr */
+{
+    char line[BUFSIZ], *buf;
+    unsigned long size, errlen;
+    int status;
+
+    if (fgets(line, sizeof(line), rfp) == NULL
+	|| sscanf(line, PROTOCOL " %d %lu %lu", &status, &size, &errlen) != 3)
+	return(-1);
+    buf = xalloc(size + errlen + 1);
+    if (!read_fully(rfp, buf, size + errlen))
+    {
+	free(buf);
+	return(-1);
+    }
+    fwrite(buf + size, 1, errlen, stderr);
+    *out = buf;
+    *outlen = size;
+    return(status);
+}
+
+static int request(FILE *rfp, FILE *wfp, char *op, char *name,
+		   char **options, int noptions, char *data, size_t len,
+		   FILE *fpout)
+/* send one request and deliver its answer; the exit status, or -1 */
+{
+    char *buf;
+    size_t outlen;
+    int status;
+
+    if (!send_request(wfp, op, name, options, noptions, data, len)
+	|| (status = receive_reply(rfp, &buf, &outlen)) < 0)
+    {
+	fprintf(stderr, "sng: the server dropped the connection\n");
+	return(-1);
+    }
+    fwrite(buf, 1, outlen, fpout);
+    free(buf);
+    return(status);
+}
+
+int client(char *path, int stats, char **options, int noptions,
+	   int nfiles, char **files)
+/* have the server at path do what sng would do with these arguments */
+{
+    struct sockaddr_un addr;
+    char *passed[MAX_OPTIONS], *data;
+    int sock, npassed = 0, error_status = 0, status = 0, i;
+    size_t len;
+    FILE *rfp, *wfp;
+
+    /* our own options stay here */
+    for (i = 0; i < noptions && npassed < MAX_OPTIONS; i++)
+	if (strncmp(options[i], "--serve", 7) && strncmp(options[i], "--connect", 9)
+	    && strcmp(options[i], "--stats") && strncmp(options[i], "--bundle", 8)
+	    && strcmp(options[i], "--"))
+	    passed[npassed++] = options[i];
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+	fprintf(stderr, "sng: socket name %s is too long\n", path);
+	return(2);
+    }
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	|| connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+	fprintf(stderr, "sng: can't connect to %s (%d)\n", path, errno);
+	return(2);
+    }
+    rfp = fdopen(sock, "r");
+    wfp = fdopen(dup(sock), "w");
+    signal(SIGPIPE, SIG_IGN);
+
+    if (stats)
+	status = request(rfp, wfp, "stats", "-", NULL, 0, "", 0, stdout);
+    else if (nfiles == 0)
+    {
+	if (!read_all(stdin, &data, &len))
+	{
+	    perror("sng: stdin");
+	    return(1);
+	}
+	status = request(rfp, wfp, "convert", "stdin",
+			 passed, npassed, data, len, stdout);
+	free(data);
+    }
+    else
+	for (i = 0; i < nfiles; i++)
+	{
+	    char outfile[BUFSIZ];
+	    FILE *fpin, *fpout;
+
+	    if (output_name(files[i], outfile) < 0)
+	    {
+		fprintf(stderr, "sng: %s is neither SNG nor PNG\n", files[i]);
+		error_status = (error_status > 1) ? error_status : 1;
+		continue;
+	    }
+	    if ((fpin = fopen(files[i], "r")) == NULL || !read_all(fpin, &data, &len))
+	    {
+		fprintf(stderr,
+			"sng: couldn't open %s for input (%d)\n", files[i], errno);
+		error_status = (error_status > 1) ? error_status : 1;
+		if (fpin)
+		    fclose(fpin);
+		continue;
+	    }
+	    fclose(fpin);
+	    if ((fpout = fopen(outfile, "w")) == NULL)
+	    {
+		fprintf(stderr,
+			"sng: couldn't open %s for output (%d)\n", outfile, errno);
+		error_status = (error_status > 1) ? error_status : 1;
+		free(data);
+		continue;
+	    }
+	    if (verbose)
+		printf("sng: converting %s to %s\n", files[i], outfile);
+	    status = request(rfp, wfp, "convert", files[i],
+			     passed, npassed, data, len, fpout);
+	    fclose(fpout);
+	    free(data);
+	    if (status < 0)
+		break;
+	    if (status > error_status)
+		error_status = status;
+	}
+
+    fclose(rfp);
+    fclose(wfp);
+    if (status < 0)
+	return(2);
+    return((status > error_status) ? status : error_status);
+}
+
+/*************************************************************************
+ *
+ * Private pools
+ *
+ * --tar and --watch keep workers of their own, each on one end of a
+ * socket pair, and collect the answers themselves.
+ *
+ ************************************************************************/
+
+static struct {
+    pid_t	pid;
+    FILE	*rfp, *wfp;
+    int		busy;
+} pool[MAX_WORKERS];
+static int pool_size;
+
+static pid_t spawn_worker(FILE **rfp, FILE **wfp)
+/* fork a worker that serves requests over a pair of streams until EOF */
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+	return(-1);
+    fflush(NULL);
+    if ((pid = fork()) == 0)
+    {
+	FILE *errfp = worker_init(), *in, *out;
+	static struct counters private;
+
+	close(sv[0]);
+	dup2(2, 1);			/* stdout may be the caller's output */
+	counters = &private;
+	in = fdopen(sv[1], "r");
+	out = fdopen(dup(sv[1]), "w");
+	while (in && out && serve_request(in, out, fileno(errfp)))
+	    continue;
+	exit(0);
+    }
+    close(sv[1]);
+    if (pid < 0)
+    {
+	close(sv[0]);
+	return(-1);
+    }
+    *rfp = fdopen(sv[0], "r");
+    *wfp = fdopen(dup(sv[0]), "w");
+    return(pid);
+}
+
+static void retire_worker(int w)
+/* close down a worker, idle or not */
+{
+    fclose(pool[w].rfp);
+    fclose(pool[w].wfp);
+    kill(pool[w].pid, SIGTERM);
+    while (waitpid(pool[w].pid, NULL, 0) < 0 && errno == EINTR)
+	continue;
+}
+
+void pool_start(void)
+/* fork --jobs workers with the color tables loaded */
+{
+    int n = (jobs < MAX_WORKERS) ? jobs : MAX_WORKERS;
+
+    sngc_preload();
+    sngd_preload();
+    signal(SIGPIPE, SIG_IGN);
+    for (pool_size = 0; pool_size < n; pool_size++)
+	if ((pool[pool_size].pid = spawn_worker(&pool[pool_size].rfp,
+						&pool[pool_size].wfp)) < 0)
+	    break;
+	else
+	    pool[pool_size].busy = FALSE;
+    if (pool_size == 0)
+    {
+	perror("sng: can't start a worker");
+	exit(2);
+    }
+}
+
+int pool_send(char *op, char *name, char *data, size_t len)
+/* hand a request to an idle worker; which one, or -1 if all are busy */
+{
+    int w;
+
+    for (w = 0; w < pool_size; w++)
+	if (!pool[w].busy)
+	{
+	    /* if the worker is gone, pool_receive() will find out */
+	    send_request(pool[w].wfp, op, name, NULL, 0, data, len);
+	    pool[w].busy = TRUE;
+	    return(w);
+	}
+    return(-1);
+}
+
+int pool_receive(int w, char **out, size_t *outlen)
+/* worker w's answer, as receive_reply(); a dead worker is replaced */
+{
+    int status = receive_reply(pool[w].rfp, out, outlen);
+
+    pool[w].busy = FALSE;
+    if (status < 0)
+    {
+	retire_worker(w);
+	if ((pool[w].pid = spawn_worker(&pool[w].rfp, &pool[w].wfp)) < 0)
+	{
+	    perror("sng: can't start a worker");
+	    exit(2);
+	}
+    }
+    return(status);
+}
+
+void pool_stop(void)
+/* retire the whole pool */
+{
+    int w;
+
+    for (w = 0; w < pool_size; w++)
+	retire_worker(w);
+    pool_size = 0;
+}
+
+/* serve.c ends here */
@@ -13,18 +13,315 @@ color_item;
 
 extern int sngc(FILE *fin, char *file, FILE *fout);
 extern int sngd(FILE *fin, char *file, FILE *fout);
+extern int sngd_stream(FILE *fin, char *file, FILE *fout);
+extern char *sngc_header(FILE *fin);
+extern void sngc_skip(FILE *fin);
+extern void sngc_pass(FILE *fin);
+extern void sngc_done(FILE *fin);
+extern void sngc_preload(void);
+extern void sngd_preload(void);
+
+extern int apply_option(char *arg);
+extern int output_name(char *infile, char *outfile);
+extern int convert_stream(FILE *fpin, char *name, FILE *fpout, int bundles);
+
+/* conversion cache, see cache.c */
+extern char *cache_dir;
+extern void content_hash(const void *data, size_t len, const char *salt,
+			 char *hex);
+
+/* a content hash being computed a piece at a time */
+typedef struct
+{
+    unsigned long long	h1, h2;
+}
+hash_state;
+
+extern void content_hash_start(hash_state *hp, const char *salt);
+extern void content_hash_add(hash_state *hp, const void *data, size_t len);
+extern void content_hash_end(hash_state *hp, char *hex);
+
+extern int cache_lookup(FILE *fpin, char *infile, char *outfile, int sng2png);
+extern void cache_store(char *outfile);
+extern void cache_store_data(const void *data, size_t len);
+extern void cache_report(void);
+
+/* reading ahead and writing behind, see batch.c */
+extern void batch_start(char **names, int n, int depth);
+extern FILE *batch_input(int n);
+extern void batch_output(char *name, char *data, size_t size);
+extern void batch_drain(void);
+extern void batch_invalidate(void);
+extern int batch_finish(void);
+
+/* conversion daemon and its client, see serve.c */
+extern int serve(char *path);
+extern int client(char *path, int stats, char **options, int noptions,
+		  int nfiles, char **files);
+extern void pool_start(void);
+extern int pool_send(char *op, char *name, char *data, size_t len);
+extern int pool_receive(int w, char **out, size_t *outlen);
+extern void pool_stop(void);
+
+/* tar archives through a pool of workers, see tar.c */
+extern int tar_stream(FILE *in, FILE *out);
+
+/* recompiling as files change, see watch.c */
+extern int watch(int ndirectories, char **directories);
+
+/* round-trip testing in memory, see verify.c */
+extern int verify_file(char *name, char *data, size_t len, FILE *fpout);
+extern int verify(int nfiles, char **files);
+
+/* pixel comparison and digests, see compare.c */
+extern int digest_metadata;
+extern int compare(char *name_a, char *name_b, int all);
+extern int digest_file(char *name, FILE *fpout);
+extern int digest(int nfiles, char **files);
+
+/* per-phase timing for -T, see timing.c */
+enum {PHASE_NONE, PHASE_READ, PHASE_PARSE, PHASE_INFLATE, PHASE_UNFILTER,
+      PHASE_FORMAT, PHASE_FILTER, PHASE_DEFLATE, PHASE_WRITE, PHASE_COUNT};
+extern int timing;
+extern int phase_switch(int phase);
+extern void timing_init(int many);
+extern void timing_start(char *name);
+extern void timing_stop(void);
+extern void timing_report(void);
+/* enter a phase, returning the one to go back to; or just change phase */
+#define PHASE_PUSH(p)	(timing ? phase_switch(p) : PHASE_NONE)
+#define PHASE_SET(p)	do { if (timing) phase_switch(p); } while (0)
+
+/* kernels timed on their own by sng_microbench, see sng_microbench.c */
+#ifdef SNG_MICROBENCH
+extern int bench_tokens(FILE *fp);
+extern void bench_escapes(const char *cp, char *tp);
+extern int bench_collect(FILE *fp, png_byte **pbytes);
+extern void bench_multi_dump(FILE *fpout, char *leader,
+			     int width, int height, unsigned char *data[]);
+extern char *safeprint(const char *buf);
+#endif /* SNG_MICROBENCH */
 
 extern void fatal(const char *fmt, ... );
 extern void *xalloc(unsigned long s);
 extern void *xrealloc(void *p, unsigned long s);
 extern char *xstrdup(char *s);
 
+/* allocation accounting for --memory, see memory.c */
+enum {MEM_OTHER, MEM_LIBPNG, MEM_PIXELS, MEM_TEXT, MEM_COLORS, MEM_ARENA,
+      MEM_COUNT};
+extern int memory_report;
+extern long memory_budget;
+extern int mem_subsystem;
+extern void *mem_alloc(unsigned long s);
+extern void *mem_aligned_alloc(unsigned long align, unsigned long s);
+extern void *mem_realloc(void *p, unsigned long s);
+extern void xfree(void *p);
+extern png_structp mem_create_read_struct(void);
+extern png_structp mem_create_write_struct(png_error_ptr warn_fn);
+extern void *mem_zalloc(void *opaque, unsigned int items, unsigned int size);
+extern void mem_zfree(void *opaque, void *p);
+extern void memory_start(char *name);
+extern void memory_stop(void);
+extern int memory_finish(void);
+
+/* per-conversion allocation, see arena.c */
+extern void *arena_alloc(unsigned long size);
+extern void *arena_grow(void *p, unsigned long old, unsigned long size);
+extern void arena_reset(void);
+
 extern void initialize_hash(int hashfunc(color_item *),
 			    color_item *hashbuckets[],
 			    int *initflag);
 
+/* IDAT encoder settings; ENCODER_DEFAULT leaves the libpng default alone */
+typedef struct
+{
+    int		level;		/* zlib compression level, 0-9 */
+    int		strategy;	/* zlib strategy, Z_DEFAULT_STRATEGY etc. */
+    int		window_bits;	/* zlib window size, 8-15 */
+    int		mem_level;	/* zlib memory level, 1-9 */
+    int		filters;	/* mask of PNG_FILTER_* row filters */
+    long	idat_size;	/* size of the IDAT buffer (and chunks) */
+}
+encoder_settings;
+
+#define ENCODER_DEFAULT	-1
+
+extern void encoder_init(encoder_settings *ep);
+extern int encoder_strategy(const char *name);
+extern int encoder_filter(const char *name);
+
+/* growable in-memory PNG output, see idat.c */
+typedef struct
+{
+    png_bytep	data;
+    png_size_t	size, room;
+}
+membuf;
+
+/* state for replacing the IDAT chunks of a PNG as libpng writes it */
+typedef struct
+{
+    FILE	*fp;		/* where the spliced stream goes */
+    membuf	*idat;		/* replacement IDAT chunks, framing and all */
+    png_uint_32	skip;		/* bytes left of the current chunk */
+    int		in_idat;	/* are we dropping an IDAT chunk? */
+    int		nheader;	/* bytes of chunk header seen so far */
+    png_byte	header[8];
+    int		spliced;	/* replacement already written? */
+}
+splicer;
+
+extern void membuf_write(png_structp png_ptr, png_bytep data, png_size_t length);
+extern void membuf_flush(png_structp png_ptr);
+extern void membuf_free(membuf *mp);
+extern void extract_idat(membuf *png, membuf *idat);
+extern void join_idat(membuf *idat, membuf *zdata);
+extern void make_idat(membuf *zdata, png_size_t chunksize, membuf *idat);
+extern png_size_t raw_idat_size(png_uint_32 width, png_uint_32 height,
+				int bit_depth, int color_type, int interlace_type);
+extern void splice_write(png_structp png_ptr, png_bytep data, png_size_t length);
+extern void splice_flush(png_structp png_ptr);
+extern void splice_init(splicer *sp, FILE *fp, membuf *idat);
+extern png_uint_32 chunk_crc(png_uint_32 crc, png_const_bytep buf, png_size_t len);
+
+/* whole-buffer compression, see deflate.c */
+#define DEFLATE_BEST	-2	/* the backend's best compression level */
+
+extern const char *deflate_backend(void);
+extern int deflate_is_zlib(void);
+extern png_size_t deflate_bound(png_size_t length);
+extern int deflate_buffer(png_bytep dest, png_size_t *destlen,
+			  png_const_bytep src, png_size_t srclen, int level);
+extern int inflate_buffer(png_bytep dest, png_size_t *destlen,
+			  png_const_bytep src, png_size_t srclen);
+
+/* row-filter selection, see filter.c */
+#define FILTER_NONE	0
+#define FILTER_SUB	1
+#define FILTER_UP	2
+#define FILTER_AVG	3
+#define FILTER_PAETH	4
+#define FILTER_COUNT	5
+
+typedef struct
+{
+    int		filters;	/* PNG_FILTER_* mask to choose from */
+    int		pass;		/* interlace pass of the previous row */
+    png_bytep	prev;		/* the previous row, unfiltered */
+    png_size_t	room;
+}
+filter_chooser;
+
+extern void filter_costs(png_const_bytep row, png_const_bytep prev,
+			 png_size_t n, int bpp, png_uint_32 cost[FILTER_COUNT]);
+extern int filter_chooser_init(png_structp png_ptr, png_infop info_ptr,
+			       filter_chooser *fc, int filters);
+extern void filter_chooser_free(filter_chooser *fc);
+extern void filter_row(int type, png_bytep out, png_const_bytep row,
+		       png_const_bytep prev, png_size_t n, int bpp);
+extern int best_filter(png_const_bytep row, png_const_bytep prev,
+		       png_size_t n, int bpp, int filters);
+
+extern int unfilter_row(int type, png_bytep row, png_const_bytep prev,
+			png_size_t n, int bpp);
+
+/* instruction-set variants of the kernels, chosen at startup, see cpu.c */
+#define CPU_SSE2	0x01
+#define CPU_SSE41	0x02
+#define CPU_SSE42	0x04
+#define CPU_PCLMUL	0x08
+#define CPU_AVX2	0x10
+#define CPU_AVX512	0x20
+
+typedef struct
+{
+    const char	*name;		/* as SNG_KERNELS spells it */
+    int		needs;		/* the CPU_* features it runs on */
+    void	(*costs)(png_const_bytep row, png_const_bytep prev,
+			 png_size_t n, int bpp, png_uint_32 cost[FILTER_COUNT]);
+    void	(*filter)(int type, png_bytep out, png_const_bytep row,
+			  png_const_bytep prev, png_size_t n, int bpp);
+    void	(*unfilter)(int type, png_bytep row, png_const_bytep prev,
+			    png_size_t n, int bpp);
+    png_uint_32	(*crc)(png_uint_32 crc, png_const_bytep buf, png_size_t len);
+}
+kernel_set;
+
+extern const kernel_set *kernels;
+extern void kernels_init(void);
+extern const char *cpu_description(void);
+extern int kernels_check(void);
+
+extern void filter_costs_scalar(png_const_bytep row, png_const_bytep prev,
+				png_size_t n, int bpp,
+				png_uint_32 cost[FILTER_COUNT]);
+extern void filter_row_scalar(int type, png_bytep out, png_const_bytep row,
+			      png_const_bytep prev, png_size_t n, int bpp);
+extern void unfilter_row_scalar(int type, png_bytep row, png_const_bytep prev,
+				png_size_t n, int bpp);
+extern png_uint_32 chunk_crc_scalar(png_uint_32 crc, png_const_bytep buf,
+				    png_size_t len);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+extern void filter_costs_avx2(png_const_bytep row, png_const_bytep prev,
+			      png_size_t n, int bpp,
+			      png_uint_32 cost[FILTER_COUNT]);
+extern void filter_row_avx2(int type, png_bytep out, png_const_bytep row,
+			    png_const_bytep prev, png_size_t n, int bpp);
+extern void unfilter_row_sse2(int type, png_bytep row, png_const_bytep prev,
+			      png_size_t n, int bpp);
+extern png_uint_32 chunk_crc_pclmul(png_uint_32 crc, png_const_bytep buf,
+				    png_size_t len);
+#endif
+
+/* whole images in memory, rows aligned for the kernels, see image.c */
+#define IMAGE_ALIGN	64
+typedef struct
+{
+    png_bytep	data;		/* the one allocation it all lives in */
+    png_bytepp	rows;		/* where each row's pixels start */
+    png_size_t	stride;		/* from one row to the next */
+    png_size_t	size;		/* of data, up to the row pointers */
+}
+image_buffer;
+
+extern int image_alloc(image_buffer *ip, png_uint_32 height,
+		       png_size_t rowbytes);
+extern void image_free(image_buffer *ip);
+
+/* image data decoded without libpng, see decode.c */
+extern int native_decodable(png_uint_32 width, png_uint_32 height,
+			    int bit_depth, int color_type, int interlace_type);
+extern int native_decode(membuf *zdata, png_uint_32 width, png_uint_32 height,
+			 int color_type, image_buffer *ip);
+
+/* image data encoded without libpng, see encode.c */
+extern int native_encodable(png_structp png_ptr, png_infop info_ptr,
+			    int transforms);
+extern void native_encode(png_structp png_ptr, png_infop info_ptr,
+			  FILE *fp, encoder_settings *ep);
+extern void native_cleanup(void);
+extern int native_splice(png_structp png_ptr, png_infop info_ptr,
+			 FILE *fp, membuf *idat);
+
+/* image data from earlier compilations, see cache.c */
+extern int idat_cache_lookup(png_const_bytep pixels, png_size_t size,
+			     const char *salt, membuf *idat);
+extern void idat_cache_store(membuf *idat);
+
+extern int optimize_idat(png_structp png_ptr, png_infop info_ptr,
+			 int transforms, encoder_settings *ep, membuf *idat);
+
 extern int verbose;
 extern int idat;
+extern int encoder_comment;
+extern encoder_settings encoder;
+extern int optimize;
+extern int jobs;
+extern int use_libpng;
+extern char *bundle;
+extern char bundle_image[];
 
 extern int linenum;
 extern char *file;
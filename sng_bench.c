@@ -0,0 +1,558 @@
+/*****************************************************************************
+
+NAME
+   sng_bench.c -- end-to-end benchmark for sng, behind `make bench'.
+
+   Usage: sng_bench [--sizes=LIST] [--repeats=N] [--sng=PATH]
+		    [--output=FILE] [--baseline=FILE] [--threshold=PCT]
+	  sng_bench --baseline=FILE [--threshold=PCT] RESULTS
+
+   Synthesizes a PNG for every color type and bit depth PNG allows,
+   interlaced and not, at each of the named sizes, with four kinds of
+   content: noise, gradients, flat user-interface blocks, and a scanned
+   page of text.  Each is decompiled by sng and the result compiled
+   again, in pipe mode, best of N runs.  The results go out as JSON, one
+   case to a line: for each direction, seconds, MB/s and pixels/s, and
+   the peak resident set size in kilobytes.  MB/s counts the bytes of
+   raw image data, so it means the same for both directions.
+
+   Sizes are icon (32x32), small (256x256), medium (1000x1000), large
+   (4000x3000) and huge (10000x10000, 100 megapixels); the default is
+   icon,small,medium.  Images are generated a row at a time, so the
+   huge ones need memory only for sng itself, though their SNG forms
+   run to gigabytes of temporary disk.
+
+   With --baseline, each case is compared with the same case in an
+   earlier run, changes in time beyond the threshold (default 10%) are
+   listed, and the exit status is 1 if anything got slower.  Given a
+   results file instead of running, sng_bench just compares.
+
+*****************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "png.h"
+
+#define TRUE	1
+#define FALSE	0
+
+typedef struct
+{
+    const char	*name;
+    png_uint_32	width, height;
+}
+size_spec;
+
+static const size_spec sizes[] = {
+    {"icon",	32,	32},
+    {"small",	256,	256},
+    {"medium",	1000,	1000},
+    {"large",	4000,	3000},
+    {"huge",	10000,	10000},
+};
+#define NSIZES	((int)(sizeof(sizes)/sizeof(sizes[0])))
+
+static const struct {
+    const char	*name;
+    int		color_type, channels;
+    const char	*depths;
+} types[] = {
+    {"gray",	PNG_COLOR_TYPE_GRAY,		1, "\1\2\4\10\20"},
+    {"rgb",	PNG_COLOR_TYPE_RGB,		3, "\10\20"},
+    {"palette",	PNG_COLOR_TYPE_PALETTE,		1, "\1\2\4\10"},
+    {"graya",	PNG_COLOR_TYPE_GRAY_ALPHA,	2, "\10\20"},
+    {"rgba",	PNG_COLOR_TYPE_RGB_ALPHA,	4, "\10\20"},
+};
+#define NTYPES	((int)(sizeof(types)/sizeof(types[0])))
+
+static const char *contents[] = {"noise", "gradient", "ui", "text"};
+#define NCONTENTS	((int)(sizeof(contents)/sizeof(contents[0])))
+
+typedef struct
+{
+    double	seconds;
+    long	peak_rss;
+} timing;
+
+static char *sng = "./sng";
+static char workdir[] = "/tmp/sng_benchXXXXXX";
+
+/*************************************************************************
+ *
+ * Synthesis
+ *
+ ************************************************************************/
+
+static unsigned long noise_state;
+
+static unsigned long noise(void)
+/* xorshift, so the images are the same every run */
+{
+    noise_state ^= noise_state << 13;
+    noise_state ^= noise_state >> 7;
+    noise_state ^= noise_state << 17;
+    return(noise_state);
+}
+
+static unsigned sample(int content, png_uint_32 x, png_uint_32 y,
+		       png_uint_32 w, png_uint_32 h, int c, unsigned maxval)
+/* one sample of the kind of content asked for */
+{
+    switch (content)
+    {
+    case 0:				/* noise */
+	return(noise() % (maxval + 1));
+    case 1:				/* gradients, a different one per channel */
+	switch (c)
+	{
+	case 0: return((unsigned long)x * maxval / (w > 1 ? w - 1 : 1));
+	case 1: return((unsigned long)y * maxval / (h > 1 ? h - 1 : 1));
+	case 2: return((unsigned long)(x + y) * maxval / (w + h));
+	default: return(maxval - (unsigned long)y * maxval / (h > 1 ? h - 1 : 1));
+	}
+    case 2:				/* flat panels with borders */
+	if (x % 97 == 0 || y % 61 == 0)
+	    return(c == 3 ? maxval : maxval / 3);
+	return((((x / 97) * 7 + (y / 61) * 3 + c) % 4) * maxval / 3);
+    default:				/* lines of dark glyphs on paper */
+	{
+	    png_uint_32 line = y / 16, row = y % 16, glyph = x / 8, col = x % 8;
+	    unsigned long bits = (glyph * 2654435761UL) ^ (line * 40503UL);
+	    int ink = row >= 3 && row < 13 && col < 6 && (glyph % 9) != 8
+		&& ((bits >> ((row - 3) * 3 + col / 2)) & 1);
+	    unsigned grain = noise() % (maxval / 16 + 1);
+
+	    if (c == 3)
+		return(maxval);
+	    return(ink ? grain : maxval - grain);
+	}
+    }
+}
+
+static void make_row(png_bytep row, int content, int bit_depth, int channels,
+		     png_uint_32 y, png_uint_32 w, png_uint_32 h)
+/* fill a row, packed the way PNG wants it */
+{
+    unsigned maxval = (1U << bit_depth) - 1;
+    png_uint_32 x;
+    int c, bit = 8;
+
+    memset(row, '\0', ((png_size_t)w * channels * bit_depth + 7) / 8);
+    for (x = 0; x < w; x++)
+	for (c = 0; c < channels; c++)
+	{
+	    unsigned v = sample(content, x, y, w, h,
+				channels == 2 && c == 1 ? 3 : c, maxval);
+
+	    if (bit_depth == 16)
+	    {
+		*row++ = v >> 8;
+		*row++ = v & 0xff;
+	    }
+	    else if (bit_depth == 8)
+		*row++ = v;
+	    else
+	    {
+		bit -= bit_depth;
+		*row |= v << bit;
+		if (bit == 0)
+		{
+		    bit = 8;
+		    row++;
+		}
+	    }
+	}
+}
+
+static int synthesize(char *path, int t, int bit_depth, int interlace,
+		      const size_spec *sp, int content)
+/* write a test image; FALSE if libpng objects */
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_bytep row = NULL;
+    png_color palette[256];
+    png_uint_32 y;
+    int i, pass, passes;
+    FILE *fp;
+
+    if ((fp = fopen(path, "wb")) == NULL)
+	return(FALSE);
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ptr = png_create_info_struct(png_ptr);
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	free(row);
+	fclose(fp);
+	return(FALSE);
+    }
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info_ptr, sp->width, sp->height, bit_depth,
+		 types[t].color_type,
+		 interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+		 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (types[t].color_type == PNG_COLOR_TYPE_PALETTE)
+    {
+	for (i = 0; i < (1 << bit_depth); i++)
+	{
+	    palette[i].red = i * 255 / ((1 << bit_depth) - 1);
+	    palette[i].green = (i * 37) & 0xff;
+	    palette[i].blue = 255 - palette[i].red;
+	}
+	png_set_PLTE(png_ptr, info_ptr, palette, 1 << bit_depth);
+    }
+    png_write_info(png_ptr, info_ptr);
+    passes = png_set_interlace_handling(png_ptr);
+    row = malloc(((png_size_t)sp->width * types[t].channels * bit_depth + 7) / 8 + 1);
+    for (pass = 0; pass < passes; pass++)
+    {
+	noise_state = 88172645463325252UL;
+	for (y = 0; y < sp->height; y++)
+	{
+	    make_row(row, content, bit_depth, types[t].channels,
+		     y, sp->width, sp->height);
+	    png_write_row(png_ptr, row);
+	}
+    }
+    png_write_end(png_ptr, info_ptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(row);
+    return(fclose(fp) == 0);
+}
+
+/*************************************************************************
+ *
+ * Timing
+ *
+ ************************************************************************/
+
+static int run_sng(char *in, char *out, timing *tp)
+/* time one pipe-mode run of sng; FALSE if it failed */
+{
+    struct timespec start, end;
+    struct rusage ru;
+    int status, ifd, ofd;
+    pid_t pid;
+
+    if ((ifd = open(in, O_RDONLY)) < 0)
+	return(FALSE);
+    if ((ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+	close(ifd);
+	return(FALSE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((pid = fork()) == 0)
+    {
+	dup2(ifd, 0);
+	dup2(ofd, 1);
+	execl(sng, sng, (char *)NULL);
+	_exit(127);
+    }
+    close(ifd);
+    close(ofd);
+    if (pid < 0 || wait4(pid, &status, 0, &ru) != pid)
+	return(FALSE);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tp->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    tp->peak_rss = ru.ru_maxrss;
+    return(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static int best_of(int repeats, char *in, char *out, timing *tp)
+/* the fastest of several runs, and the most memory any of them took */
+{
+    timing t;
+    int i;
+
+    for (i = 0; i < repeats; i++)
+    {
+	if (!run_sng(in, out, &t))
+	    return(FALSE);
+	if (i == 0 || t.seconds < tp->seconds)
+	    tp->seconds = t.seconds;
+	if (i == 0 || t.peak_rss > tp->peak_rss)
+	    tp->peak_rss = t.peak_rss;
+    }
+    return(TRUE);
+}
+
+static long file_size(char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    long size = -1;
+
+    if (fp && fseek(fp, 0L, SEEK_END) == 0)
+	size = ftell(fp);
+    if (fp)
+	fclose(fp);
+    return(size);
+}
+
+static void put_timing(FILE *fp, const char *dir, timing *tp, double raw,
+		       double pixels)
+/* one direction's numbers, as JSON members */
+{
+    fprintf(fp, ", \"%s_seconds\": %.6f, \"%s_mb_s\": %.2f, "
+	    "\"%s_pixels_s\": %.0f, \"%s_peak_rss_kb\": %ld",
+	    dir, tp->seconds, dir, raw / 1e6 / tp->seconds,
+	    dir, pixels / tp->seconds, dir, tp->peak_rss);
+}
+
+static int run_all(char *which, int repeats, FILE *fp)
+/* synthesize and time every case at the sizes listed; FALSE on failure */
+{
+    char png[sizeof(workdir) + 32], sngfile[sizeof(workdir) + 32];
+    char out[sizeof(workdir) + 32], name[128];
+    int s, t, d, interlace, content, first = TRUE, ok = TRUE;
+
+    sprintf(png, "%s/in.png", workdir);
+    sprintf(sngfile, "%s/in.sng", workdir);
+    sprintf(out, "%s/out.png", workdir);
+
+    fprintf(fp, "{\"sng_bench\": 1, \"repeats\": %d, \"cases\": [\n", repeats);
+    for (s = 0; s < NSIZES; s++)
+    {
+	char list[BUFSIZ], *word;
+	int wanted = FALSE;
+
+	strncpy(list, which, sizeof(list) - 1);
+	list[sizeof(list) - 1] = '\0';
+	for (word = strtok(list, ","); word; word = strtok(NULL, ","))
+	    if (strcmp(word, sizes[s].name) == 0 || strcmp(word, "all") == 0)
+		wanted = TRUE;
+	if (!wanted)
+	    continue;
+
+	for (t = 0; t < NTYPES; t++)
+	    for (d = 0; types[t].depths[d]; d++)
+		for (interlace = 0; interlace < 2; interlace++)
+		    for (content = 0; content < NCONTENTS; content++)
+		    {
+			int depth = types[t].depths[d];
+			double pixels = (double)sizes[s].width * sizes[s].height;
+			double raw = sizes[s].height
+			    * (((double)sizes[s].width * types[t].channels * depth + 7) / 8);
+			timing sngd, sngc;
+
+			sprintf(name, "%s%d%s-%s-%s", types[t].name, depth,
+				interlace ? "-adam7" : "", sizes[s].name,
+				contents[content]);
+			fprintf(stderr, "sng_bench: %s\n", name);
+			if (!synthesize(png, t, depth, interlace,
+					&sizes[s], content))
+			{
+			    fprintf(stderr, "sng_bench: %s: can't make the image\n", name);
+			    ok = FALSE;
+			    continue;
+			}
+			if (!best_of(repeats, png, sngfile, &sngd)
+			    || !best_of(repeats, sngfile, out, &sngc))
+			{
+			    fprintf(stderr, "sng_bench: %s: sng failed\n", name);
+			    ok = FALSE;
+			    continue;
+			}
+			fprintf(fp, "%s{\"case\": \"%s\", \"width\": %lu, "
+				"\"height\": %lu, \"png_bytes\": %ld, "
+				"\"sng_bytes\": %ld",
+				first ? "" : ",\n", name,
+				(unsigned long)sizes[s].width,
+				(unsigned long)sizes[s].height,
+				file_size(png), file_size(sngfile));
+			put_timing(fp, "sngd", &sngd, raw, pixels);
+			put_timing(fp, "sngc", &sngc, raw, pixels);
+			fputc('}', fp);
+			fflush(fp);
+			first = FALSE;
+		    }
+    }
+    fprintf(fp, "\n]}\n");
+    unlink(png);
+    unlink(sngfile);
+    unlink(out);
+    return(ok);
+}
+
+/*************************************************************************
+ *
+ * Comparison
+ *
+ ************************************************************************/
+
+typedef struct
+{
+    char	name[128];
+    double	sngd, sngc;
+}
+result;
+
+static double json_number(const char *line, const char *key)
+/* the value of a numeric member of a one-line object, or -1 */
+{
+    char pattern[64];
+    const char *cp;
+
+    sprintf(pattern, "\"%s\": ", key);
+    if ((cp = strstr(line, pattern)) == NULL)
+	return(-1);
+    return(atof(cp + strlen(pattern)));
+}
+
+static result *load_results(char *path, int *n)
+/* the cases in a results file, as written above */
+{
+    char line[4096];
+    result *rp = NULL;
+    int room = 0;
+    FILE *fp;
+
+    *n = 0;
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+	fprintf(stderr, "sng_bench: can't read %s (%d)\n", path, errno);
+	return(NULL);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+	char *cp = strstr(line, "{\"case\": \"");
+
+	if (cp == NULL)
+	    continue;
+	if (*n == room)
+	    rp = realloc(rp, (room = 2 * room + 64) * sizeof(result));
+	sscanf(cp + 10, "%127[^\"]", rp[*n].name);
+	rp[*n].sngd = json_number(cp, "sngd_seconds");
+	rp[*n].sngc = json_number(cp, "sngc_seconds");
+	(*n)++;
+    }
+    fclose(fp);
+    return(rp);
+}
+
+static int compare(char *baseline, char *current, double threshold)
+/* report changes beyond threshold percent; TRUE if nothing got slower */
+{
+    result *old, *new;
+    int nold, nnew, i, j, k, slower = 0, faster = 0;
+    static const char *dirs[] = {"sngd", "sngc"};
+
+    if ((old = load_results(baseline, &nold)) == NULL
+	|| (new = load_results(current, &nnew)) == NULL)
+	return(FALSE);
+    for (i = 0; i < nnew; i++)
+	for (j = 0; j < nold; j++)
+	    if (strcmp(new[i].name, old[j].name) == 0)
+	    {
+		for (k = 0; k < 2; k++)
+		{
+		    double was = k ? old[j].sngc : old[j].sngd;
+		    double now = k ? new[i].sngc : new[i].sngd;
+		    double change;
+
+		    if (was <= 0 || now <= 0)
+			continue;
+		    change = (now - was) / was * 100;
+		    if (change > threshold)
+			slower++;
+		    else if (change < -threshold)
+			faster++;
+		    else
+			continue;
+		    printf("%-36s %s %10.6fs -> %10.6fs %+7.1f%%%s\n",
+			   new[i].name, dirs[k], was, now, change,
+			   change > threshold ? "  SLOWER" : "");
+		}
+		break;
+	    }
+    printf("sng_bench: %d slower, %d faster than %s by more than %g%%\n",
+	   slower, faster, baseline, threshold);
+    free(old);
+    free(new);
+    return(slower == 0);
+}
+
+/*************************************************************************
+ *
+ * Main sequence
+ *
+ ************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    char *which = "icon,small,medium", *output = NULL, *baseline = NULL;
+    double threshold = 10;
+    int repeats = 3, ok;
+    FILE *fp = stdout;
+
+    for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; argc--, argv++)
+    {
+	char *value = strchr(argv[1], '=');
+
+	/* an empty --baseline= is allowed, and means none */
+	if (value == NULL
+	    || (value[1] == '\0' && strncmp(argv[1], "--baseline=", 11) != 0))
+	{
+	    fprintf(stderr, "sng_bench: %s needs a value\n", argv[1]);
+	    exit(2);
+	}
+	value++;
+	if (strncmp(argv[1], "--sizes=", 8) == 0)
+	    which = value;
+	else if (strncmp(argv[1], "--repeats=", 10) == 0 && atoi(value) > 0)
+	    repeats = atoi(value);
+	else if (strncmp(argv[1], "--sng=", 6) == 0)
+	    sng = value;
+	else if (strncmp(argv[1], "--output=", 9) == 0)
+	    output = value;
+	else if (strncmp(argv[1], "--baseline=", 11) == 0)
+	    baseline = *value ? value : NULL;
+	else if (strncmp(argv[1], "--threshold=", 12) == 0)
+	    threshold = atof(value);
+	else
+	{
+	    fprintf(stderr, "sng_bench: unknown option %s\n", argv[1]);
+	    exit(2);
+	}
+    }
+
+    /* given a results file, just compare */
+    if (argc > 1)
+    {
+	if (baseline == NULL)
+	{
+	    fprintf(stderr, "sng_bench: a results file needs --baseline\n");
+	    exit(2);
+	}
+	exit(compare(baseline, argv[1], threshold) ? 0 : 1);
+    }
+
+    if (output && (fp = fopen(output, "w")) == NULL)
+    {
+	fprintf(stderr, "sng_bench: can't write %s (%d)\n", output, errno);
+	exit(2);
+    }
+    if (mkdtemp(workdir) == NULL)
+    {
+	perror("sng_bench: can't make a scratch directory");
+	exit(2);
+    }
+    ok = run_all(which, repeats, fp);
+    rmdir(workdir);
+    if (output)
+	fclose(fp);
+    if (ok && baseline && output)
+	ok = compare(baseline, output, threshold);
+    exit(ok ? 0 : 1);
+}
+
+/* sng_bench.c ends here */
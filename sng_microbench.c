@@ -0,0 +1,415 @@
+/*****************************************************************************
+
+NAME
+   sng_microbench.c -- time sng's tokenizer and data codecs on their own.
+
+   Usage: sng_microbench [--repeats=N] [--size=BYTES] [--cpu=N] [KERNEL...]
+
+   Built from the same sources as sng, with SNG_MICROBENCH defined so
+   sngc.c and sngd.c export entry points to their hot static functions.
+   Each kernel runs on a fixed input synthesized in memory, read through
+   fmemopen(3) and written to a memory buffer, so no file I/O gets into
+   the numbers.  The process is pinned to one CPU (0 unless --cpu says
+   otherwise; -1 leaves it alone), every kernel is run N times (default
+   20), and the fastest run is reported in cycles and megabytes a second
+   per input byte.  On x86 a cycle is a tick of the time-stamp counter;
+   elsewhere the cycle column is nanoseconds.  Name kernels to run only
+   those; --list shows them.
+
+*****************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* for sched_setaffinity() */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "png.h"
+#include "sng.h"
+#include "config.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define TSC
+#define CYCLES	"cycles"
+#else
+#define CYCLES	"ns"
+#endif
+
+#define ROW_BYTES	3000		/* a row of 1000 RGB pixels */
+
+static long size = 1 << 20;		/* input bytes per kernel */
+static unsigned long seed;
+
+static char *text;			/* input to the kernel being timed */
+static long text_len;
+static unsigned char **rows;		/* or the rows it dumps */
+static int nrows;
+static char *sink;			/* where output goes */
+static long sink_len;
+
+static unsigned long noise(void)
+/* a fixed pseudorandom sequence, so every run sees the same input */
+{
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return(seed >> 33);
+}
+
+static unsigned long long now(void)
+{
+#ifdef TSC
+    return(__rdtsc());
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
+
+/*************************************************************************
+ *
+ * Inputs
+ *
+ ************************************************************************/
+
+static void append(const char *s)
+{
+    long len = strlen(s);
+
+    text = xrealloc(text, text_len + len + 1);
+    memcpy(text + text_len, s, len + 1);
+    text_len += len;
+}
+
+static void make_sng(void)
+/* chunk specifications of the kinds real SNG files are made of */
+{
+    static const char *lines[] = {
+	"IHDR {\n    width: 1000; height: 1000; bitdepth: 8;\n"
+	"    using color alpha;\n}\n",
+	"gAMA {0.45455}\n",
+	"tEXt {\n    keyword: \"Comment\";\n"
+	"    text: \"scanned \\\"as is\\\"\\nno retouching\\t\\x41\";\n}\n",
+	"# a comment, which the tokenizer must skip\n",
+	"PLTE {\n    (255,  0,  0)     # red\n    (  0,255,  0)\n"
+	"    ( 18, 52, 86)\n}\n",
+	"pHYs {xpixels: 2835; ypixels: 2835; per meter;}\n",
+    };
+    int i;
+
+    for (i = 0; text_len < size; i = (i + 1) % 6)
+	append(lines[i]);
+}
+
+static void make_escapes(void)
+/* a string with the escapes SNG text chunks use, and plenty without */
+{
+    static const char *pieces[] = {
+	"plain words ", "\\n", "\\t", "\\\"quoted\\\" ", "\\x7f", "\\101",
+	"\\0", "\\\\", "more text ",
+    };
+
+    while (text_len < size)
+	append(pieces[noise() % 9]);
+}
+
+static void make_data(const char *format)
+/* a data segment, in hex or base64, of about size bytes */
+{
+    long i;
+
+    append(format);
+    append("\n");
+    text = xrealloc(text, text_len + size + size / 64 + 3);
+    for (i = 0; i < size; i++)
+    {
+	if (format[0] == 'h')
+	    text[text_len++] = "0123456789abcdef"[noise() % 16];
+	else
+	    text[text_len++] = BASE64[noise() % 64];
+	if (i % 64 == 63)
+	    text[text_len++] = '\n';
+    }
+    strcpy(text + text_len, ";\n");
+    text_len += 2;
+}
+
+static void make_rows(int kind)
+/* rows of pixels multi_dump() will print as hex, base64 or a string */
+{
+    static const char printable[] =
+	"The quick brown fox jumps over the lazy dog.\n\"Quoted\" \\ ";
+    int i, j;
+
+    nrows = (size + ROW_BYTES - 1) / ROW_BYTES;
+    rows = xalloc(nrows * sizeof(unsigned char *));
+    for (i = 0; i < nrows; i++)
+    {
+	rows[i] = xalloc(ROW_BYTES);
+	for (j = 0; j < ROW_BYTES; j++)
+	    if (kind == 'h')
+		rows[i][j] = noise();
+	    else if (kind == 'b')
+		rows[i][j] = noise() % 64;
+	    else
+		rows[i][j] = printable[noise() % (sizeof(printable) - 1)];
+    }
+    text_len = (long)nrows * ROW_BYTES;
+}
+
+static void make_strings(void)
+/* text with the odd control and high-bit character for safeprint() */
+{
+    long i;
+
+    text = xrealloc(text, size + 1);
+    for (i = 0; i < size; i++)
+    {
+	unsigned long r = noise() % 100;
+
+	if (r < 90)
+	    text[i] = ' ' + r % 95;
+	else if (r < 95)
+	    text[i] = "\n\r\b\"\\"[r - 90];
+	else
+	    text[i] = (r % 2) ? 1 + r % 31 : 128 + r;
+    }
+    text[text_len = size] = '\0';
+}
+
+/*************************************************************************
+ *
+ * Kernels
+ *
+ ************************************************************************/
+
+static FILE *input(void)
+{
+    FILE *fp = fmemopen(text, text_len, "r");
+
+    if (fp == NULL)
+	fatal("can't open a memory stream");
+    return(fp);
+}
+
+static FILE *output(void)
+{
+    FILE *fp = fmemopen(sink, sink_len, "w");
+
+    if (fp == NULL)
+	fatal("can't open a memory stream");
+    return(fp);
+}
+
+static void run_tokens(void)
+{
+    FILE *fp = input();
+
+    bench_tokens(fp);
+    fclose(fp);
+}
+
+static void run_escapes(void)
+{
+    bench_escapes(text, sink);
+}
+
+static void run_collect(void)
+{
+    FILE *fp = input();
+    png_byte *bytes;
+
+    bench_collect(fp, &bytes);
+    arena_reset();
+    fclose(fp);
+}
+
+static void run_multi_dump(void)
+{
+    FILE *fp = output();
+
+    bench_multi_dump(fp, "    ", ROW_BYTES, nrows, rows);
+    fclose(fp);
+}
+
+static void run_safeprint(void)
+{
+    char save, *cp;
+    long n;
+
+    /* in pieces as long as the strings safeprint() is made for */
+    for (cp = text; cp < text + text_len; cp += n)
+    {
+	n = text + text_len - cp;
+	if (n > 1024)
+	    n = 1024;
+	save = cp[n];
+	cp[n] = '\0';
+	safeprint(cp);
+	cp[n] = save;
+    }
+}
+
+typedef struct
+{
+    const char	*name;
+    void	(*setup)(void);
+    void	(*run)(void);
+}
+kernel;
+
+static void setup_hex(void)	{ make_data("hex"); }
+static void setup_base64(void)	{ make_data("base64"); }
+static void setup_dump_hex(void)	{ make_rows('h'); }
+static void setup_dump_base64(void)	{ make_rows('b'); }
+static void setup_dump_string(void)	{ make_rows('s'); }
+
+static const kernel timed[] = {
+    {"get_token",		make_sng,		run_tokens},
+    {"escapes",			make_escapes,		run_escapes},
+    {"collect_data/hex",	setup_hex,		run_collect},
+    {"collect_data/base64",	setup_base64,		run_collect},
+    {"multi_dump/hex",		setup_dump_hex,		run_multi_dump},
+    {"multi_dump/base64",	setup_dump_base64,	run_multi_dump},
+    {"multi_dump/string",	setup_dump_string,	run_multi_dump},
+    {"safeprint",		make_strings,		run_safeprint},
+};
+#define NKERNELS	((int)(sizeof(timed) / sizeof(timed[0])))
+
+static void measure(const kernel *kp, int repeats)
+/* time one kernel, best of repeats */
+{
+    unsigned long long best = ~0ULL, start, t;
+    struct timespec t0, t1;
+    double seconds = 0;
+    int i;
+
+    seed = 1;
+    text_len = 0;
+    kp->setup();
+    sink = xalloc(sink_len = 8 * text_len + 65536);
+
+    kp->run();				/* warm the caches first */
+    for (i = 0; i < repeats; i++)
+    {
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	start = now();
+	kp->run();
+	t = now() - start;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (t < best)
+	{
+	    best = t;
+	    seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	}
+    }
+    printf("%-20s %9ld bytes %8.2f %s/byte %9.1f MB/s\n",
+	   kp->name, text_len, (double)best / text_len, CYCLES,
+	   seconds > 0 ? text_len / seconds / 1e6 : 0.0);
+
+    free(text);
+    text = NULL;
+    for (i = 0; i < nrows; i++)
+	free(rows[i]);
+    free(rows);
+    rows = NULL;
+    nrows = 0;
+    free(sink);
+}
+
+static void pin(int cpu)
+/* keep to one CPU, so migrations and frequency differences stay out */
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+	fprintf(stderr, "sng_microbench: can't pin to CPU %d\n", cpu);
+#else
+    fputs("sng_microbench: can't pin to a CPU here\n", stderr);
+#endif
+}
+
+static int measure_named(char **names, int nnames, int repeats)
+/* time the kernels named, all of them if none are; FALSE if none match */
+{
+    int k, j, any = FALSE;
+
+    for (k = 0; k < NKERNELS; k++)
+    {
+	int wanted = (nnames == 0);
+
+	for (j = 0; j < nnames; j++)
+	    if (strcmp(names[j], timed[k].name) == 0
+		|| strncmp(names[j], timed[k].name, strlen(names[j])) == 0)
+		wanted = TRUE;
+	if (wanted)
+	{
+	    measure(&timed[k], repeats);
+	    any = TRUE;
+	}
+    }
+    return(any);
+}
+
+int main(int argc, char *argv[])
+{
+    volatile int repeats = 20, i;	/* still wanted after the setjmp() */
+    int cpu = 0, k;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	if (strncmp(argv[i], "--repeats=", 10) == 0)
+	    repeats = atoi(argv[i] + 10);
+	else if (strncmp(argv[i], "--size=", 7) == 0)
+	    size = atol(argv[i] + 7);
+	else if (strncmp(argv[i], "--cpu=", 6) == 0)
+	    cpu = atoi(argv[i] + 6);
+	else if (strcmp(argv[i], "--list") == 0)
+	{
+	    for (k = 0; k < NKERNELS; k++)
+		puts(timed[k].name);
+	    exit(0);
+	}
+	else
+	{
+	    fprintf(stderr,
+		    "usage: sng_microbench [--repeats=N] [--size=BYTES] "
+		    "[--cpu=N] [--list] [KERNEL...]\n");
+	    exit(2);
+	}
+    if (repeats < 1 || size < 1)
+    {
+	fputs("sng_microbench: repeats and size must be positive\n", stderr);
+	exit(2);
+    }
+    kernels_init();
+    if (cpu >= 0)
+	pin(cpu);
+
+    /* multi_dump() spaces its hex by the pixel format in the IHDR */
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ptr = png_create_info_struct(png_ptr);
+    if (png_ptr == NULL || info_ptr == NULL)
+	fatal("can't allocate PNG structures");
+    png_set_IHDR(png_ptr, info_ptr, ROW_BYTES / 3, 1, 8, PNG_COLOR_TYPE_RGB,
+		 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		 PNG_FILTER_TYPE_DEFAULT);
+    file = "sng_microbench";
+    if (setjmp(png_jmpbuf(png_ptr)))
+	exit(2);			/* fatal() has had its say */
+    if (!measure_named(argv + i, argc - i, repeats))
+    {
+	fputs("sng_microbench: no such kernel; try --list\n", stderr);
+	exit(2);
+    }
+    return(0);
+}
+
+/* sng_microbench.c ends here */
@@ -10,8 +10,10 @@ NAME
 #include <unistd.h>
 #include <ctype.h>
 #include "png.h"
+#include "zlib.h"
 
 #include "sng.h"
+#include "config.h"
 
 extern int verbose;
 
@@ -100,10 +102,16 @@ static chunkprops properties[] =
 #define IMAGE	24
     {"IMAGE",		FALSE,	0},
 
+/*
+ * Encoder-settings pseudo-chunk
+ */
+#define ENCODER	25
+    {"encoder",		FALSE,	0},
+
 /*
  * Private chunks
  */
-#define PRIVATE	25
+#define PRIVATE	26
     {"private",		TRUE,	0},
 };
 
@@ -118,6 +126,11 @@ static png_color palette[256];
 static color_item *cname_hashbuckets[COLOR_HASH_MODULUS];
 static int cname_initialized;
 static int write_transform_options;
+static encoder_settings file_encoder;
+static filter_chooser chooser;
+static image_buffer image;	/* the pixels attached to info_ptr */
+static png_bytep image_pixels;	/* and as collected, all in one piece */
+static png_size_t image_size;
 
 static int hash_by_cname(color_item *cp)
 /* hash by color's RGB value */
@@ -144,6 +157,162 @@ static color_item *find_by_cname(char *name)
     return((color_item *)NULL);
 }
 
+/*************************************************************************
+ *
+ * Encoder settings
+ *
+ ************************************************************************/
+
+static struct {
+    char	*name;
+    int		value;
+} strategies[] = {
+    {"default",		Z_DEFAULT_STRATEGY},
+    {"filtered",	Z_FILTERED},
+    {"huffman",		Z_HUFFMAN_ONLY},
+    {"rle",		Z_RLE},
+    {"fixed",		Z_FIXED},
+}, filters[] = {
+    {"none",		PNG_FILTER_NONE},
+    {"sub",		PNG_FILTER_SUB},
+    {"up",		PNG_FILTER_UP},
+    {"avg",		PNG_FILTER_AVG},
+    {"paeth",		PNG_FILTER_PAETH},
+    {"all",		PNG_ALL_FILTERS},
+};
+
+void encoder_init(encoder_settings *ep)
+/* set every encoder parameter to the library default */
+{
+    ep->level = ep->strategy = ep->window_bits = ep->mem_level = ENCODER_DEFAULT;
+    ep->filters = ENCODER_DEFAULT;
+    ep->idat_size = ENCODER_DEFAULT;
+}
+
+int encoder_strategy(const char *name)
+/* map a zlib strategy name to its value, or ENCODER_DEFAULT if unknown */
+{
+    int i;
+
+    for (i = 0; i < sizeof(strategies)/sizeof(strategies[0]); i++)
+	if (strcmp(strategies[i].name, name) == 0)
+	    return(strategies[i].value);
+    return(ENCODER_DEFAULT);
+}
+
+int encoder_filter(const char *name)
+/* map a row-filter name to its PNG_FILTER_* mask, or ENCODER_DEFAULT */
+{
+    int i;
+
+    for (i = 0; i < sizeof(filters)/sizeof(filters[0]); i++)
+	if (strcmp(filters[i].name, name) == 0)
+	    return(filters[i].value);
+    return(ENCODER_DEFAULT);
+}
+
+static void set_encoder(encoder_settings *ep)
+/* pass the non-default members of an encoder specification to libpng */
+{
+    if (ep->level != ENCODER_DEFAULT)
+	png_set_compression_level(png_ptr, ep->level);
+    if (ep->strategy != ENCODER_DEFAULT)
+	png_set_compression_strategy(png_ptr, ep->strategy);
+    if (ep->window_bits != ENCODER_DEFAULT)
+	png_set_compression_window_bits(png_ptr, ep->window_bits);
+    if (ep->mem_level != ENCODER_DEFAULT)
+	png_set_compression_mem_level(png_ptr, ep->mem_level);
+    if (ep->filters != ENCODER_DEFAULT)
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, ep->filters);
+    if (ep->idat_size != ENCODER_DEFAULT)
+	png_set_compression_buffer_size(png_ptr, ep->idat_size);
+}
+
+
+static void merge_encoder(encoder_settings *ep)
+/* collapse file and command-line settings into one, same precedence */
+{
+    *ep = file_encoder;
+    if (encoder.level != ENCODER_DEFAULT)
+	ep->level = encoder.level;
+    if (encoder.strategy != ENCODER_DEFAULT)
+	ep->strategy = encoder.strategy;
+    if (encoder.window_bits != ENCODER_DEFAULT)
+	ep->window_bits = encoder.window_bits;
+    if (encoder.mem_level != ENCODER_DEFAULT)
+	ep->mem_level = encoder.mem_level;
+    if (encoder.filters != ENCODER_DEFAULT)
+	ep->filters = encoder.filters;
+    if (encoder.idat_size != ENCODER_DEFAULT)
+	ep->idat_size = encoder.idat_size;
+}
+
+static void apply_encoder(void)
+/* settings from the SNG file first, so the command line can override them */
+{
+    set_encoder(&file_encoder);
+    set_encoder(&encoder);
+}
+
+static void merge_filters(encoder_settings *ep)
+/* merged settings, with the filters libpng would default to filled in */
+{
+    merge_encoder(ep);
+    if (ep->filters == ENCODER_DEFAULT)
+    {
+	if ((png_get_color_type(png_ptr, info_ptr) & PNG_COLOR_MASK_PALETTE)
+	    || png_get_bit_depth(png_ptr, info_ptr) < 8)
+	    ep->filters = PNG_FILTER_NONE;
+	else
+	    ep->filters = PNG_ALL_FILTERS;
+    }
+}
+
+static char *image_salt(void)
+/* everything besides the pixels that goes into the IDAT chunks */
+{
+    static char salt[BUFSIZ];
+    encoder_settings settings;
+    png_uint_32 width, height;
+    int bit_depth, color_type, interlace_type, num_palette = 0;
+    png_colorp palette;
+    png_color_8p sig_bit;
+    png_color_8 no_sig_bit;
+
+    merge_filters(&settings);
+    png_get_IHDR(png_ptr, info_ptr, &width, &height,
+		 &bit_depth, &color_type, &interlace_type, NULL, NULL);
+    png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette);
+    if (!png_get_sBIT(png_ptr, info_ptr, &sig_bit))
+    {
+	memset(&no_sig_bit, '\0', sizeof(no_sig_bit));
+	sig_bit = &no_sig_bit;
+    }
+    sprintf(salt, "sng %s/libpng %s/%s/%lu %lu %d %d %d %d/%d %d %d %d %d/"
+	    "%d %d %d %d %d %d %ld/%d %d",
+	    VERSION, png_get_libpng_ver(NULL), deflate_backend(),
+	    (unsigned long)width, (unsigned long)height, bit_depth,
+	    color_type, interlace_type, num_palette,
+	    sig_bit->red, sig_bit->green, sig_bit->blue, sig_bit->gray,
+	    sig_bit->alpha,
+	    write_transform_options, settings.level, settings.strategy,
+	    settings.window_bits, settings.mem_level, settings.filters,
+	    settings.idat_size, optimize, use_libpng);
+    return(salt);
+}
+
+static void choose_filters(void)
+/* pick row filters ourselves wherever libpng would use its heuristic */
+{
+    encoder_settings settings;
+
+    merge_filters(&settings);
+    /* libpng would pick the strategy from the filter of the first row */
+    if (filter_chooser_init(png_ptr, info_ptr, &chooser, settings.filters)
+	&& settings.strategy == ENCODER_DEFAULT)
+	png_set_compression_strategy(png_ptr, Z_FILTERED);
+}
+
 /*************************************************************************
  *
  * Token-parsing code
@@ -156,6 +325,12 @@ static int token_class;
 #define PUNCT_TOKEN	2
 #define WORD_TOKEN	3
 static bool pushed;
+static bool bol = TRUE;		/* is the next character at a line start? */
+
+/* the #SNG line starting the next image of a stream, minus its newline */
+static char next_header[BUFSIZ];
+static FILE *header_fp;		/* the stream it belongs to */
+static int header_line;		/* and the line it was on */
 
 static void escapes(cp, tp)
 /* process standard C-style escape sequences in a string */
@@ -226,26 +401,46 @@ static int get_token(void)
      */
     for (;;)
     {
+	int at_bol = bol;
+
 	w = fgetc(yyin);
 	if (w == '\n')
 	    linenum++;
+	bol = (w == '\n');
 	if (feof(yyin))
 	    return(FALSE);
 	else if (isspace(w) || w == ',' || w == ';' || w == ':')
 	    continue;
 	else if (w == '#')		/* comment */
 	{
+	    char *hp = next_header;
+
+	    *hp++ = w;
 	    for (;;)
 	    {
 		w = fgetc(yyin);
 		if (feof(yyin))
-		    return(FALSE);
+		    break;
 		if (w == '\n')
 		{
 		    ungetc(w, yyin);
 		    break;
 		}
+		if (hp < next_header + sizeof(next_header) - 1)
+		    *hp++ = w;
+	    }
+	    *hp = '\0';
+
+	    /* an #SNG line at the left margin starts another image */
+	    if (at_bol && strncmp(next_header, "#SNG", 4) == 0)
+	    {
+		header_fp = yyin;
+		header_line = linenum;
+		return(FALSE);
 	    }
+	    next_header[0] = '\0';
+	    if (feof(yyin))
+		return(FALSE);
 	}
 	else				/* non-space character */
 	{
@@ -253,6 +448,7 @@ static int get_token(void)
 	    break;
 	}
     }
+    bol = FALSE;
 
     /* accumulate token */
     if (w == '\'' || w == '"')
@@ -306,6 +502,7 @@ static int get_token(void)
 	    {
 		if (c == '\n')
 		    linenum++;
+		bol = (c == '\n');
 		break;
 	    }
 	    else if (ispunct(c) && c != '.')
@@ -469,7 +666,7 @@ static int keyword_validate(bool token_ok, char *stash)
 }
 
 static void collect_data(int *pnbytes, png_byte **pbytes)
-/* collect data in either bitmap format */
+/* collect data in either bitmap format, into the arena */
 {
     /*
      * A data segment consists of a byte stream. 
@@ -502,7 +699,7 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
      *
      * In either format, whitespace is ignored.
      */
-    png_byte *bytes = xalloc(MEMORY_QUANTUM);
+    png_byte *bytes = arena_alloc(MEMORY_QUANTUM);
     int quanta = 1;
     int	nbytes = 0;
     int ocount = 0;
@@ -518,11 +715,11 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
     else if (token_class == STRING_TOKEN)
     {
 	*pnbytes = 0;
-	*pbytes = NULL;
+	*pbytes = bytes;
 	do {
 	    int	seglen = strlen(token_buffer);
 
-	    *pbytes = xrealloc(*pbytes, *pnbytes + seglen);
+	    *pbytes = arena_grow(*pbytes, *pnbytes, *pnbytes + seglen);
 	    memcpy(*pbytes + *pnbytes, token_buffer, seglen);
 	    *pnbytes += seglen;	    
 	} while
@@ -588,7 +785,11 @@ static void collect_data(int *pnbytes, png_byte **pbytes)
 	    unsigned char	value = 0;
 
 	    if (nbytes >= quanta * MEMORY_QUANTUM)
-		bytes = xrealloc(bytes, MEMORY_QUANTUM * ++quanta);
+	    {
+		bytes = arena_grow(bytes, MEMORY_QUANTUM * quanta,
+				   MEMORY_QUANTUM * (quanta + 1));
+		quanta++;
+	    }
 
 	    switch(fmt)
 	    {
@@ -779,14 +980,12 @@ static void compile_IDAT(void)
     require_or_die("}");
 #ifndef PNG_INFO_IMAGE_SUPPORTED
     png_write_chunk(png_ptr, "IDAT", bits, nbits);
-    free(bits);
 #else
     memcpy(chunk.name, "IDAT", sizeof(chunk.name));
     chunk.data = bits;
     chunk.size = nbits;
     png_set_unknown_chunks(png_ptr, info_ptr, &chunk, 1);
 // TODO: also use png_set_unknown_chunk_location if libpng before 1.6.0
-    png_free(png_ptr, bits);
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 }
 
@@ -895,7 +1094,6 @@ static void compile_iCCP(void)
 
     png_set_iCCP(png_ptr, info_ptr, name, PNG_COMPRESSION_TYPE_BASE,
 		 data, data_len);
-    free(data);
 }
 
 static void compile_sBIT(void)
@@ -1578,7 +1776,6 @@ static void compile_gIFx(void)
 
 	    collect_data(&datalen, &data);
 	    memcpy(chunkdata + 11, data, datalen);
-	    free(data);
 	}
 	else
 	    fatal("invalid token `%s' in gIFx specification", token_buffer);
@@ -1597,7 +1794,6 @@ static void compile_IMAGE(void)
     png_byte	color_type = png_get_color_type(png_ptr, info_ptr);
     png_byte	bit_depth = png_get_bit_depth(png_ptr, info_ptr);
     int		doublewidth = bit_depth == 16 ? 2 : 1;
-    png_bytepp	row_pointers = 0;
     int		width = png_get_image_width(png_ptr, info_ptr);
     int		height = png_get_image_height(png_ptr, info_ptr);
 
@@ -1704,21 +1900,79 @@ static void compile_IMAGE(void)
 #endif
 #endif
 
-    row_pointers = (png_byte **)xalloc(sizeof(png_bytep) * height);
+    /* aligned rows for the encoders; the cache wants them as collected */
+    if (!image_alloc(&image, height, input_width))
+	fatal("out of memory");
     for (i = 0; i < height; i++)
-	row_pointers[i] = &bytes[i * input_width];
+	memcpy(image.rows[i], &bytes[i * input_width], input_width);
+    image_pixels = bytes;
+    image_size = nbytes;
 
 #ifndef PNG_INFO_IMAGE_SUPPORTED
     /* got the bits; now write them out */
-    png_write_image(png_ptr, row_pointers);
-    free(bytes);
-    free(row_pointers);
+    png_write_image(png_ptr, image.rows);
+    image_free(&image);
 #else
     /* got the bits; attach them to the info structure */
-    png_set_rows(png_ptr, info_ptr, row_pointers);
+    png_set_rows(png_ptr, info_ptr, image.rows);
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 }
 
+static void compile_encoder(void)
+/* parse encoder specification, stash settings until the image is written */
+{
+    while (get_inner_token())
+	if (token_equals("level"))
+	{
+	    file_encoder.level = byte_numeric(get_token());
+	    if (file_encoder.level > 9)
+		fatal("compression level must be 0-9");
+	}
+	else if (token_equals("strategy"))
+	{
+	    if (!get_token())
+		fatal("unexpected EOF");
+	    file_encoder.strategy = encoder_strategy(token_buffer);
+	    if (file_encoder.strategy == ENCODER_DEFAULT)
+		fatal("unknown compression strategy `%s'", token_buffer);
+	}
+	else if (token_equals("windowbits"))
+	{
+	    file_encoder.window_bits = byte_numeric(get_token());
+	    if (file_encoder.window_bits < 8 || file_encoder.window_bits > 15)
+		fatal("window bits must be 8-15");
+	}
+	else if (token_equals("memlevel"))
+	{
+	    file_encoder.mem_level = byte_numeric(get_token());
+	    if (file_encoder.mem_level < 1 || file_encoder.mem_level > 9)
+		fatal("memory level must be 1-9");
+	}
+	else if (token_equals("filters"))
+	{
+	    file_encoder.filters = 0;
+	    while (get_inner_token())
+	    {
+		int	filter = encoder_filter(token_buffer);
+
+		if (filter == ENCODER_DEFAULT)
+		    break;
+		file_encoder.filters |= filter;
+	    }
+	    if (!file_encoder.filters)
+		fatal("no filter names after `filters'");
+	    push_token();
+	}
+	else if (token_equals("idatsize"))
+	{
+	    file_encoder.idat_size = long_numeric(get_token());
+	    if (!file_encoder.idat_size)
+		fatal("IDAT size must be nonzero");
+	}
+	else
+	    fatal("invalid token `%s' in encoder specification", token_buffer);
+}
+
 static void compile_private(char *name)
 /* compile a private chunk */
 {
@@ -1741,29 +1995,232 @@ static void compile_private(char *name)
     chunk.location = PNG_HAVE_IHDR; // FIXME
     png_set_unknown_chunks(png_ptr, info_ptr, &chunk, 1);
 // TODO: also use png_set_unknown_chunk_location if libpng before 1.6.0
-    png_free(png_ptr, bytes);
+}
+
+void sngc_preload(void)
+/* load the color-name table now rather than at the first color name */
+{
+    initialize_hash(hash_by_cname, cname_hashbuckets, &cname_initialized);
+}
+
+/*************************************************************************
+ *
+ * Writing the image
+ *
+ ************************************************************************/
+
+#ifdef PNG_INFO_IMAGE_SUPPORTED
+static membuf image_png, image_idat;	/* on their way to or from the cache */
+static FILE *image_fp;
+
+static void splice_png(FILE *fout, membuf *idat)
+/* write the image with its IDAT chunks replaced by ready-made ones */
+{
+    splicer	sp;
+
+    /* the IDATs libpng produces now are thrown away, so be quick */
+    splice_init(&sp, fout, idat);
+    png_set_write_fn(png_ptr, &sp, splice_write, splice_flush);
+#ifdef PNG_WRITE_CUSTOMIZE_ZTXT_COMPRESSION_SUPPORTED
+    png_set_compression_level(png_ptr, 0);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+#endif /* PNG_WRITE_CUSTOMIZE_ZTXT_COMPRESSION_SUPPORTED */
+    png_write_png(png_ptr, info_ptr, write_transform_options, NULL);
+}
+
+static void release_png(void)
+/* free the PNG structures, the image and the arena, however far we got */
+{
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    image_free(&image);
+    arena_reset();
+}
+
+static void write_png(FILE *fout)
+/* write the image with whichever encoder suits it */
+{
+    if (optimize && properties[IMAGE].count)
+    {
+	encoder_settings	settings;
+	membuf			best;
+
+	merge_encoder(&settings);
+	if (optimize_idat(png_ptr, info_ptr, write_transform_options,
+			  &settings, &best))
+	{
+	    splice_png(fout, &best);
+	    xfree(best.data);
+	}
+	else
+	{
+	    choose_filters();
+	    png_write_png(png_ptr, info_ptr, write_transform_options, NULL);
+	}
+    }
+    else if (native_encodable(png_ptr, info_ptr, write_transform_options))
+    {
+	encoder_settings	settings;
+
+	merge_filters(&settings);
+	native_encode(png_ptr, info_ptr, fout, &settings);
+    }
+    else
+    {
+	choose_filters();
+	png_write_png(png_ptr, info_ptr, write_transform_options, NULL);
+    }
+}
+
+static void write_cached(FILE *fout)
+/* write the image using IDAT chunks from the cache, or add them to it */
+{
+    if (idat_cache_lookup(image_pixels, image_size,
+			  image_salt(), &image_idat))
+    {
+	/* only the metadata has changed since these pixels were compressed */
+	if (!native_splice(png_ptr, info_ptr, fout, &image_idat))
+	    splice_png(fout, &image_idat);
+    }
+    else
+    {
+	/* write to memory, so the IDAT chunks can be picked out */
+	image_fp = open_memstream((char **)&image_png.data, &image_png.size);
+	if (image_fp == NULL)
+	    fatal("out of memory");
+	png_init_io(png_ptr, image_fp);
+	write_png(image_fp);
+	fclose(image_fp);
+	image_fp = NULL;
+
+	extract_idat(&image_png, &image_idat);
+	idat_cache_store(&image_idat);
+	if (fwrite(image_png.data, 1, image_png.size, fout) != image_png.size)
+	    png_error(png_ptr, "Write Error");
+    }
+    membuf_free(&image_png);
+    membuf_free(&image_idat);
+}
+
+static void write_cleanup(void)
+/* drop whatever a failed write_cached() or write_png() left behind */
+{
+    native_cleanup();
+    if (image_fp)
+    {
+	fclose(image_fp);
+	image_fp = NULL;
+    }
+    membuf_free(&image_png);
+    membuf_free(&image_idat);
+}
+#endif /* PNG_INFO_IMAGE_SUPPORTED */
+
+/*************************************************************************
+ *
+ * Image boundaries
+ *
+ * An SNG stream may hold several images, each starting with a line
+ * beginning `#SNG' at the left margin.  The tokenizer stops when it sees
+ * one, and keeps it for the next call of sngc() on the same stream.
+ *
+ ************************************************************************/
+
+static char *read_header(FILE *fin)
+/* take the next line of fin as a header, leaving its newline unread */
+{
+    char *nl;
+
+    if (fgets(next_header, sizeof(next_header), fin) == NULL)
+	return(NULL);
+    if ((nl = strchr(next_header, '\n')) != NULL)
+    {
+	*nl = '\0';
+	ungetc('\n', fin);
+    }
+    header_fp = fin;
+    return(next_header);
+}
+
+char *sngc_header(FILE *fin)
+/* the #SNG line starting the next image on fin, or NULL at the end */
+{
+    if (header_fp == fin && next_header[0])
+	return(next_header);
+    next_header[0] = '\0';
+    bol = TRUE;
+    header_line = 1;
+    return(read_header(fin));
+}
+
+void sngc_done(FILE *fin)
+/* forget anything read ahead of fin, which is about to be closed */
+{
+    if (header_fp == fin)
+    {
+	header_fp = NULL;
+	next_header[0] = '\0';
+    }
+}
+
+void sngc_skip(FILE *fin)
+/* pass over the rest of an image that failed to compile */
+{
+    int c, at_bol = FALSE;
+
+    if (header_fp == fin && next_header[0])
+	return;
+    while ((c = fgetc(fin)) != EOF)
+    {
+	if (at_bol && c == '#')
+	{
+	    ungetc(c, fin);
+	    if (read_header(fin) && strncmp(next_header, "#SNG", 4) == 0)
+	    {
+		header_line = linenum;
+		return;
+	    }
+	    c = fgetc(fin);	/* usually the newline read_header() left */
+	}
+	if (c == '\n')
+	    linenum++;
+	at_bol = (c == '\n');
+    }
+    next_header[0] = '\0';
+}
+
+void sngc_pass(FILE *fin)
+/* pass over the next image without compiling it */
+{
+    if (header_fp == fin)
+	next_header[0] = '\0';	/* its header is used up */
+    sngc_skip(fin);
 }
 
 int sngc(FILE *fin, char *name, FILE *fout)
-/* compile SNG on fin to PNG on fout */
+/* compile the next SNG image on fin to PNG on fout */
 {
     int	prevchunk, errtype;
-    char buf[BUFSIZ];
+    char *header;
 
     yyin = fin;
     file = name;
-    linenum = 1;
 
-    if (fgets(buf, sizeof(buf), fin) == NULL)
+    if ((header = sngc_header(fin)) == NULL)
     {
 	fputs("sng: no data in file\n", stderr);
-	exit(1);
+	return(1);
     }
-    else if (strncmp("#SNG", buf, 3))
+    else if (strncmp("#SNG", header, 3))
     {
 	fputs("sng: this is not an sng file\n", stderr);
-	exit(1);
+	next_header[0] = '\0';	/* so sngc_skip() looks further */
+	return(1);
     }
+    linenum = header_line - 1;	/* numbered as it always was */
+    next_header[0] = '\0';
+    pushed = FALSE;
+    bol = FALSE;
+    PHASE_SET(PHASE_PARSE);
 
     /* Create and initialize the png_struct with the desired error handler
      * functions.  If you want to use the default stderr and longjump method,
@@ -1771,8 +2228,7 @@ int sngc(FILE *fin, char *name, FILE *fout)
      * the library version is compatible with the one used at compile time,
      * in case we are using dynamically linked libraries.  REQUIRED.
      */
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-				      (void *)NULL, NULL, NULL);
+    png_ptr = mem_create_write_struct(NULL);
 
     if (png_ptr == NULL)
 	return(2);
@@ -1789,8 +2245,12 @@ int sngc(FILE *fin, char *name, FILE *fout)
     if ((errtype = setjmp(png_jmpbuf(png_ptr)))) {
 	if (errtype == 1)
 	    fprintf(stderr, "%s:%d: libpng croaked\n", file, linenum);
-	free(png_ptr);
-	free(info_ptr);
+#ifdef PNG_INFO_IMAGE_SUPPORTED
+	write_cleanup();
+#endif /* PNG_INFO_IMAGE_SUPPORTED */
+	mem_subsystem = MEM_OTHER;
+	release_png();
+	filter_chooser_free(&chooser);
 	return errtype;
     }
 
@@ -1801,6 +2261,7 @@ int sngc(FILE *fin, char *name, FILE *fout)
     png_set_keep_unknown_chunks(png_ptr, 2, NULL, 0);
 
     write_transform_options = PNG_TRANSFORM_IDENTITY;
+    encoder_init(&file_encoder);
 
     /* initialize per-input-file chunk properties */
     for (chunkprops *pp = properties;
@@ -1822,6 +2283,7 @@ int sngc(FILE *fin, char *name, FILE *fout)
 	fatal("unknown chunk type `%s'", token_buffer);
 
     ok:
+	mem_subsystem = (pp - properties == IMAGE) ? MEM_PIXELS : MEM_TEXT;
 	if (!get_token())
 	    fatal("unexpected EOF");
 	if (!token_equals("{") && (pp - properties) != PRIVATE)
@@ -1860,7 +2322,10 @@ int sngc(FILE *fin, char *name, FILE *fout)
 	    /* force out the pre-IDAT portions */
 #ifndef PNG_INFO_IMAGE_SUPPORTED
 	    if (properties[IDAT].count == 0)
+	    {
+		apply_encoder();
 		png_write_info(png_ptr, info_ptr);
+	    }
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 	    compile_IDAT();
 	    break;
@@ -1984,12 +2449,22 @@ int sngc(FILE *fin, char *name, FILE *fout)
 	    /* force out the pre-IDAT portions */
 #ifndef PNG_INFO_IMAGE_SUPPORTED
 	    if (properties[IMAGE].count == 0)
+	    {
+		apply_encoder();
+		choose_filters();
 		png_write_info(png_ptr, info_ptr);
+	    }
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 	    compile_IMAGE();
 	    properties[IDAT].count++;
 	    break;
 
+	case ENCODER:
+	    if (properties[IDAT].count)
+		fatal("encoder specification must come before IDAT");
+	    compile_encoder();
+	    break;
+
 	case PRIVATE:
 	    compile_private(token_buffer);
 	    break;
@@ -2000,6 +2475,7 @@ int sngc(FILE *fin, char *name, FILE *fout)
 	prevchunk = (pp - properties);
 	pp->count++;
     }
+    mem_subsystem = MEM_OTHER;
 
     /* end-of-file sanity checks */
     linenum = EOF;
@@ -2014,16 +2490,64 @@ int sngc(FILE *fin, char *name, FILE *fout)
     /* It is REQUIRED to call this to finish writing the rest of the file */
     png_write_end(png_ptr, info_ptr);
 #else
-    png_write_png(png_ptr, info_ptr, write_transform_options, NULL);
+    apply_encoder();
+    PHASE_SET(PHASE_DEFLATE);		/* libpng filters as it deflates */
+    if (cache_dir && properties[IMAGE].count)
+	write_cached(fout);
+    else
+	write_png(fout);
 #endif /* PNG_INFO_IMAGE_SUPPORTED */
 
     /* if you malloced the palette, free it here */
     /* free(info_ptr->palette); */
 
     /* clean up after the write, and free any memory allocated */
-    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+    release_png();
+    filter_chooser_free(&chooser);
 
     return(0);
 }
 
+#ifdef SNG_MICROBENCH
+/*************************************************************************
+ *
+ * Entry points for sng_microbench, which times the kernels above on
+ * their own.  They exist only in its build, so the kernels stay static
+ * (and inlinable) in sng proper.
+ *
+ ************************************************************************/
+
+int bench_tokens(FILE *fp)
+/* tokenize fp to its end, returning the number of tokens */
+{
+    int n = 0;
+
+    yyin = fp;
+    pushed = FALSE;
+    bol = TRUE;
+    header_fp = NULL;
+    while (get_token())
+	n++;
+    return(n);
+}
+
+void bench_escapes(const char *cp, char *tp)
+{
+    escapes(cp, tp);
+}
+
+int bench_collect(FILE *fp, png_byte **pbytes)
+/* read one data segment from fp, returning its length */
+{
+    int nbytes;
+
+    yyin = fp;
+    pushed = FALSE;
+    bol = TRUE;
+    header_fp = NULL;
+    collect_data(&nbytes, pbytes);
+    return(nbytes);
+}
+#endif /* SNG_MICROBENCH */
+
 /* sngc.c ends here */
@@ -9,7 +9,14 @@ NAME
 #include <stdarg.h>
 #include <ctype.h>
 #include "config.h"	/* for RGBTXT */
+#include <unistd.h>
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif /* HAVE_MMAP */
 #include "png.h"
+#include "zlib.h"
 #include "sng.h"
 
 static char *image_type[] = {
@@ -34,6 +41,38 @@ static char *current_file;
 /* Error status for the file being processed; reset to 0 at the top of sngd() */
 static int sng_error;
 
+/* chunk framing seen on input, for reporting the encoder settings */
+static struct {
+    FILE	*fp;
+    png_uint_32	skip;		/* signature, data or CRC bytes to pass */
+    int		in_idat;	/* are we passing IDAT data? */
+    int		nheader;	/* bytes of chunk header collected */
+    png_byte	header[8];
+    int		nzlib;		/* bytes of zlib header collected */
+    png_byte	zlib[2];
+    int		idat_chunks;
+    png_uint_32	idat_first;
+
+    membuf	pending;	/* bytes to give libpng before reading more */
+    png_size_t	pending_pos;
+    int		native;		/* are we decoding the IDATs ourselves? */
+    membuf	zdata;		/* the IDAT data, all in one piece */
+    image_buffer image;		/* what we made of it, if anything */
+
+    png_bytep	map;		/* the whole input file, if we mapped it */
+    png_size_t	map_size;
+    png_size_t	map_pos;	/* where fp would be if we were reading it */
+    png_size_t	map_released;	/* pages before this are given back */
+
+    int		complete;	/* did we read the image through to IEND? */
+} input;
+
+/* how much mapped input to pass before giving pages back to the kernel */
+#define RELEASE_SIZE	(1024 * 1024)
+
+/* IDAT data read through stdio at a time, at first; then what we have */
+#define ZDATA_STEP	(64 * 1024)
+
 /*****************************************************************************
  *
  * Interface to RGB database
@@ -248,6 +287,402 @@ static void printerr(int err, const char *fmt, ... )
     sng_error = err;
 }
 
+/*****************************************************************************
+ *
+ * Input handling
+ *
+ *****************************************************************************/
+
+static void scan_input(png_bytep data, png_size_t length)
+/* follow the chunk framing of the bytes libpng has read */
+{
+    while (length)
+    {
+	if (input.skip)
+	{
+	    png_size_t n = length < input.skip ? length : input.skip;
+
+	    if (input.in_idat)
+		while (input.nzlib < 2 && n > 0 && input.skip > 4)
+		{
+		    input.zlib[input.nzlib++] = *data++;
+		    input.skip--;
+		    length--;
+		    n--;
+		}
+	    input.skip -= n;
+	    data += n;
+	    length -= n;
+	}
+	else
+	{
+	    input.header[input.nheader++] = *data++;
+	    length--;
+	    if (input.nheader == 8)
+	    {
+		png_uint_32 size = png_get_uint_32(input.header);
+
+		input.in_idat = !memcmp(input.header + 4, "IDAT", 4);
+		if (input.in_idat && !input.idat_chunks++)
+		    input.idat_first = size;
+		input.skip = size + 4;
+		input.nheader = 0;
+	    }
+	}
+    }
+}
+
+static void map_input(void)
+/* if the input is a regular file, map it rather than going through stdio */
+{
+#ifdef HAVE_MMAP
+    struct stat st;
+    off_t start = ftello(input.fp);
+    void *map;
+
+    if (start < 0 || fstat(fileno(input.fp), &st) != 0
+	|| !S_ISREG(st.st_mode) || st.st_size <= start
+	|| (png_size_t)st.st_size != st.st_size)
+	return;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(input.fp), 0);
+    if (map == MAP_FAILED)
+	return;
+#ifdef HAVE_MADVISE
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif /* HAVE_MADVISE */
+    input.map = map;
+    input.map_size = st.st_size;
+    input.map_pos = start;
+#endif /* HAVE_MMAP */
+}
+
+static void release_behind(void)
+/* let the kernel have back the mapped pages we are done with */
+{
+#if defined(HAVE_MMAP) && defined(HAVE_MADVISE)
+    png_size_t done = input.map_pos & ~(png_size_t)(sysconf(_SC_PAGESIZE) - 1);
+
+    if (input.map != NULL && done >= input.map_released + RELEASE_SIZE)
+    {
+	madvise(input.map + input.map_released, done - input.map_released,
+		MADV_DONTNEED);
+	input.map_released = done;
+    }
+#endif /* defined(HAVE_MMAP) && defined(HAVE_MADVISE) */
+}
+
+static png_bytep map_bytes(png_structp png_ptr, png_size_t length)
+/* the next length bytes of mapped input, where they lie */
+{
+    png_bytep data = input.map + input.map_pos;
+
+    if (input.map_size - input.map_pos < length)
+	png_error(png_ptr, "Read Error");
+    input.map_pos += length;
+    return(data);
+}
+
+static void read_bytes(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    if (input.map != NULL)
+	memcpy(data, map_bytes(png_ptr, length), length);
+    else if (fread(data, 1, length, input.fp) != length)
+	png_error(png_ptr, "Read Error");
+}
+
+static png_bytep add_zdata(png_size_t length)
+/* make room for length more bytes of IDAT data, and say where they go */
+{
+    if (input.zdata.size + length > input.zdata.room)
+    {
+	input.zdata.room = 2 * (input.zdata.size + length);
+	input.zdata.data = xrealloc(input.zdata.data, input.zdata.room);
+    }
+    input.zdata.size += length;
+    return(input.zdata.data + input.zdata.size - length);
+}
+
+static void queue_bytes(png_const_bytep data, png_size_t length)
+/* add to what libpng gets to see before we read any further */
+{
+    if (input.pending.size + length > input.pending.room)
+    {
+	input.pending.room = input.pending.size + length;
+	input.pending.data = xrealloc(input.pending.data, input.pending.room);
+    }
+    memcpy(input.pending.data + input.pending.size, data, length);
+    input.pending.size += length;
+}
+
+static void peek_input(png_bytep sig)
+/*
+ * Look at the IHDR before libpng does, to see if we can decode the image.
+ * If the caller has already read the signature, it is passed as sig.
+ */
+{
+    png_byte head[33];		/* signature, and IHDR with its CRC */
+    png_size_t n = 0, more;
+
+    if (sig != NULL)
+    {
+	memcpy(head, sig, 8);
+	n = 8;
+    }
+    if (input.map != NULL)
+    {
+	more = input.map_size - input.map_pos;
+	if (more > sizeof(head) - n)
+	    more = sizeof(head) - n;
+	memcpy(head + n, map_bytes(NULL, more), more);
+	n += more;
+    }
+    else
+	n += fread(head + n, 1, sizeof(head) - n, input.fp);
+
+    queue_bytes(head, n);
+    scan_input(head, n);
+    if (n == sizeof(head) && !png_sig_cmp(head, 0, 8)
+	&& png_get_uint_32(head + 8) == 13 && !memcmp(head + 12, "IHDR", 4)
+	&& native_decodable(png_get_uint_32(head + 16),
+			    png_get_uint_32(head + 20),
+			    head[24], head[25], head[28]))
+	input.native = TRUE;
+}
+
+static png_bytep read_zdata(png_uint_32 length)
+/*
+ * Read length more bytes of IDAT data through stdio, making room only as
+ * they arrive, so a lying chunk length costs no more than the input has.
+ * NULL if the input ends first; what did arrive is left on the end.
+ */
+{
+    png_size_t start = input.zdata.size, n, got;
+
+    while (input.zdata.size - start < length)
+    {
+	n = length - (input.zdata.size - start);
+	if (n > ZDATA_STEP && n > input.zdata.size)
+	    n = (input.zdata.size > ZDATA_STEP) ? input.zdata.size : ZDATA_STEP;
+	got = fread(add_zdata(n), 1, n, input.fp);
+	if (got != n)
+	{
+	    input.zdata.size -= n - got;
+	    return(NULL);
+	}
+    }
+    return(input.zdata.data + start);
+}
+
+static void give_back_idat(png_structp png_ptr, membuf *zp, png_bytep header,
+			   png_const_bytep tail, png_size_t ntail)
+/*
+ * Leave a damaged run of IDATs to libpng, whose diagnostics are the ones
+ * the user should see: the data collected so far as one chunk, then the
+ * chunk header we didn't like and any of its data we read, and nothing
+ * more from us after that.
+ */
+{
+    membuf chunk;
+
+    png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_AS_DEFAULT,
+				(png_bytep)"IDAT", 1);
+    if (zp->size > 0)
+    {
+	make_idat(zp, PNG_UINT_31_MAX, &chunk);
+	queue_bytes(chunk.data, chunk.size);
+	membuf_free(&chunk);
+    }
+    queue_bytes(header, 8);
+    if (ntail > 0)
+	queue_bytes(tail, ntail);
+    input.native = FALSE;
+}
+
+static void collect_idat(png_structp png_ptr, png_bytep header)
+/*
+ * Read the run of IDAT chunks starting with header and decode them.  If
+ * that works, libpng gets an empty IDAT in their place; otherwise it gets
+ * all the data in one chunk, to decode (or complain about) itself.
+ */
+{
+    static png_byte empty_idat[12] = {0, 0, 0, 0, 'I', 'D', 'A', 'T',
+				      0x35, 0xaf, 0x06, 0x1e};
+    png_uint_32 length = png_get_uint_32(header);
+    png_uint_32 width, height;
+    int bit_depth, color_type;
+    png_byte crc[4];
+    membuf chunk, view, before, *zp;
+    png_size_t start;
+
+    input.zdata.size = 0;
+    view.data = NULL;
+    while (!memcmp(header + 4, "IDAT", 4))
+    {
+	png_bytep data;
+
+	/* a length libpng would refuse, before we allocate for it */
+	if (length > PNG_UINT_31_MAX
+	    || (input.map != NULL && length > input.map_size - input.map_pos))
+	{
+	    give_back_idat(png_ptr, view.data != NULL ? &view : &input.zdata,
+			   header, NULL, 0);
+	    return;
+	}
+	if (!input.idat_chunks++)
+	    input.idat_first = length;
+	if (input.map != NULL && input.zdata.size == 0 && view.data == NULL)
+	{
+	    /* a lone IDAT can be decoded where it lies in the mapping */
+	    data = view.data = map_bytes(png_ptr, length);
+	    view.size = length;
+	}
+	else
+	{
+	    if (view.data != NULL)
+	    {
+		memcpy(add_zdata(view.size), view.data, view.size);
+		view.data = NULL;
+	    }
+	    start = input.zdata.size;
+	    if (input.map != NULL)
+		read_bytes(png_ptr, data = add_zdata(length), length);
+	    else if ((data = read_zdata(length)) == NULL)
+	    {
+		/* the input ended inside the chunk */
+		before = input.zdata;
+		before.size = start;
+		give_back_idat(png_ptr, &before, header, input.zdata.data + start,
+			       input.zdata.size - start);
+		return;
+	    }
+	}
+	read_bytes(png_ptr, crc, 4);
+	if (png_get_uint_32(crc) != chunk_crc(chunk_crc(0, header + 4, 4),
+					      data, length))
+	    png_error(png_ptr, "IDAT: CRC error");
+
+	read_bytes(png_ptr, header, 8);
+	length = png_get_uint_32(header);
+    }
+    zp = (view.data != NULL) ? &view : &input.zdata;
+    for (input.nzlib = 0; input.nzlib < 2 && input.nzlib < zp->size; input.nzlib++)
+	input.zlib[input.nzlib] = zp->data[input.nzlib];
+
+    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+		 NULL, NULL, NULL);
+    if (input.image.rows == NULL
+	&& native_decode(zp, width, height, color_type, &input.image))
+	queue_bytes(empty_idat, sizeof(empty_idat));
+    else
+    {
+	png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_AS_DEFAULT,
+				    (png_bytep)"IDAT", 1);
+	if (zp->size == 0)
+	    queue_bytes(empty_idat, sizeof(empty_idat));
+	else
+	{
+	    make_idat(zp, PNG_UINT_31_MAX, &chunk);
+	    queue_bytes(chunk.data, chunk.size);
+	    membuf_free(&chunk);
+	}
+    }
+
+    /* and the chunk that ended the run */
+    queue_bytes(header, 8);
+    input.skip = length + 4;
+}
+
+static void read_input(png_structp png_ptr, png_bytep data, png_size_t length)
+/* libpng read callback, so we can watch the chunks go by */
+{
+    int phase = PHASE_PUSH(PHASE_READ);
+
+    while (length)
+    {
+	png_size_t n;
+
+	if (input.pending_pos < input.pending.size)
+	{
+	    n = input.pending.size - input.pending_pos;
+	    if (n > length)
+		n = length;
+	    memcpy(data, input.pending.data + input.pending_pos, n);
+	    input.pending_pos += n;
+	    if (input.pending_pos == input.pending.size)
+		input.pending_pos = input.pending.size = 0;
+	}
+	else if (!input.native)
+	{
+	    n = length;
+	    read_bytes(png_ptr, data, n);
+	    scan_input(data, n);
+	}
+	else if (input.skip)
+	{
+	    n = length < input.skip ? length : input.skip;
+	    read_bytes(png_ptr, data, n);
+	    input.skip -= n;
+	}
+	else
+	{
+	    png_byte header[8];
+
+	    /* at a chunk boundary; it's only the IDATs we want */
+	    read_bytes(png_ptr, header, 8);
+	    if (!memcmp(header + 4, "IDAT", 4))
+		collect_idat(png_ptr, header);
+	    else
+	    {
+		queue_bytes(header, 8);
+		input.skip = png_get_uint_32(header) + 4;
+	    }
+	    continue;
+	}
+	data += n;
+	length -= n;
+    }
+    release_behind();
+    PHASE_SET(phase);
+}
+
+static int handle_idat(png_structp png_ptr, png_unknown_chunkp chunk)
+/* libpng user-chunk callback: the empty IDAT standing in for decoded data */
+{
+    return(!memcmp(chunk->name, "IDAT", 4));
+}
+
+static void release_input(void)
+{
+#ifdef HAVE_MMAP
+    if (input.map != NULL)
+    {
+	/* leave stdio where the next image, if any, begins */
+	fseeko(input.fp, input.map_pos, SEEK_SET);
+	munmap(input.map, input.map_size);
+    }
+    input.map = NULL;
+#endif /* HAVE_MMAP */
+    membuf_free(&input.pending);
+    membuf_free(&input.zdata);
+    image_free(&input.image);
+}
+
+static void dump_encoder(FILE *fpout)
+/* report, as a comment, the encoder settings we can infer from the IDATs */
+{
+    static char *level_hint[] = {"fastest", "fast", "default", "maximum"};
+
+    if (input.nzlib < 2 || (input.zlib[0] & 0x0f) != Z_DEFLATED)
+	return;
+
+    fprintf(fpout, "#encoder {windowbits: %d;", (input.zlib[0] >> 4) + 8);
+    if (input.idat_chunks > 1)
+	fprintf(fpout, " idatsize: %lu;", (unsigned long)input.idat_first);
+    fprintf(fpout, "}   # zlib level hint: %s, %d IDAT chunk%s\n",
+	    level_hint[input.zlib[1] >> 6],
+	    input.idat_chunks, input.idat_chunks == 1 ? "" : "s");
+}
+
 /*****************************************************************************
  *
  * Chunk handlers
@@ -928,7 +1363,10 @@ static void dump_unknown_chunks(int after_idat, FILE *fpout)
 void sngdump(png_byte *row_pointers[], FILE *fpout)
 /* dump a canonicalized SNG form of a PNG file */
 {
-    fprintf(fpout, "#SNG: from %s\n", current_file);
+    if (bundle)
+	fprintf(fpout, "#SNG: image %s\n", bundle_image);
+    else
+	fprintf(fpout, "#SNG: from %s\n", current_file);
 
     dump_IHDR(fpout);			/* first critical chunk */
 
@@ -961,22 +1399,31 @@ void sngdump(png_byte *row_pointers[], FILE *fpout)
     dump_tIME(fpout);
     dump_text(fpout);
 
+    if (encoder_comment)
+	dump_encoder(fpout);
+
     dump_image(row_pointers, fpout);	/* third critical chunk */
 
     dump_unknown_chunks(TRUE, fpout);
 }
 
-int sngd(FILE *fp, char *name, FILE *fpout)
-/* read and decompile an SNG image presented on stdin */
+void sngd_preload(void)
+/* load the color-name table now rather than at the first palette */
+{
+    initialize_hash(hash_by_rgb, rgb_hashbuckets, &rgb_initialized);
+}
+
+static int decompile(FILE *fp, char *name, FILE *fpout, png_bytep sig)
+/* decompile the PNG on fp, whose signature may already have been read */
 {
 #ifndef PNG_INFO_IMAGE_SUPPORTED
-    png_bytepp row_pointers;
-    png_uint_32 row;
     png_uint_32 height;
 #endif
 
    current_file = name;
    sng_error = 0;
+   input.complete = FALSE;
+   PHASE_SET(PHASE_PARSE);
 
    /* Create and initialize the png_struct with the desired error handler
     * functions.  If you want to use the default stderr and longjump method,
@@ -984,19 +1431,15 @@ int sngd(FILE *fp, char *name, FILE *fpout)
     * the compiler header file version, so that we know if the application
     * was compiled with a compatible version of the library.  REQUIRED
     */
-   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   png_ptr = mem_create_read_struct();
 
    if (png_ptr == NULL)
-   {
-      fclose(fp);
       return(1);
-   }
 
    /* Allocate/initialize the memory for image information.  REQUIRED. */
    info_ptr = png_create_info_struct(png_ptr);
    if (info_ptr == NULL)
    {
-      fclose(fp);
       png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
       return 1;
    }
@@ -1009,7 +1452,7 @@ int sngd(FILE *fp, char *name, FILE *fpout)
    {
       /* Free all of the memory associated with the png_ptr and info_ptr */
       png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-      fclose(fp);
+      release_input();
       /* If we get here, we had a problem reading the file */
       return(1);
    }
@@ -1024,10 +1467,48 @@ int sngd(FILE *fp, char *name, FILE *fpout)
    }
 
 
-   /* Set up the input control if you are using standard C streams */
-   png_init_io(png_ptr, fp);
-
+   /* Set up the input control; we want to watch the chunks go by */
+   memset(&input, '\0', sizeof(input));
+   input.fp = fp;
+   input.skip = 8;		/* the PNG signature */
+   PHASE_SET(PHASE_READ);
+   map_input();
+   peek_input(sig);
+   PHASE_SET(PHASE_PARSE);
+   png_set_read_fn(png_ptr, NULL, read_input);
 
+   if (input.native)
+   {
+       png_uint_32 height;
+       png_size_t rowbytes;
+
+       /* libpng will see one empty IDAT, if we can decode the real ones */
+       png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_NEVER,
+				   (png_byte *)"IDAT", 1);
+       png_set_read_user_chunk_fn(png_ptr, NULL, handle_idat);
+       png_read_info(png_ptr, info_ptr);
+
+       if (input.image.rows == NULL)
+       {
+	   /* no; it's back to libpng */
+	   png_read_update_info(png_ptr, info_ptr);
+	   height = png_get_image_height(png_ptr, info_ptr);
+	   rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+	   if (!image_alloc(&input.image, height, rowbytes))
+	       fatal("out of memory");
+	   PHASE_SET(PHASE_INFLATE);	/* libpng unfilters as it inflates */
+	   png_read_image(png_ptr, input.image.rows);
+	   PHASE_SET(PHASE_PARSE);
+       }
+
+       png_read_end(png_ptr, info_ptr);
+
+       /* dump the image */
+       PHASE_SET(PHASE_FORMAT);
+       sngdump(input.image.rows, fpout);
+   }
+   else
+   {
    /*
     * Unpack images with bit depth < 8 into bytes per sample.
     * We'll cheat, later on, by referring to png_ptr->bit_depth.
@@ -1037,9 +1518,11 @@ int sngd(FILE *fp, char *name, FILE *fpout)
     * will start failing on images of depth 1, 2, and 4.
     */
 #ifdef PNG_INFO_IMAGE_SUPPORTED
+   PHASE_SET(PHASE_INFLATE);	/* chunk parsing included */
    png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_PACKING, NULL);
 
    /* dump the image */
+   PHASE_SET(PHASE_FORMAT);
    sngdump(png_get_rows(png_ptr, info_ptr), fpout);
 #else
    png_set_packing(png_ptr);
@@ -1052,28 +1535,71 @@ int sngd(FILE *fp, char *name, FILE *fpout)
    png_read_update_info(png_ptr, info_ptr);
 
    height = png_get_image_height(png_ptr, info_ptr);
+   if (!image_alloc(&input.image, height, png_get_rowbytes(png_ptr, info_ptr)))
+       fatal("out of memory");
 
-   row_pointers = (png_bytepp)malloc(height * sizeof(png_bytep));
-   for (row = 0; row < height; row++)
-       row_pointers[row] = malloc(png_get_rowbytes(png_ptr, info_ptr));
-
-   png_read_image(png_ptr, row_pointers);
+   PHASE_SET(PHASE_INFLATE);
+   png_read_image(png_ptr, input.image.rows);
+   PHASE_SET(PHASE_PARSE);
 
    /* read rest of file, and get additional chunks in info_ptr - REQUIRED */
    png_read_end(png_ptr, info_ptr);
 
    /* dump the image */
-   sngdump(row_pointers, fpout);
+   PHASE_SET(PHASE_FORMAT);
+   sngdump(input.image.rows, fpout);
 #endif
+   }
 
    /* clean up after the read, and free any memory allocated - REQUIRED */
    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-
-   /* close the file */
-   fclose(fp);
+   release_input();
+   input.complete = TRUE;
 
    /* that's it; return this file's error status */
    return sng_error;
 }
 
+int sngd(FILE *fp, char *name, FILE *fpout)
+/* read and decompile a PNG image */
+{
+    int status = decompile(fp, name, fpout, NULL);
+
+    fclose(fp);
+    return(status);
+}
+
+int sngd_stream(FILE *fp, char *name, FILE *fpout)
+/*
+ * Decompile PNGs concatenated on fp into a stream of SNG images, as each
+ * arrives.  Anything after an IEND that isn't another PNG signature ends
+ * the stream, as it always ended a lone image.  After a damaged image
+ * there is no telling where the next begins, so we stop there too.
+ */
+{
+    png_byte sig[8];
+    int status = 0, n, s;
+
+    for (n = 0; n == 0 || input.complete; n++)
+    {
+	if (n > 0 && (fread(sig, 1, sizeof(sig), fp) != sizeof(sig)
+		      || png_sig_cmp(sig, 0, sizeof(sig))))
+	    break;
+	if ((s = decompile(fp, name, fpout, n > 0 ? sig : NULL)) > status)
+	    status = s;
+	fflush(fpout);
+    }
+    fclose(fp);
+    return(status);
+}
+
+#ifdef SNG_MICROBENCH
+/* for sng_microbench, which times multi_dump() on its own */
+void bench_multi_dump(FILE *fpout, char *leader,
+		      int width, int height, unsigned char *data[])
+{
+    multi_dump(fpout, leader, width, height, data);
+}
+#endif /* SNG_MICROBENCH */
+
 /* sngd.c ends here */
@@ -0,0 +1,433 @@
+/*****************************************************************************
+
+NAME
+   tar.c -- convert the members of a tar archive as it streams past.
+
+   `sng --tar' reads a tar archive on standard input and writes one on
+   standard output in which each .png member has become a .sng member
+   and each .sng member a .png one, under the same name but for the
+   extension, with the same modes, owners and times.  Everything else,
+   directories and links and other files alike, passes through as it
+   came.  A member that fails to convert is passed through unchanged,
+   after its error messages.
+
+   The converting is done by serve.c's workers, --jobs of them, each
+   forked with the color tables already loaded.  Members are handed out
+   as they arrive and written back in archive order, so the output is
+   the same whatever the number of workers.  Extended headers in the
+   POSIX (pax) and GNU long-name formats are understood and rewritten.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+#include "sng.h"
+
+#define BLOCK		512
+#define MAX_EXTENSIONS	8		/* extended headers on one member */
+
+#define NAME_FIELD	0		/* offsets of ustar header fields */
+#define SIZE_FIELD	124
+#define CHKSUM_FIELD	148
+#define TYPE_FIELD	156
+#define MAGIC_FIELD	257
+#define PREFIX_FIELD	345
+
+typedef struct
+{
+    unsigned char	header[BLOCK];
+    char		*data;		/* what follows the header, unpadded */
+    size_t		size;
+}
+record;
+
+typedef struct member
+{
+    record		ext[MAX_EXTENSIONS];	/* pax and long-name records */
+    int			next;
+    record		main;
+    char		*name;
+    int			sng2png;	/* or -1 to pass it through */
+    int			worker;		/* converting it, or -1 */
+    struct member	*later;
+}
+member;
+
+static member *first, *last;		/* waiting to be written */
+static int error_status;		/* 1 if any member failed to convert */
+static int archive_error;		/* the archive itself is damaged */
+
+/*************************************************************************
+ *
+ * Headers
+ *
+ ************************************************************************/
+
+static int checksum(unsigned char *header)
+/* a ustar header checksum, counting the checksum field as blanks */
+{
+    int i, sum = 0;
+
+    for (i = 0; i < BLOCK; i++)
+	sum += (i >= CHKSUM_FIELD && i < CHKSUM_FIELD + 8) ? ' ' : header[i];
+    return(sum);
+}
+
+static int get_size(unsigned char *header, size_t *size)
+/* read the size field, octal or GNU base-256; FALSE if it's garbage */
+{
+    unsigned char *cp = header + SIZE_FIELD;
+    int i;
+
+    *size = 0;
+    if (*cp & 0x80)
+    {
+	for (i = 1; i < 12; i++)
+	    *size = (*size << 8) | cp[i];
+	return(TRUE);
+    }
+    for (i = 0; i < 12 && cp[i] == ' '; i++)
+	continue;
+    for (; i < 12 && cp[i] >= '0' && cp[i] <= '7'; i++)
+	*size = (*size << 3) | (cp[i] - '0');
+    return(i == 12 || cp[i] == ' ' || cp[i] == '\0');
+}
+
+static void set_size(unsigned char *header, size_t size)
+/* write the size field and the checksum that goes with it */
+{
+    unsigned char *cp = header + SIZE_FIELD;
+    int i;
+
+    if (size < (1UL << 33))
+	sprintf((char *)cp, "%011lo", (unsigned long)size);
+    else
+    {
+	cp[0] = 0x80;
+	for (i = 11; i > 0; i--, size >>= 8)
+	    cp[i] = size & 0xff;
+    }
+    sprintf((char *)header + CHKSUM_FIELD, "%06o", checksum(header));
+    header[CHKSUM_FIELD + 7] = ' ';
+}
+
+static void rename_end(char *name, size_t len, int sng2png)
+/* swap the extension at the end of len bytes of name */
+{
+    if (len >= 4 && memcmp(name + len - 4, sng2png ? ".sng" : ".png", 4) == 0)
+	memcpy(name + len - 4, sng2png ? ".png" : ".sng", 4);
+}
+
+static char *pax_value(record *rp, const char *key, size_t *len)
+/* find a pax record by key; its value and length, or NULL */
+{
+    char *cp = rp->data, *end = rp->data + rp->size, *sp;
+    size_t keylen = strlen(key);
+    unsigned long n;
+
+    while (cp < end && (n = strtoul(cp, &sp, 10)) > 0 && *sp == ' '
+	   && n <= end - cp)
+    {
+	if (sp + keylen + 2 <= cp + n && memcmp(sp + 1, key, keylen) == 0
+	    && sp[1 + keylen] == '=')
+	{
+	    *len = cp + n - (sp + keylen + 2) - 1;
+	    return(sp + keylen + 2);
+	}
+	cp += n;
+    }
+    return(NULL);
+}
+
+static void pax_resize(record *rp, size_t size)
+/* change or leave out the size record of a pax header */
+{
+    char *cp = rp->data, *end = rp->data + rp->size, *sp, *out, *op;
+    unsigned long n;
+    char value[32];
+    int len, digits;
+
+    out = op = xalloc(rp->size + 64);
+    while (cp < end && (n = strtoul(cp, &sp, 10)) > 0 && *sp == ' '
+	   && n <= end - cp)
+    {
+	if (strncmp(sp + 1, "size=", 5) != 0)
+	{
+	    memcpy(op, cp, n);
+	    op += n;
+	}
+	else if (size >= (1UL << 33))
+	{
+	    /* the length counts its own digits */
+	    len = sprintf(value, "%lu", (unsigned long)size) + 7;
+	    for (digits = 1; sprintf(op, "%d", len + digits) != digits; digits++)
+		continue;
+	    op += sprintf(op, "%d size=%s\n", len + digits, value);
+	}
+	cp += n;
+    }
+    free(rp->data);
+    rp->data = out;
+    rp->size = op - out;
+    set_size(rp->header, rp->size);
+}
+
+/*************************************************************************
+ *
+ * Reading and writing
+ *
+ ************************************************************************/
+
+static int read_record(FILE *in, record *rp)
+/* read a header and its data; FALSE at the end of the archive */
+{
+    size_t padded;
+    int i;
+
+    memset(rp, '\0', sizeof(record));
+    if (fread(rp->header, 1, BLOCK, in) != BLOCK)
+    {
+	if (ferror(in))
+	    perror("sng: stdin");
+	else
+	    fputs("sng: stdin: tar archive ends early\n", stderr);
+	archive_error = TRUE;
+	return(FALSE);
+    }
+    for (i = 0; i < BLOCK && rp->header[i] == '\0'; i++)
+	continue;
+    if (i == BLOCK)
+	return(FALSE);			/* the trailer; we make our own */
+    if (strtol((char *)rp->header + CHKSUM_FIELD, NULL, 8) != checksum(rp->header)
+	|| !get_size(rp->header, &rp->size))
+    {
+	fputs("sng: stdin: not a tar archive\n", stderr);
+	archive_error = TRUE;
+	return(FALSE);
+    }
+
+    /* links and directories may claim a size, but have no data */
+    if (rp->header[TYPE_FIELD] == '1' || rp->header[TYPE_FIELD] == '2'
+	|| rp->header[TYPE_FIELD] == '5')
+	rp->size = 0;
+    padded = (rp->size + BLOCK - 1) / BLOCK * BLOCK;
+    rp->data = xalloc(padded + 1);
+    if (fread(rp->data, 1, padded, in) != padded)
+    {
+	fputs("sng: stdin: tar archive ends early\n", stderr);
+	free(rp->data);
+	rp->data = NULL;
+	archive_error = TRUE;
+	return(FALSE);
+    }
+    rp->data[rp->size] = '\0';
+    return(TRUE);
+}
+
+static void write_record(FILE *out, record *rp)
+/* write a header and its data, padded out to a block */
+{
+    static char zeros[BLOCK];
+
+    fwrite(rp->header, 1, BLOCK, out);
+    fwrite(rp->data, 1, rp->size, out);
+    if (rp->size % BLOCK)
+	fwrite(zeros, 1, BLOCK - rp->size % BLOCK, out);
+    free(rp->data);
+    rp->data = NULL;
+}
+
+static member *read_member(FILE *in)
+/* read the next member with its extended headers; NULL at the end */
+{
+    member *mp = xalloc(sizeof(member));
+    char *path, outfile[BUFSIZ];
+    size_t len;
+    int type, i;
+
+    mp->next = 0;
+    mp->worker = -1;
+    mp->later = NULL;
+    mp->name = NULL;
+    for (;;)
+    {
+	if (!read_record(in, &mp->main))
+	    break;
+	type = mp->main.header[TYPE_FIELD];
+	if (type != 'x' && type != 'L')
+	    break;
+	if (mp->next == MAX_EXTENSIONS)
+	{
+	    fputs("sng: stdin: too many extended headers\n", stderr);
+	    free(mp->main.data);
+	    mp->main.data = NULL;
+	    archive_error = TRUE;
+	    break;
+	}
+	mp->ext[mp->next++] = mp->main;
+    }
+    if (archive_error || mp->main.data == NULL)
+    {
+	for (i = 0; i < mp->next; i++)
+	    free(mp->ext[i].data);
+	free(mp);
+	return(NULL);
+    }
+
+    /* the last word on the name is the latest extended header */
+    for (i = 0; i < mp->next; i++)
+	if (mp->ext[i].header[TYPE_FIELD] == 'L')
+	    mp->name = xstrdup(mp->ext[i].data);
+	else if ((path = pax_value(&mp->ext[i], "path", &len)) != NULL)
+	{
+	    free(mp->name);
+	    mp->name = xalloc(len + 1);
+	    memcpy(mp->name, path, len);
+	    mp->name[len] = '\0';
+	}
+    if (mp->name == NULL)
+    {
+	char *hp = (char *)mp->main.header;
+
+	mp->name = xalloc(BLOCK);
+	if (memcmp(hp + MAGIC_FIELD, "ustar", 5) == 0 && hp[PREFIX_FIELD])
+	    sprintf(mp->name, "%.155s/%.100s", hp + PREFIX_FIELD, hp + NAME_FIELD);
+	else
+	    sprintf(mp->name, "%.100s", hp + NAME_FIELD);
+    }
+
+    type = mp->main.header[TYPE_FIELD];
+    if (type == '0' || type == '\0' || type == '7')
+	mp->sng2png = output_name(mp->name, outfile);
+    else
+	mp->sng2png = -1;
+    return(mp);
+}
+
+static void rename_member(member *mp, size_t size)
+/* give a converted member its new name and size */
+{
+    char *path;
+    size_t len;
+    int i;
+
+    for (i = 0; i < mp->next; i++)
+	if (mp->ext[i].header[TYPE_FIELD] == 'L')
+	    rename_end(mp->ext[i].data, strlen(mp->ext[i].data), mp->sng2png);
+	else
+	{
+	    if ((path = pax_value(&mp->ext[i], "path", &len)) != NULL)
+		rename_end(path, len, mp->sng2png);
+	    if (pax_value(&mp->ext[i], "size", &len) != NULL)
+		pax_resize(&mp->ext[i], size);
+	}
+    rename_end((char *)mp->main.header + NAME_FIELD,
+	       strnlen((char *)mp->main.header + NAME_FIELD, 100), mp->sng2png);
+    set_size(mp->main.header, size);
+}
+
+/*************************************************************************
+ *
+ * Handing out the work
+ *
+ ************************************************************************/
+
+static void finish_member(FILE *out, member *mp)
+/* write out the member at the head of the queue, converted or not */
+{
+    char *data = NULL;
+    size_t size = 0;
+    int i, status;
+
+    if (mp->worker >= 0)
+    {
+	status = pool_receive(mp->worker, &data, &size);
+	if (status < 0)
+	{
+	    fprintf(stderr, "sng: %s: the worker converting it died\n", mp->name);
+	    status = 1;
+	}
+	if (status == 0)
+	{
+	    rename_member(mp, size);
+	    free(mp->main.data);
+	    mp->main.data = data;
+	    mp->main.size = size;
+	}
+	else
+	{
+	    error_status = 1;		/* passed through; the archive is fine */
+	    free(data);
+	}
+    }
+    for (i = 0; i < mp->next; i++)
+	write_record(out, &mp->ext[i]);
+    write_record(out, &mp->main);
+    free(mp->name);
+    free(mp);
+}
+
+static void pop_queue(FILE *out)
+/* write out the member at the head of the queue */
+{
+    member *mp = first;
+
+    first = mp->later;
+    if (first == NULL)
+	last = NULL;
+    finish_member(out, mp);
+}
+
+static void convert_member(FILE *out, member *mp)
+/* hand a member to an idle worker, waiting for one if need be */
+{
+    if (verbose)
+    {
+	char outfile[BUFSIZ];
+
+	output_name(mp->name, outfile);
+	fprintf(stderr, "sng: converting %s to %s\n", mp->name, outfile);
+    }
+    /* when everyone's busy, the oldest piece of work frees someone up */
+    while ((mp->worker = pool_send("convert", mp->name,
+				   mp->main.data, mp->main.size)) < 0)
+    {
+	pop_queue(out);
+	while (first && first->worker < 0)
+	    pop_queue(out);
+    }
+}
+
+int tar_stream(FILE *in, FILE *out)
+/* convert the members of a tar archive; the exit status */
+{
+    static char trailer[2 * BLOCK];
+    member *mp;
+
+    pool_start();
+    while ((mp = read_member(in)) != NULL)
+    {
+	if (mp->sng2png >= 0)
+	    convert_member(out, mp);
+	if (last)
+	    last->later = mp;
+	else
+	    first = mp;
+	last = mp;
+	while (first && first->worker < 0)
+	    pop_queue(out);
+    }
+    while (first)
+	pop_queue(out);
+    fwrite(trailer, 1, sizeof(trailer), out);
+    if (fflush(out) != 0)
+    {
+	perror("sng: stdout");
+	archive_error = TRUE;
+    }
+    pool_stop();
+    return(archive_error ? 2 : error_status);
+}
+
+/* tar.c ends here */
@@ -0,0 +1,343 @@
+/*****************************************************************************
+
+NAME
+   timing.c -- where the time goes, for -T.
+
+   The conversion code marks the phases it goes through -- reading input,
+   parsing, inflating, unfiltering, formatting SNG, filtering, deflating
+   and writing output -- with PHASE_PUSH() and PHASE_SET().  Each mark
+   reads a monotonic clock and charges the time since the last one to
+   the phase being left, so nested phases are counted once, in the
+   innermost.  Where the kernel lets us open hardware counters, the
+   instructions, cycles and cache misses of this thread are charged the
+   same way.  Time outside any phase is reported as "other".
+
+   Some phases can't be told apart: when libpng decodes an image it
+   unfilters as it inflates, and when it encodes one it deflates as it
+   filters unless we choose the filters, so all of that goes to inflate
+   or deflate.  The compiler reads its input through stdio as it parses,
+   so that reading is parsing too.  Only the thread that called
+   timing_init() is timed; the marks optimize.c's trial threads pass
+   are ignored, and the time the main thread spends waiting for them
+   goes to whatever phase it was in.
+
+   One file gets a table on standard error.  Several get a JSON object
+   apiece, one to a line, then one more with the totals and the median
+   and 99th percentile of each phase over all the files, and the slowest
+   file for each, which is usually the one worth looking at.
+
+*****************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "png.h"
+#include "sng.h"
+#include "config.h"
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+int timing;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "other", "read", "parse", "inflate", "unfilter",
+    "format", "filter", "deflate", "write",
+};
+
+#define NCOUNTERS	3
+static const char *counter_names[NCOUNTERS] = {
+    "instructions", "cycles", "cache_misses",
+};
+
+typedef struct
+{
+    char	*name;
+    double	ms[PHASE_COUNT];
+    unsigned long long counts[PHASE_COUNT][NCOUNTERS];
+}
+file_times;
+
+static int json;			/* report as JSON lines */
+static int counting;			/* the hardware counters are open */
+static int current = PHASE_NONE;
+static struct timespec last;
+static unsigned long long last_counts[NCOUNTERS];
+
+static file_times *files;
+static int nfiles, files_room;
+static file_times *this_file;		/* the one being converted */
+static pthread_t timed_thread;		/* the one doing the converting */
+
+/*************************************************************************
+ *
+ * Hardware counters
+ *
+ ************************************************************************/
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static int counter_fds[NCOUNTERS];
+
+static int open_counter(unsigned long long config, int group)
+/* open one counter of this thread, in user space, in group */
+{
+    struct perf_event_attr pe;
+
+    memset(&pe, '\0', sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = config;
+    pe.disabled = (group == -1);
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    pe.read_format = PERF_FORMAT_GROUP;
+    return(syscall(__NR_perf_event_open, &pe, 0, -1, group, 0));
+}
+
+static void open_counters(void)
+/* open the counters if we may; if not, we do without */
+{
+    static const unsigned long long configs[NCOUNTERS] = {
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_CACHE_MISSES,
+    };
+    int i;
+
+    for (i = 0; i < NCOUNTERS; i++)
+	if ((counter_fds[i] = open_counter(configs[i],
+				       i ? counter_fds[0] : -1)) < 0)
+	{
+	    if (verbose)
+		fprintf(stderr, "sng: no hardware counters (%d)\n", errno);
+	    while (--i >= 0)
+		close(counter_fds[i]);
+	    return;
+	}
+    ioctl(counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    counting = TRUE;
+}
+
+static void read_counters(unsigned long long *counts)
+{
+    unsigned long long buf[1 + NCOUNTERS];
+
+    if (read(counter_fds[0], buf, sizeof(buf)) == sizeof(buf))
+	memcpy(counts, buf + 1, sizeof(buf) - sizeof(buf[0]));
+}
+#else
+static void open_counters(void)
+{
+}
+
+static void read_counters(unsigned long long *counts)
+{
+}
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+
+/*************************************************************************
+ *
+ * Phases
+ *
+ ************************************************************************/
+
+int phase_switch(int phase)
+/* charge the time since the last switch to the current phase; return it */
+{
+    struct timespec now;
+    unsigned long long counts[NCOUNTERS];
+    int i, was;
+
+    if (!pthread_equal(pthread_self(), timed_thread))
+	return(PHASE_NONE);		/* a trial thread; leave ours alone */
+    was = current;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (this_file)
+	this_file->ms[current] += (now.tv_sec - last.tv_sec) * 1000.0
+	    + (now.tv_nsec - last.tv_nsec) / 1e6;
+    last = now;
+    if (counting)
+    {
+	memcpy(counts, last_counts, sizeof(counts));
+	read_counters(counts);
+	for (i = 0; this_file && i < NCOUNTERS; i++)
+	    this_file->counts[current][i] += counts[i] - last_counts[i];
+	memcpy(last_counts, counts, sizeof(counts));
+    }
+    current = phase;
+    return(was);
+}
+
+void timing_init(int many)
+/* get ready to time files; many says to report them as JSON */
+{
+    json = many;
+    timed_thread = pthread_self();
+    open_counters();
+}
+
+static double total_ms(file_times *fp)
+{
+    double ms = 0;
+    int p;
+
+    for (p = 0; p < PHASE_COUNT; p++)
+	ms += fp->ms[p];
+    return(ms);
+}
+
+static void json_name(FILE *fp, char *name)
+/* a file name as a JSON string */
+{
+    putc('"', fp);
+    for (; *name; name++)
+	if (*name == '"' || *name == '\\')
+	    fprintf(fp, "\\%c", *name);
+	else if ((unsigned char)*name < ' ')
+	    fprintf(fp, "\\u%04x", *name);
+	else
+	    putc(*name, fp);
+    putc('"', fp);
+}
+
+static void report_file(file_times *fp)
+/* what one file cost, phase by phase */
+{
+    int p, i;
+
+    if (json)
+    {
+	fputs("{\"file\": ", stderr);
+	json_name(stderr, fp->name);
+	fprintf(stderr, ", \"total_ms\": %.3f", total_ms(fp));
+	for (p = 0; p < PHASE_COUNT; p++)
+	{
+	    fprintf(stderr, ", \"%s_ms\": %.3f", phase_names[p], fp->ms[p]);
+	    for (i = 0; counting && i < NCOUNTERS; i++)
+		fprintf(stderr, ", \"%s_%s\": %llu",
+			phase_names[p], counter_names[i], fp->counts[p][i]);
+	}
+	fputs("}\n", stderr);
+	return;
+    }
+
+    fprintf(stderr, "sng: %s took %.3f ms\n", fp->name, total_ms(fp));
+    fprintf(stderr, "    %-9s %10s %6s", "phase", "ms", "%");
+    if (counting)
+	fprintf(stderr, " %14s %14s %12s", "instructions", "cycles", "cache misses");
+    putc('\n', stderr);
+    for (p = 1; p <= PHASE_COUNT; p++)
+    {
+	int q = p % PHASE_COUNT;	/* other goes last */
+
+	if (fp->ms[q] == 0)
+	    continue;
+	fprintf(stderr, "    %-9s %10.3f %5.1f%%", phase_names[q], fp->ms[q],
+		100 * fp->ms[q] / total_ms(fp));
+	if (counting)
+	    fprintf(stderr, " %14llu %14llu %12llu", fp->counts[q][0],
+		    fp->counts[q][1], fp->counts[q][2]);
+	putc('\n', stderr);
+    }
+}
+
+void timing_start(char *name)
+/* begin timing a file, finishing with the last one if need be */
+{
+    timing_stop();
+    if (nfiles == files_room)
+	files = xrealloc(files, (files_room = 2 * files_room + 16)
+			 * sizeof(file_times));
+    this_file = &files[nfiles++];
+    memset(this_file, '\0', sizeof(file_times));
+    this_file->name = name;
+    current = PHASE_NONE;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    if (counting)
+	read_counters(last_counts);
+}
+
+void timing_stop(void)
+/* finish timing the current file and report on it */
+{
+    if (this_file == NULL)
+	return;
+    phase_switch(PHASE_NONE);
+    report_file(this_file);
+    this_file = NULL;
+}
+
+/*************************************************************************
+ *
+ * Summary
+ *
+ ************************************************************************/
+
+static int by_ms(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return((x > y) - (x < y));
+}
+
+static double percentile(double *ms, int n, int pct)
+/* the nearest-rank percentile of n sorted times */
+{
+    int rank = (pct * n + 99) / 100;
+
+    return(ms[rank > 0 ? rank - 1 : 0]);
+}
+
+static void summarize(const char *what, double *ms, char *slowest)
+/* the totals and percentiles of one phase, as JSON members */
+{
+    double sum = 0;
+    int i;
+
+    for (i = 0; i < nfiles; i++)
+	sum += ms[i];
+    qsort(ms, nfiles, sizeof(double), by_ms);
+    fprintf(stderr, ", \"%s_total_ms\": %.3f, \"%s_p50_ms\": %.3f, "
+	    "\"%s_p99_ms\": %.3f, \"%s_slowest\": ",
+	    what, sum, what, percentile(ms, nfiles, 50),
+	    what, percentile(ms, nfiles, 99), what);
+    if (slowest)
+	json_name(stderr, slowest);
+    else
+	fputs("null", stderr);
+}
+
+void timing_report(void)
+/* after a batch, the totals and percentiles for each phase */
+{
+    double *ms;
+    int p, i, slowest;
+
+    timing_stop();
+    if (!json || nfiles == 0)
+	return;
+
+    ms = xalloc(nfiles * sizeof(double));
+    fprintf(stderr, "{\"files\": %d", nfiles);
+    for (p = -1; p < PHASE_COUNT; p++)
+    {
+	for (slowest = i = 0; i < nfiles; i++)
+	{
+	    ms[i] = (p < 0) ? total_ms(&files[i]) : files[i].ms[p];
+	    if (ms[i] > ms[slowest])
+		slowest = i;
+	}
+	summarize(p < 0 ? "total" : phase_names[p], ms,
+		  ms[slowest] > 0 ? files[slowest].name : NULL);
+    }
+    fputs("}\n", stderr);
+    free(ms);
+}
+
+/* timing.c ends here */
@@ -0,0 +1,198 @@
+/*****************************************************************************
+
+NAME
+   verify.c -- round-trip regression testing, in process and in parallel.
+
+   `sng --verify FILE...' makes the checks sng_regress makes, without
+   the shell, the temporary files or the four execs per file.  A PNG is
+   decompiled, the SNG recompiled, the PNG that makes decompiled again
+   and that SNG compiled; the two PNGs compiled must be identical.  An
+   SNG file is compiled, decompiled, compiled and decompiled, and the two
+   SNGs decompiled must be identical.  Every step happens in memory, the
+   results are compared by content hash, and the files are shared among
+   serve.c's workers, --jobs of them, so the whole machine is busy.
+
+   A failure is reported on standard output in sng_regress's words, and
+   whatever sng said along the way goes to standard error, as it would
+   there.  With -v, each file that passes is listed with the time its
+   round trip took, and a summary follows.  The exit status is 1 if any
+   file failed.
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "png.h"
+#include "sng.h"
+
+typedef struct
+{
+    char	*data;
+    size_t	size;
+}
+stream;
+
+static int step(char *name, stream *in, stream *out)
+/* one conversion, memory to memory, in whichever direction in calls for */
+{
+    FILE *fpin, *fpout;
+    int status;
+
+    out->data = NULL;
+    out->size = 0;
+    if (in->size == 0)
+	return(1);			/* the last step made nothing */
+    if ((fpin = fmemopen(in->data, in->size, "r")) == NULL)
+	return(1);
+    if ((fpout = open_memstream(&out->data, &out->size)) == NULL)
+    {
+	fclose(fpin);
+	return(1);
+    }
+    status = convert_stream(fpin, name, fpout, FALSE);
+    fclose(fpout);
+    png_ptr = NULL;
+    info_ptr = NULL;
+    file = NULL;
+    return(status);
+}
+
+static int same(stream *a, stream *b)
+/* compare two results by their hashes */
+{
+    char ha[33], hb[33];
+
+    content_hash(a->data, a->size, "", ha);
+    content_hash(b->data, b->size, "", hb);
+    return(a->size == b->size && strcmp(ha, hb) == 0);
+}
+
+int verify_file(char *name, char *data, size_t len, FILE *fpout)
+/*
+ * Run the round trip on one file's contents, as a worker, writing any
+ * failure or, with -v, the time taken to fpout.  1 if the file failed.
+ */
+{
+    static const char *png_steps[] = {
+	"decompilation of the test PNG failed",
+	"recompilation of the decompiled form failed",
+	"generation of the canonicalized form failed",
+	"recompilation of the canonicalized form failed",
+    };
+    static const char *sng_steps[] = {
+	"compilation of the test SNG failed",
+	"generation of the canonicalized form failed",
+	"recompilation of the canonicalized form failed",
+	"decompilation of the canonicalized form failed",
+    };
+    const char **steps;
+    stream s[5];
+    struct timespec start, end;
+    int i, failed = FALSE;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* the direction goes by the data, as in pipe mode */
+    steps = (len > 0 && isprint((unsigned char)data[0])) ? sng_steps : png_steps;
+    memset(s, '\0', sizeof(s));
+    s[0].data = data;
+    s[0].size = len;
+
+    /* s[1] and s[3] are of one kind, s[2] and s[4] of the other */
+    for (i = 0; i < 4; i++)
+	if (step(name, &s[i], &s[i + 1]) != 0)
+	{
+	    fprintf(fpout, "%s: %s.\n", name, steps[i]);
+	    failed = TRUE;
+	    break;
+	}
+    if (!failed && !same(&s[2], &s[4]))
+    {
+	fprintf(fpout, "%s: decompiled and canonicalized versions differ.\n",
+		name);
+	failed = TRUE;
+    }
+    for (i = 1; i < 5; i++)
+	free(s[i].data);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (verbose && !failed)
+	fprintf(fpout, "%s: passed in %.1f ms\n", name,
+		(end.tv_sec - start.tv_sec) * 1000.0
+		+ (end.tv_nsec - start.tv_nsec) / 1e6);
+    return(failed);
+}
+
+/*************************************************************************
+ *
+ * Farming the files out
+ *
+ ************************************************************************/
+
+static int failures;
+
+static void finish(int w)
+/* pass on what a worker found */
+{
+    char *out;
+    size_t size;
+    int status = pool_receive(w, &out, &size);
+
+    if (status < 0)
+	failures++;			/* the worker said its piece as it died */
+    else
+    {
+	fwrite(out, 1, size, stdout);
+	fflush(stdout);
+	free(out);
+	failures += (status != 0);
+    }
+}
+
+int verify(int nfiles, char **files)
+/* round-trip every file, a worker's worth at a time, reporting in order */
+{
+    struct timespec start, end;
+    int *workers = xalloc((nfiles + 1) * sizeof(int));
+    int sent, done, tested = 0, w;
+    char outfile[BUFSIZ];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pool_start();
+    for (sent = done = 0; sent < nfiles; sent++)
+    {
+	workers[sent] = -1;
+	if (output_name(files[sent], outfile) < 0)
+	{
+	    /* nothing to wait for, so this one can't overtake the others */
+	    while (done < sent)
+		if (workers[done++] >= 0)
+		    finish(workers[done - 1]);
+	    printf("Non-PNG, non-SNG file `%s' ignored\n", files[sent]);
+	    fflush(stdout);
+	    continue;
+	}
+	while ((w = pool_send("verify", files[sent], files[sent],
+			      strlen(files[sent]))) < 0)
+	    if (workers[done++] >= 0)
+		finish(workers[done - 1]);
+	workers[sent] = w;
+	tested++;
+    }
+    for (; done < nfiles; done++)
+	if (workers[done] >= 0)
+	    finish(workers[done]);
+    pool_stop();
+    free(workers);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (verbose)
+	fprintf(stderr, "sng: verified %d files in %.2f s, %d failed\n",
+		tested, (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1e9, failures);
+    return(failures > 0);
+}
+
+/* verify.c ends here */
@@ -0,0 +1,302 @@
+/*****************************************************************************
+
+NAME
+   watch.c -- recompile SNG files as they change.
+
+   `sng --watch DIR...' watches the named directory trees, the current
+   one by default, and compiles each SNG file that is written or moved
+   into them to the PNG main() would make of it.  The trees are walked
+   once, at startup, to set up inotify watches; after that only events
+   are looked at, and a directory that appears later is walked when it
+   does.  Changes are collected until the events stop for a moment, so
+   an editor's burst of writes costs one compile, and the compiles are
+   shared among serve.c's workers with the color tables already loaded.
+   Each PNG is written under a temporary name and renamed into place,
+   so nothing watching it sees half an image.  The time taken for each
+   file is logged on standard output.
+
+*****************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "png.h"
+#include "sng.h"
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define DEBOUNCE	50		/* ms of quiet that ends a burst */
+#define MAX_DELAY	1000		/* ms a change may wait regardless */
+#define WATCHED		(IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+static int inotify_fd;
+static char **dirs;			/* watched directories by descriptor */
+static int ndirs;
+
+static char **pending;			/* changed files, in order of change */
+static int npending, pending_room;
+static struct timespec first_change;
+
+static volatile sig_atomic_t stopping;
+
+static double ms_since(struct timespec *then)
+/* milliseconds from then till now */
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return((now.tv_sec - then->tv_sec) * 1000.0
+	   + (now.tv_nsec - then->tv_nsec) / 1e6);
+}
+
+static void stop(int sig)
+{
+    stopping = sig;
+}
+
+/*************************************************************************
+ *
+ * Watching
+ *
+ ************************************************************************/
+
+static void touch(char *path)
+/* note a changed SNG file, once however often it changes */
+{
+    char outfile[BUFSIZ];
+    int i;
+
+    if (output_name(path, outfile) != TRUE)
+	return;
+    for (i = 0; i < npending; i++)
+	if (strcmp(pending[i], path) == 0)
+	    return;
+    if (npending == 0)
+	clock_gettime(CLOCK_MONOTONIC, &first_change);
+    if (npending == pending_room)
+	pending = xrealloc(pending, (pending_room = 2 * pending_room + 16)
+			   * sizeof(char *));
+    pending[npending++] = xstrdup(path);
+}
+
+static int watch_tree(char *path, int fresh)
+/* watch a directory and those under it; if fresh, its SNG files are new */
+{
+    struct dirent *dp;
+    struct stat st;
+    char sub[BUFSIZ];
+    DIR *dir;
+    int wd;
+
+    if ((wd = inotify_add_watch(inotify_fd, path, WATCHED | IN_ONLYDIR)) < 0)
+    {
+	fprintf(stderr, "sng: can't watch %s (%d)\n", path, errno);
+	return(FALSE);
+    }
+    if (wd >= ndirs)
+    {
+	dirs = xrealloc(dirs, (wd + 64) * sizeof(char *));
+	memset(dirs + ndirs, '\0', (wd + 64 - ndirs) * sizeof(char *));
+	ndirs = wd + 64;
+    }
+    else if (dirs[wd] != NULL)
+	return(TRUE);			/* seen it, under another name */
+    dirs[wd] = xstrdup(path);
+
+    if ((dir = opendir(path)) == NULL)
+	return(TRUE);
+    while ((dp = readdir(dir)) != NULL)
+    {
+	if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0
+	    || strlen(path) + strlen(dp->d_name) + 2 > sizeof(sub))
+	    continue;
+	strcat(strcat(strcpy(sub, path), "/"), dp->d_name);
+	if (dp->d_type == DT_DIR
+	    || (dp->d_type == DT_UNKNOWN && lstat(sub, &st) == 0
+		&& S_ISDIR(st.st_mode)))
+	    watch_tree(sub, fresh);
+	else if (fresh)
+	    touch(sub);
+    }
+    closedir(dir);
+    return(TRUE);
+}
+
+static void read_events(void)
+/* take in whatever inotify has for us */
+{
+    char buf[65536], path[BUFSIZ];
+    struct inotify_event *ev;
+    ssize_t n;
+    char *cp;
+
+    if ((n = read(inotify_fd, buf, sizeof(buf))) <= 0)
+	return;
+    for (cp = buf; cp < buf + n; cp += sizeof(*ev) + ev->len)
+    {
+	ev = (struct inotify_event *)cp;
+	if (ev->mask & IN_Q_OVERFLOW)
+	    fputs("sng: too many changes at once; some were missed\n", stderr);
+	if (ev->wd < 0 || ev->wd >= ndirs || dirs[ev->wd] == NULL)
+	    continue;
+	if (ev->mask & IN_IGNORED)
+	{
+	    free(dirs[ev->wd]);
+	    dirs[ev->wd] = NULL;
+	    continue;
+	}
+	if (ev->len == 0
+	    || strlen(dirs[ev->wd]) + strlen(ev->name) + 2 > sizeof(path))
+	    continue;
+	strcat(strcat(strcpy(path, dirs[ev->wd]), "/"), ev->name);
+	if (ev->mask & IN_ISDIR)
+	{
+	    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+		watch_tree(path, TRUE);
+	}
+	else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+	    touch(path);
+    }
+}
+
+/*************************************************************************
+ *
+ * Compiling
+ *
+ ************************************************************************/
+
+static void finish(char *infile, int w, struct timespec *start)
+/* put a worker's PNG in place, and log how long it took */
+{
+    char outfile[BUFSIZ], tmp[BUFSIZ + 16], *data;
+    size_t size;
+    int status;
+    FILE *fp;
+
+    output_name(infile, outfile);
+    if ((status = pool_receive(w, &data, &size)) < 0)
+	fprintf(stderr, "sng: %s: the worker compiling it died\n", infile);
+    else if (status == 0)
+    {
+	sprintf(tmp, "%s.%ld~", outfile, (long)getpid());
+	if ((fp = fopen(tmp, "w")) == NULL)
+	    status = errno;
+	else if (fwrite(data, 1, size, fp) != size)
+	{
+	    status = errno;
+	    fclose(fp);
+	}
+	else if (fclose(fp) != 0 || rename(tmp, outfile) != 0)
+	    status = errno;
+	if (status)
+	{
+	    fprintf(stderr, "sng: couldn't write %s (%d)\n", outfile, status);
+	    unlink(tmp);
+	}
+	free(data);
+    }
+    else
+	free(data);
+
+    if (status == 0)
+	printf("sng: compiled %s to %s in %.1f ms\n",
+	       infile, outfile, ms_since(start));
+    else
+	printf("sng: %s failed after %.1f ms\n", infile, ms_since(start));
+    fflush(stdout);
+}
+
+static void compile_pending(void)
+/* compile everything that changed, a worker's worth at a time */
+{
+    struct timespec *starts = xalloc(npending * sizeof(struct timespec));
+    int *workers = xalloc(npending * sizeof(int));
+    int sent, done, w;
+
+    for (sent = done = 0; sent < npending; sent++)
+    {
+	clock_gettime(CLOCK_MONOTONIC, &starts[sent]);
+	while ((w = pool_send("path", pending[sent], pending[sent],
+			      strlen(pending[sent]))) < 0)
+	{
+	    finish(pending[done], workers[done], &starts[done]);
+	    done++;
+	}
+	workers[sent] = w;
+    }
+    for (; done < npending; done++)
+	finish(pending[done], workers[done], &starts[done]);
+
+    for (done = 0; done < npending; done++)
+	free(pending[done]);
+    npending = 0;
+    free(starts);
+    free(workers);
+}
+
+int watch(int ndirectories, char **directories)
+/* recompile SNG files under the directories as they change, until killed */
+{
+    struct sigaction sa;
+    struct pollfd pfd;
+    int i, timeout, watching = FALSE;
+
+    if ((inotify_fd = inotify_init()) < 0)
+    {
+	perror("sng: inotify");
+	return(2);
+    }
+    if (ndirectories == 0)
+	watching = watch_tree(".", FALSE);
+    for (i = 0; i < ndirectories; i++)
+	watching |= watch_tree(directories[i], FALSE);
+    if (!watching)
+    {
+	close(inotify_fd);
+	return(2);			/* there would be nothing to wake us */
+    }
+
+    pool_start();
+    memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = stop;		/* no SA_RESTART, so poll wakes up */
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    pfd.fd = inotify_fd;
+    pfd.events = POLLIN;
+    while (!stopping)
+    {
+	if (npending == 0)
+	    timeout = -1;
+	else if ((timeout = MAX_DELAY - ms_since(&first_change)) > DEBOUNCE)
+	    timeout = DEBOUNCE;
+	if (npending && timeout <= 0)
+	    compile_pending();
+	else if (poll(&pfd, 1, timeout) > 0)
+	    read_events();
+	else if (npending && !stopping)
+	    compile_pending();
+    }
+
+    pool_stop();
+    close(inotify_fd);
+    return(0);
+}
+#else
+int watch(int ndirectories, char **directories)
+/* no inotify, no watching */
+{
+    fputs("sng: --watch needs inotify, which this system lacks\n", stderr);
+    return(2);
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* watch.c ends here */